@@ -0,0 +1,135 @@
+/*
+ * Random load generator of the Basic Disk-storage Server
+ *
+ * ./BDC_random <DiskServerAddress> <#port> <#requests> [#requests in flight]
+ */
+
+#include "BasicDisk.h"
+#include "ClientCore.h"
+
+// Read exactly len bytes from the socket
+int recv_all(int sockfd, char* buffer, size_t len) {
+    size_t received = 0;
+    while (received < len) {
+        int n = read(sockfd, buffer + received, len - received);
+        if (n <= 0) {
+            fprintf(stderr, "ERROR reading from socket\n");
+            exit(0);
+        }
+        received += n;
+    }
+    return received;
+}
+
+// Send the command header and payload bytes of data
+void send_request(int sockfd, Command* cmd, int payload) {
+    char* buffer = (char*)cmd;
+    size_t len = SIZE_CMD_BASIC + payload;
+    size_t sent = 0;
+    while (sent < len) {
+        int n = write(sockfd, buffer + sent, len - sent);
+        if (n < 0) {
+            fprintf(stderr, "ERROR writing to socket\n");
+            exit(0);
+        }
+        sent += n;
+    }
+}
+
+// Receive a response header and its payload into buffer
+void receive_reply(int sockfd, Response* header, char* buffer) {
+    recv_all(sockfd, (char*)header, SIZE_RESP_BASIC);
+    if (header->len > 0) {
+        recv_all(sockfd, buffer, header->len);
+    }
+}
+
+int generate_command(int n_cylinders, int n_sectors, Command* cmd, u_int32_t tag) {
+    int c = rand() % n_cylinders;
+    int s = rand() % n_sectors;
+    cmd->block_id = c * n_sectors + s;
+    cmd->tag = tag;
+
+    if (rand() % 2 == 0) {
+        cmd->type = CMD_R;
+        cmd->len = 0;
+        printf("R %d %d\n", c, s);
+        return 0;
+    }
+    cmd->type = CMD_W;
+    cmd->len = SECTOR_SIZE;
+    for (int i = 0; i < SECTOR_SIZE; i++) {
+        cmd->data[i] = ' ' + rand() % 95;
+    }
+    printf("W %d %d\n", c, s);
+    return SECTOR_SIZE;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 4 && argc != 5) {
+        fprintf(stderr, "Usage: %s <DiskServerAddress> <#port> <#requests> [#requests in flight]\n", argv[0]);
+        exit(1);
+    }
+    srand(time(NULL) ^ getpid());
+
+    int n_requests = atoi(argv[3]);
+    int depth = argc == 5 ? atoi(argv[4]) : 1;
+    if (depth < 1) {
+        depth = 1;
+    }
+    Command cmd;
+    Response header;
+    char response[MAX_BUF_SIZE];
+
+    // Connect to the server
+    int sockfd = connect_to(argv[1], atoi(argv[2]));
+
+    // Send the information request
+    cmd.type = CMD_I;
+    cmd.len = 0;
+    cmd.block_id = 0;
+    cmd.tag = 0;
+    send_request(sockfd, &cmd, 0);
+    receive_reply(sockfd, &header, response);
+    int n_cylinders = ((u_int16_t*)response)[0];
+    int n_sectors = ((u_int16_t*)response)[1];
+    printf("I\n%d %d\n", n_cylinders, n_sectors);
+
+    struct timeval startTime, endTime;
+    long run_time_in_microseconds;
+    int sent = 0, done = 0, failed = 0;
+
+    gettimeofday(&startTime, NULL);
+
+    // Generate random commands, keeping up to depth of them in flight
+    while (done < n_requests) {
+        while (sent < n_requests && sent - done < depth) {
+            int payload = generate_command(n_cylinders, n_sectors, &cmd, sent + 1);
+            send_request(sockfd, &cmd, payload);
+            sent++;
+        }
+        receive_reply(sockfd, &header, response);
+        if (header.status != 0) {
+            printf("%.*s", header.len, response);
+            failed++;
+        }
+        done++;
+    }
+
+    gettimeofday(&endTime, NULL);
+
+    // Send the exit command
+    cmd.type = CMD_E;
+    cmd.len = 0;
+    cmd.tag = sent + 1;
+    send_request(sockfd, &cmd, 0);
+    receive_reply(sockfd, &header, response);
+    printf("E\nExiting...\n");
+    close(sockfd);
+
+    run_time_in_microseconds = (endTime.tv_sec - startTime.tv_sec) * 1000000 + (endTime.tv_usec - startTime.tv_usec);
+    printf("Requests: %d, failed: %d\n", n_requests, failed);
+    printf("Time used: %ld microseconds.\n", run_time_in_microseconds);
+
+    return 0;
+}
@@ -1,154 +1,248 @@
 /*
  * Basic Disk-storage Server
  *
- * ./BDS <DiskFileName> <#cylinders> <#sector per cylinder> <track-to-track delay> <#port>
+ * ./BDS <DiskFileName> <#cylinders> <#sector per cylinder> <track-to-track delay> <#port> [FCFS|SSTF|SCAN|CLOOK]
+ *
+ * Requests pipelined by the clients are received by a thread per connection into one shared queue,
+ * and served by the arm thread in the order chosen by the scheduling policy.
+ * The responses are written by a sender thread per connection, a client not reading never stalls the arm
  */
 
 #include "BasicDisk.h"
+#include "DiskQueue.h"
 #include "ServerCore.h"
 
-void disk_loop(BasicDisk* disk, int id) {
-    char command[MAX_BUF_SIZE];
+typedef struct Connection {
+    BasicDisk disk;
+    DiskQueue* queue;
+    Outbox outbox;
+    int id;
+} Connection;
+
+void serve_request(BasicDisk* disk, DiskQueue* queue, DiskRequest* req, int* order) {
+    Command* cmd = &req->cmd;
+    int cylinder = cmd->block_id / disk->n_sectors;
+    int sector = cmd->block_id % disk->n_sectors;
+
+    switch (cmd->type) {
+        case CMD_I:
+            info(disk, cmd->tag);
+            break;
 
-    while (1) {
-        int nbytes = read(disk->socket_fd, command, MAX_BUF_SIZE - 1);
-        if (nbytes < 0) {
-            perror("read");
-            exit(-1);
-        } else if (nbytes == 0) {
-            printf("Client %d disconnected\n", id);
-            close(disk->socket_fd);
+        case CMD_R:
+            read_sector(disk, cmd->tag, cylinder, sector);
             break;
-        }
-        Command* cmd = (Command*)command;
-        printf("Received command: %d, len: %d, block_id: %d\n", cmd->type, cmd->len, cmd->block_id);
 
-        int cylinder = cmd->block_id / disk->n_sectors;
-        int sector = cmd->block_id % disk->n_sectors;
+        case CMD_W:
+#ifdef _DEBUG
+            for (int i = 0; i < cmd->len; i++) {
+                int d = cmd->data[i];
+                printf("%d ", d);
+            }
+            printf("\n");
+#endif
+            write_sector(disk, cmd->tag, cylinder, sector, cmd->len, cmd->data);
+            break;
 
-        switch (cmd->type) {
-            case CMD_I:
-                info(disk);
-                break;
+        case CMD_RV:
+            read_sectors(disk, cmd->tag, cmd->len, (u_int32_t*)cmd->data, order);
+            break;
 
-            case CMD_R:
-                read_sector(disk, cylinder, sector);
-                break;
+        case CMD_WV:
+            write_sectors(disk, cmd->tag, cmd->len, (u_int32_t*)cmd->data, req->data, order);
+            break;
 
-            case CMD_W:
-#ifdef _DEBUG
-                for (int i = 0; i < cmd->len; i++) {
-                    int d = cmd->data[i];
-                    printf("%d ", d);
-                }
-                printf("\n");
-#endif
-                write_sector(disk, cylinder, sector, cmd->len, cmd->data);
-                break;
+        case CMD_E:
+            queue_flush(disk, queue);
+            respond(disk, cmd->tag, CMD_E, 0, NULL, 0);
+            break;
 
-            case CMD_E:
-                write_to_socket(disk, "", 1);
-                close(disk->socket_fd);
-                exit(0);
-                break;
+        default:
+            respond_error(disk, cmd->tag, cmd->type, "Invalid command\n");
+            break;
+    }
+}
 
-            case CMD_S:
-                write_to_socket(disk, "", 1);
-                break;
+// Serve the requests of all the connections, one at a time
+void* arm_thread(void* arg) {
+    Connection* arm = (Connection*)arg;
+    DiskQueue* queue = arm->queue;
+    int order[MAX_VEC_SECTORS];
+    DiskRequest req;
 
-            default:
-                write_to_socket(disk, "Invalid command\n", 17);
-                fprintf(stderr, "Invalid command: %s\n", command);
-                break;
+    while (1) {
+        queue_next(&arm->disk, queue, &req);
+        queue_order(&arm->disk, queue, &req, order);
+        serve_request(req.disk, queue, &req, order);
+        queue_done(queue, &req);
+    }
+    return NULL;
+}
+
+// Write the responses of a client until its connection ends
+void* sender_thread(void* arg) {
+    Connection* conn = (Connection*)arg;
+    send_outbox(&conn->disk);
+    return NULL;
+}
+
+// Receive the requests of a client until it exits
+void* connection_thread(void* arg) {
+    Connection* conn = (Connection*)arg;
+    BasicDisk* disk = &conn->disk;
+    init_outbox(&conn->outbox);
+    disk->outbox = &conn->outbox;
+    pthread_t sender;
+    if (pthread_create(&sender, NULL, sender_thread, conn) != 0) {
+        perror("pthread_create");
+        // Answered by the arm directly
+        disk->outbox = NULL;
+    }
+
+    while (1) {
+        // A client not reading its responses is not read either
+        if (disk->outbox != NULL) {
+            outbox_wait_room(disk);
         }
+        u_int16_t type;
+        int nbytes = queue_receive(disk, conn->queue, &type);
+        if (nbytes < 0) {
+            perror("read");
+            queue_drop(conn->queue, disk);
+            break;
+        } else if (nbytes == 0) {
+            printf("Client %d disconnected\n", conn->id);
+            queue_drop(conn->queue, disk);
+            break;
+        } else if (type == CMD_E) {
+            printf("Client %d exited\n", conn->id);
+            break;
+        }
+    }
+    queue_wait_idle(conn->queue, disk);
+    if (disk->outbox != NULL) {
+        close_outbox(disk);
+        pthread_join(sender, NULL);
+        disk->outbox = NULL;
     }
+    destroy_outbox(&conn->outbox);
+    close(disk->socket_fd);
+    // Written sectors are kept even if the client left without syncing
+    sync_disk(disk);
+    print_seek_stats(disk, conn->queue);
+    free(conn);
+    return NULL;
 }
 
 int main(int argc, char* argv[]) {
-    if (argc != 6) {
-        fprintf(stderr, "Usage: %s <DiskFileName> <#cylinders> <#sector per cylinder> <#track-to-track delay> <#port>\n", argv[0]);
+    if (argc != 6 && argc != 7) {
+        fprintf(stderr, "Usage: %s <DiskFileName> <#cylinders> <#sector per cylinder> <#track-to-track delay> <#port> [FCFS|SSTF|SCAN|CLOOK]\n", argv[0]);
         exit(1);
     }
 
+    int policy = argc == 7 ? parse_policy(argv[6]) : SCHED_FCFS;
+    if (policy < 0) {
+        fprintf(stderr, "Unknown scheduling policy: %s\n", argv[6]);
+        exit(1);
+    }
+    DiskQueue queue;
+    init_queue(&queue, policy);
+
     BasicDisk disk;
     disk.n_cylinders = atoi(argv[2]);
     disk.n_sectors = atoi(argv[3]);
     disk.track_to_track_delay = atoi(argv[4]);
-    disk.current_track = 0;
+    disk.socket_fd = -1;
+    disk.pending = 0;
+    disk.outbox = NULL;
 
     init_disk(argv[1], &disk);
 
     int port = atoi(argv[5]);
-    int master_socket, addrlen, client_socket, activity, status;
+    int master_socket, addrlen, activity;
+    int n_clients = 0;
     struct sockaddr_in address;
 
-    // char buffer[MAX_COMMAND];
-    pid_t child_pid;
-
     // Set of socket descriptors
-    fd_set readfds, controlfds;
-    struct timeval timeout = {0, 250000};
+    fd_set readfds;
 
-    // 0 refers to unconnected socket and child pid
-    client_socket = 0;
-    child_pid = 0;
+    // A client leaving must not kill the server
+    signal(SIGPIPE, SIG_IGN);
 
     master_socket = init_server(&address, port);
 
+    // Start the arm
+    Connection arm;
+    arm.disk = disk;
+    arm.queue = &queue;
+    arm.id = -1;
+    pthread_t arm_tid;
+    if (pthread_create(&arm_tid, NULL, arm_thread, &arm) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+    pthread_detach(arm_tid);
+
     // Accept the incoming connection
     addrlen = sizeof(address);
-    printf("Waiting for connections ... \n");
-
-    // Listen to the socket
-    listen(master_socket, 3);
+    printf("Waiting for connections ... (%s scheduling)\n", policy_name(queue.policy));
 
     while (1) {
-        // Clear the socket set
+        // Wait for a new connection or a command from stdin
         FD_ZERO(&readfds);
-
-        // Add master socket to set
         FD_SET(master_socket, &readfds);
+        FD_SET(STDIN_FILENO, &readfds);
+
+        activity = select(master_socket + 1, &readfds, NULL, NULL, NULL);
+        if (activity < 0) {
+            if (errno != EINTR) {
+                perror("select");
+            }
+            continue;
+        }
 
-        // Wait for an activity on the sockets
-        activity = select(master_socket + 1, &readfds, NULL, NULL, &timeout);
-        if ((activity < 0) && (errno != EINTR)) {
-            perror("select");
+        // Check if the server should exit
+        if (FD_ISSET(STDIN_FILENO, &readfds)) {
+            char buffer[MAX_BUF_SIZE];
+            int nbytes = read(STDIN_FILENO, buffer, MAX_BUF_SIZE);
+            if (nbytes <= 0 || strncmp(buffer, "exit", 4) == 0) {
+                fprintf(stdout, "Exiting...\n");
+                break;
+            }
         }
 
         // Process new connection
-        if (FD_ISSET(master_socket, &readfds) && client_socket == 0) {
+        if (FD_ISSET(master_socket, &readfds)) {
             int new_socket = accept_new(master_socket, &address, &addrlen);
+            if (new_socket < 0) {
+                continue;
+            }
 
-            disk.socket_fd = new_socket;
-
-            // Add new socket to array of sockets
-            int i = 0;
-            client_socket = new_socket;
-            printf("Adding to list of sockets as %d\n", i);
+            Connection* conn = (Connection*)malloc(sizeof(Connection));
+            if (conn == NULL) {
+                perror("malloc");
+                close(new_socket);
+                continue;
+            }
+            conn->disk = disk;
+            conn->disk.socket_fd = new_socket;
+            conn->queue = &queue;
+            conn->id = n_clients++;
+            printf("Adding to list of sockets as %d\n", conn->id);
 
             // Start processing the new connection
-            pid_t pid = fork();
-            if (pid == 0) {
-                // Child process
-                disk_loop(&disk, i);
-                exit(0);
-            } else if (pid < 0) {
-                perror("fork");
-                exit(-1);
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, connection_thread, conn) != 0) {
+                perror("pthread_create");
+                close(new_socket);
+                free(conn);
+                continue;
             }
-            child_pid = pid;
-        }
-
-        if (child_pid != 0 && waitpid(child_pid, &status, WNOHANG) != 0) {
-            printf("Child process terminated, status = %d\n", status);
-            disconnect(&client_socket, &child_pid, status);
+            pthread_detach(thread);
         }
-
-        // Check if the server should exit
-        check_exit(&controlfds, &client_socket, &child_pid);
     }
 
-    dystroy_disk(&disk);
-
-    return 0;
-}
\ No newline at end of file
+    // Keep the sectors written by the clients still connected
+    sync_disk(&disk);
+    exit(0);
+}
@@ -1,6 +1,69 @@
 #include "FileServer.h"
 #include <fcntl.h>
 
+#define FC_PIPELINE 16   // Commands of a script sent ahead of their responses
+#define FC_ECHO_SIZE 80  // Bytes of a command echoed
+
+// Commands sent and not answered yet, each echoed just before its response
+typedef struct Pipeline {
+    u_int32_t sent;      // Sequence number of the last command sent
+    u_int32_t echoed;    // Last command echoed
+    u_int32_t answered;  // Last command whose prompt came back
+    bool prompted;       // The first prompt came back
+    char lines[FC_PIPELINE][FC_ECHO_SIZE];
+} Pipeline;
+
+// Echo the commands sent up to seq
+void echo_commands(Pipeline* pipeline, u_int32_t seq) {
+    while (pipeline->echoed < seq && pipeline->echoed < pipeline->sent) {
+        pipeline->echoed++;
+        printf("%s", pipeline->lines[pipeline->echoed % FC_PIPELINE]);
+    }
+}
+
+// Print the frames already received, return false if the server is gone
+bool handle_frames(User* user, Pipeline* pipeline, char* response) {
+    while (fs_frame_ready(user)) {
+        FrameHeader header;
+        int nbytes = fs_recv_frame(user, &header, response);
+        if (nbytes < 0) {
+            return false;
+        }
+        response[nbytes] = '\0';
+        echo_commands(pipeline, header.seq);
+        if (header.type == FRAME_PROMPT) {
+            if (header.seq > pipeline->answered) {
+                pipeline->answered = header.seq;
+            }
+            pipeline->prompted = true;
+            strcpy(user->path, response);
+        } else if (header.type == FRAME_FLUSH) {
+            printf("\033[1;33mWarning:\033[0m Current path no longer exists\n");
+        }
+        printf("%s", response);
+        fflush(stdout);
+    }
+    return true;
+}
+
+// Block until the server sends more, then print it
+bool wait_frames(User* user, Pipeline* pipeline, char* response) {
+    if (fs_read_frames(user) < 0) {
+        return false;
+    }
+    return handle_frames(user, pipeline, response);
+}
+
+// Block until every command sent is answered
+bool drain_frames(User* user, Pipeline* pipeline, char* response) {
+    while (pipeline->answered < pipeline->sent) {
+        if (!wait_frames(user, pipeline, response)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 int main(int argc, char* argv[]) {
     if (argc < 4 && argc > 6) {
         fprintf(stderr, "Usage: %s <File-systemServerAddress> <#port> <username> [passwd] [cmdFile]\n", argv[0]);
@@ -26,10 +89,12 @@ int main(int argc, char* argv[]) {
 
     // Connect to the server
     int sockfd = connect_to(argv[1], atoi(argv[2]));
-    int activity, nbytes;
+    int activity;
 
     User user;
     user.sockfd = sockfd;
+    FrameBuffer rx;
+    fs_init_frames(&user, &rx, NULL);
     strcpy(user.username, argv[3]);
     sprintf(user.path, "\n\033[1;32mFileServer\033[0m:\033[1;34mhome/%s\033[0m$ ", argv[3]);
 
@@ -49,39 +114,67 @@ int main(int argc, char* argv[]) {
     }
 
     fd_set controlfds;
-    struct timeval timeout = {0, 500000};
+    Pipeline pipeline;
+    pipeline.sent = 0;
+    pipeline.echoed = 0;
+    pipeline.answered = 0;
+    pipeline.prompted = false;
+    bool connected = true;
 
-    while (1) {
+    while (connected) {
         FD_ZERO(&controlfds);
         FD_SET(sockfd, &controlfds);
         if (!is_file) {
             FD_SET(STDIN_FILENO, &controlfds);
         }
 
+        // A script sends ahead without waiting while the pipeline has room
+        bool room = is_file && operatable && pipeline.sent - pipeline.answered < FC_PIPELINE;
+        struct timeval timeout = {0, room ? 0 : 500000};
         activity = select(sockfd + 1, &controlfds, NULL, NULL, &timeout);
 
-        if (operatable && (is_file || (activity > 0 && FD_ISSET(STDIN_FILENO, &controlfds)))) {
+        if (room || (operatable && activity > 0 && FD_ISSET(STDIN_FILENO, &controlfds))) {
             char* ch = fgets(cmd, MAX_BUF_SIZE, file);
             if (ch == NULL) {
+                drain_frames(&user, &pipeline, response);
                 break;
             } else if (cmd[0] == '\n') {
+                connected = drain_frames(&user, &pipeline, response);
                 printf("%s", user.path);
                 fflush(stdout);
                 continue;
             }
+            // Echoed with the response, the command is cut by the parser
+            char echo[FC_ECHO_SIZE];
+            echo[0] = '\0';
             if (is_file) {
-                printf("%.48s", cmd);
                 int cmd_len = strlen(cmd);
+                int echo_len = snprintf(echo, FC_ECHO_SIZE, "%.48s", cmd);
                 if (cmd_len > 50) {
-                    printf("...(%d bytes more)\n", cmd_len - 50);
+                    snprintf(echo + echo_len, FC_ECHO_SIZE - echo_len, "...(%d bytes more)\n", cmd_len - 50);
                 }
-                usleep(250000);
+            } else {
+                operatable = false;
+            }
+            // The password prompt comes after the responses of the commands sent before
+            if (is_file && cmd_reads_input(cmd)) {
+                if (!drain_frames(&user, &pipeline, response)) {
+                    break;
+                }
+                printf("%s", echo);
+                echo[0] = '\0';
             }
-            operatable = false;
             int res = parse_command(cmd, &command, &data_ptr, file);
 #ifdef _DEBUG
             printf("Cmd Type: %d\tName_len: %d\tData_len: %d\tPosition: %d\tName: %.*s\n", command.type, command.name_len, command.data_len, command.position, command.name_len, command.name);
 #endif
+            if (res < 0 || command.type == (u_int16_t)FS_EXIT) {
+                // Answered here, after the responses of the commands sent before
+                if (!drain_frames(&user, &pipeline, response)) {
+                    break;
+                }
+                printf("%s", echo);
+            }
             if (res == -1) {
                 fprintf(stderr, "\033[1;31mError:\033[0m Invalid command: %s\n", cmd);
             } else if (res == -2) {
@@ -102,8 +195,22 @@ int main(int argc, char* argv[]) {
                     // Check data
                     fs_data_len_check(cmd, data_ptr, command.data_len, res);
                 }
+                int frames = 1;
+                if (command.data_len > 0 && command.type != FS_DELETE) {
+                    frames += (command.data_len + FS_CHUNK_SIZE - 1) / FS_CHUNK_SIZE;
+                }
+                // Never wait for the window while the server may wait for us to read its responses
+                while (connected && user.unacked + frames > FS_WINDOW && (frames <= FS_WINDOW || pipeline.answered < pipeline.sent)) {
+                    connected = wait_frames(&user, &pipeline, response);
+                }
+                if (!connected) {
+                    break;
+                }
+                pipeline.sent++;
+                strcpy(pipeline.lines[pipeline.sent % FC_PIPELINE], echo);
+                user.seq = pipeline.sent;
                 int header_size = 12 + command.name_len;
-                res = fs_respond(&user, (char*)&command, header_size);
+                res = fs_send_frames(&user, FRAME_CMD, (char*)&command, header_size);
                 if (res < 0) {
                     close(sockfd);
                     return -1;
@@ -125,26 +232,17 @@ int main(int argc, char* argv[]) {
         }
 
         if (activity > 0 && FD_ISSET(sockfd, &controlfds)) {
-            nbytes = receive_response(sockfd, response);
-            if (nbytes == 0) {
-                printf("Server disconnected\n");
-                break;
-            } else if (nbytes > 0) {
-                if (strncmp(response, "\n\033[1;32m", 8) == 0) {
-                    operatable = true;
-                    strcpy(user.path, response);
-                } else if (strncmp(response, "\0F\0\0", 4) == 0) {
-                    // Flushed
-                    printf("\033[1;33mWarning:\033[0m Current path no longer exists\n");
-                }
-                printf("%s", response);
-                fflush(stdout);
-                // Confirm recived
-                if (write(sockfd, "", 1) != 1) {
-                    perror("send");
-                    return -1;
-                }
-            }
+            // The acks in the frames are taken here, the messages below
+            connected = fs_read_frames(&user) >= 0;
+        }
+        // Several messages may have arrived in one segment
+        if (connected) {
+            connected = handle_frames(&user, &pipeline, response);
+        }
+        if (!connected) {
+            printf("Server disconnected\n");
+        } else if (pipeline.prompted && (is_file || pipeline.answered == pipeline.sent)) {
+            operatable = true;
         }
     }
 
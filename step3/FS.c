@@ -1,59 +1,397 @@
 #include "BasicDisk.h"
 #include "FileServer.h"
 #include "ServerCore.h"
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
 
 #define SECTOR_SIZE 256
 
-int main(int argc, char* argv[]) {
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s <DiskServerAddress> <#BDS_port> <#FS_port>\n", argv[0]);
-        exit(1);
+// A thread keeps at most a stream and a vectored I/O in flight
+_Static_assert(STREAM_RING + MAX_INFLIGHT <= MAX_PENDING, "Pending table too small for a thread");
+
+// Tokens of the descriptors watched besides the clients, whose token is their slot and generation
+#define TOKEN_MASTER -1
+#define TOKEN_STDIN -2
+#define TOKEN_WAKE -3
+#define TOKEN_DISK -4
+
+// A connection and its buffers, allocated when accepted
+typedef struct Client {
+    User user;
+    Inode dir_inode;
+    FrameBuffer rx;
+    FrameQueue tx;
+    int slot;             // Index in the table of the server
+    u_int32_t gen;        // Tells the events of the client from the ones of the previous owner of the slot
+    bool logged_in;       // The login packet was answered, by a worker
+    bool busy;            // Served by a worker, not watched by the main thread, used by the main thread only
+    char* kick;           // Warning of the main thread before disconnecting, NULL if none
+    struct Client* next;  // Next client with a command ready
+} Client;
+
+// State shared by the main thread and the workers
+typedef struct Server {
+    AuthList* auth_list;
+    pthread_mutex_t lock;  // Protects the fields below
+    pthread_cond_t ready;  // Signaled when a client is queued
+    Client** client;       // Connected clients by slot, NULL if free
+    int* free_slot;        // Slots not used, taken from the end
+    int n_free;
+    int capacity;          // Slots of the table
+    u_int32_t next_gen;
+    Client* head;          // Clients with a command ready, in arrival order
+    Client* tail;
+    bool kicked;           // Warnings are waiting for idle clients
+    bool is_formatted;
+    int connections;
+    int wake[2];  // Pipe of the slots given back to the main thread
+} Server;
+
+// A worker has its own connection to the disk server, its requests are not queued behind the others
+typedef struct Worker {
+    Server* server;
+    DiskChannel disk;
+} Worker;
+
+// Queue a client with a command ready, the main thread leaves it to the workers
+void dispatch(Server* server, Client* client) {
+    pthread_mutex_lock(&server->lock);
+    client->busy = true;
+    client->next = NULL;
+    if (server->tail == NULL) {
+        server->head = client;
+    } else {
+        server->tail->next = client;
+    }
+    server->tail = client;
+    pthread_cond_signal(&server->ready);
+    pthread_mutex_unlock(&server->lock);
+}
+
+// Ask the main thread to disconnect the other users, all of them if id < 0
+void kick_users(Server* server, Client* client, int id, char* message) {
+    pthread_mutex_lock(&server->lock);
+    for (int j = 0; j < server->capacity; j++) {
+        Client* other = server->client[j];
+        if (other == NULL || other == client || other->user.sockfd == 0 || (id >= 0 && other->user.id != id)) {
+            continue;
+        }
+        other->kick = message;
+        server->kicked = true;
+    }
+    pthread_mutex_unlock(&server->lock);
+}
+
+int login_client(Server* server, Client* client);
+
+// Run the commands the client sent ahead, a few at a time so the others are served
+void serve_user(Server* server, Client* client, char* cmd_buffer, char* data_buffer) {
+    User* user = &client->user;
+    if (!client->logged_in && login_client(server, client) < 0) {
+        fs_disconnect(user);
+        return;
     }
+    bool failed = false;
+    for (int n = 0; n < FS_BATCH && user->sockfd > 0 && fs_frame_ready(user); n++) {
+        pthread_mutex_lock(&server->lock);
+        bool kicked = client->kick != NULL;
+        bool is_formatted = server->is_formatted;
+        pthread_mutex_unlock(&server->lock);
+        if (kicked) {
+            break;
+        }
+        // Read command from client
+        int res = fs_get_cmd(user, cmd_buffer, data_buffer);
+        if (res < 0) {
+            if (res == FS_EXIT) {
+                fs_disconnect(user);
+                printf("Client %d disconnected\n", client->slot);
+            } else {
+                printf("Failed to read command\n");
+            }
+            break;
+        }
+        CmdHeader* cmd = (CmdHeader*)cmd_buffer;
+        if (is_formatted || cmd->type == FS_FORMAT) {
+            res = fs_process_cmd(user, server->auth_list, cmd, data_buffer);
+            if (res == PEER_FAILURE) {
+                // Neither prompt nor acks, the main thread sees the connection end
+                printf("Failed to send response\n");
+                failed = true;
+                break;
+            } else if (res < 0) {
+                printf("Failed to process command\n");
+            } else if (cmd->type == FS_FORMAT) {
+                pthread_mutex_lock(&server->lock);
+                server->is_formatted = true;
+                pthread_mutex_unlock(&server->lock);
+                strcpy(user->username, "root");
+                kick_users(server, client, -1, "Disk formatted\n");
+            } else if (cmd->type == FS_USERDEL) {
+                kick_users(server, client, res, "User deleted\n");
+            }
+        } else {
+            fs_respond(user, "\nPlease format the disk", 23);
+        }
+        fs_print_work_dir(user);
+    }
+    // Acks of the frames consumed last
+    if (user->sockfd > 0 && !failed) {
+        fs_flush_frames(user);
+    }
+}
+
+void* worker_thread(void* arg) {
+    Worker* worker = (Worker*)arg;
+    Server* server = worker->server;
+    attach_channel(&worker->disk);
     char cmd_buffer[MAX_BUF_SIZE];
     char data_buffer[MAX_BUF_SIZE];
 
+    while (1) {
+        pthread_mutex_lock(&server->lock);
+        while (server->head == NULL) {
+            pthread_cond_wait(&server->ready, &server->lock);
+        }
+        Client* client = server->head;
+        server->head = client->next;
+        if (server->head == NULL) {
+            server->tail = NULL;
+        }
+        pthread_mutex_unlock(&server->lock);
+
+        serve_user(server, client, cmd_buffer, data_buffer);
+
+        // Write back the blocks changed by the commands of the batch
+        if (flush_cache(client->user.vol) < 0) {
+            printf("Failed to flush the block cache\n");
+        }
+
+        // Give the client back to the main thread
+        if (write(server->wake[1], &client->slot, sizeof(int)) != sizeof(int)) {
+            perror("write");
+        }
+    }
+    return NULL;
+}
+
+// Watch a descriptor with the token given
+void watch(int epoll_fd, int op, int fd, u_int32_t events, int token, u_int32_t gen) {
+    struct epoll_event event;
+    event.events = events;
+    event.data.u64 = (u_int64_t)gen << 32 | (u_int32_t)token;
+    if (epoll_ctl(epoll_fd, op, fd, &event) < 0) {
+        perror("epoll_ctl");
+    }
+}
+
+// Watch the socket of an idle client again, an event is raised at once if data arrived meanwhile
+void rearm(int epoll_fd, Client* client) {
+    watch(epoll_fd, EPOLL_CTL_MOD, client->user.sockfd, EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT, client->slot, client->gen);
+}
+
+// Take a slot for a new client, the table grows when full
+Client* add_client(Server* server, Volume* vol, int sockfd) {
+    Client* client = (Client*)malloc(sizeof(Client));
+    if (client == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    pthread_mutex_lock(&server->lock);
+    if (server->n_free == 0) {
+        int capacity = server->capacity == 0 ? 64 : server->capacity * 2;
+        Client** table = (Client**)realloc(server->client, sizeof(Client*) * capacity);
+        int* free_slot = table == NULL ? NULL : (int*)realloc(server->free_slot, sizeof(int) * capacity);
+        if (table != NULL) {
+            server->client = table;
+        }
+        if (free_slot == NULL) {
+            pthread_mutex_unlock(&server->lock);
+            perror("realloc");
+            free(client);
+            return NULL;
+        }
+        server->free_slot = free_slot;
+        // Lower slots are taken first
+        for (int i = capacity - 1; i >= server->capacity; i--) {
+            server->client[i] = NULL;
+            server->free_slot[server->n_free++] = i;
+        }
+        server->capacity = capacity;
+    }
+    client->slot = server->free_slot[--server->n_free];
+    client->gen = ++server->next_gen;
+    server->client[client->slot] = client;
+    server->connections++;
+    pthread_mutex_unlock(&server->lock);
+
+    User* user = &client->user;
+    user->sockfd = sockfd;
+    user->path[0] = '\0';
+    user->vol = vol;
+    user->cur_dir.inodeptr = &client->dir_inode;
+    user->cur_dir.dir_entries = NULL;
+    user->cur_dir.orig_data = NULL;
+    user->cur_dir.holes = NULL;
+    user->cur_dir.index = NULL;
+    fs_init_frames(user, &client->rx, &client->tx);
+    client->logged_in = false;
+    client->busy = false;
+    client->kick = NULL;
+    return client;
+}
+
+// Forget a client, the events already taken with it are told apart by the generation
+void remove_client(Server* server, Client* client) {
+    if (client->user.sockfd > 0) {
+        fs_disconnect(&client->user);
+    }
+    pthread_mutex_lock(&server->lock);
+    server->client[client->slot] = NULL;
+    server->free_slot[server->n_free++] = client->slot;
+    server->connections--;
+    pthread_mutex_unlock(&server->lock);
+    free(client);
+}
+
+// Answer the login packet of a new client, run by a worker as it reads the disk
+int login_client(Server* server, Client* client) {
+    User* user = &client->user;
+    pthread_mutex_lock(&server->lock);
+    bool is_formatted = server->is_formatted;
+    pthread_mutex_unlock(&server->lock);
+    if (is_formatted) {
+        pthread_rwlock_rdlock(&user->vol->tree_lock);
+        int res = fs_auth_user(user, server->auth_list);
+        pthread_rwlock_unlock(&user->vol->tree_lock);
+        if (res != 0) {
+            printf("Failed to initialize user\n");
+            return -1;
+        }
+    } else {
+        // Skip the login, every user is root on an unformatted disk
+        AuthUser auth;
+        fs_take_login(user, &auth);
+        user->id = 0;
+        fs_answer_login(user);
+        fs_respond(user, "Please format the disk", 22);
+    }
+    client->logged_in = true;
+    printf("Adding to list of sockets as %d\n", client->slot);
+    return fs_print_work_dir(user);
+}
+
+// Take what arrived from an idle client, it may be a part of a command or only acks
+int read_client(Server* server, Client* client, int epoll_fd) {
+    if (!client->logged_in) {
+        // The login packet may arrive in pieces, it is answered by a worker once whole
+        int res = fs_poll_login(&client->user);
+        if (res < 0) {
+            printf(res == FS_EXIT ? "Client %d disconnected\n" : "Client %d failed to log in\n", client->slot);
+            return -1;
+        }
+        if (res == 1) {
+            dispatch(server, client);
+        } else {
+            rearm(epoll_fd, client);
+        }
+        return 0;
+    }
+    if (fs_poll_frames(&client->user) < 0) {
+        printf("Client %d disconnected\n", client->slot);
+        return -1;
+    }
+    // A whole command is run by a worker, the socket is not watched meanwhile
+    if (fs_frame_ready(&client->user)) {
+        dispatch(server, client);
+    } else {
+        rearm(epoll_fd, client);
+    }
+    return 0;
+}
+
+// Send the warning of a kicked client and disconnect it
+bool kick_client(Server* server, Client* client) {
+    pthread_mutex_lock(&server->lock);
+    char* message = client->kick;
+    client->kick = NULL;
+    pthread_mutex_unlock(&server->lock);
+    if (message == NULL) {
+        return false;
+    }
+    fs_warning(&client->user, message, strlen(message));
+    remove_client(server, client);
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 4 && argc != 5) {
+        fprintf(stderr, "Usage: %s <DiskServerAddress> <#BDS_port> <#FS_port> [strictatime|noatime|relatime|lazytime][,lazymeta][,extents][,inline]\n", argv[0]);
+        exit(1);
+    }
+    char buffer[MAX_BUF_SIZE];
+
     int fs_port = atoi(argv[3]);
-    int master_socket, addrlen, max_fd;
+    int master_socket, addrlen;
     struct sockaddr_in address;
 
-    // Users
-    Inode dir_inode[MAX_CLIENTS];
-    User user[MAX_CLIENTS];
-    int connections = 0;
-
     // Auth info
     Inode auth_inode;
     auth_inode.i_idx = AUTH_INODE;
     AuthList auth_list;
     auth_list.inodeptr = &auth_inode;
 
-    // Set of socket descriptors
-    fd_set readfds, controlfds;
-    struct timeval timeout = {0, 500000};
-
     // Connect to Basic Disk-storage Server
     int bds_sockfd = connect_to(argv[1], atoi(argv[2]));
-    int activity, nbytes;
 
     printf("Waiting for connections ... \n");
     Volume vol;
     MetaBlocks meta;
+    if (parse_mount_options(&vol, argc == 5 ? argv[4] : NULL) < 0) {
+        exit(1);
+    }
     vol.blockptr = &meta;
-    vol.sockfd = bds_sockfd;
+    init_channel(&vol.disk, bds_sockfd);
     int res = init_volume(&vol);
-    bool is_formatted = res == 0;
-    if (is_formatted) {
+
+    Server server;
+    server.auth_list = &auth_list;
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.ready, NULL);
+    server.client = NULL;
+    server.free_slot = NULL;
+    server.n_free = 0;
+    server.capacity = 0;
+    server.next_gen = 0;
+    server.head = NULL;
+    server.tail = NULL;
+    server.kicked = false;
+    server.is_formatted = res == 0;
+    server.connections = 0;
+    if (pipe(server.wake) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    fcntl(server.wake[0], F_SETFL, O_NONBLOCK);
+    if (server.is_formatted) {
         load_auth_list(&vol, &auth_list);
     }
 
-    // 0 refers to unconnected socket
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        user[i].sockfd = 0;
-        user[i].path[0] = '\0';
-        user[i].vol = &vol;
-        user[i].cur_dir.inodeptr = &dir_inode[i];
-        user[i].cur_dir.dir_entries = NULL;
-        user[i].cur_dir.orig_data = NULL;
+    // A client leaving must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // Commands run on the workers, the sockets are watched by the main thread
+    Worker workers[FS_WORKERS];
+    for (int i = 0; i < FS_WORKERS; i++) {
+        workers[i].server = &server;
+        init_channel(&workers[i].disk, connect_to(argv[1], atoi(argv[2])));
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker_thread, &workers[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+        pthread_detach(thread);
     }
 
     master_socket = init_server(&address, fs_port);
@@ -63,137 +401,109 @@ int main(int argc, char* argv[]) {
     printf("Waiting for connections ... \n");
 
     // Listen to the socket
-    listen(master_socket, 5);
+    listen(master_socket, SOMAXCONN);
+    fcntl(master_socket, F_SETFL, O_NONBLOCK);
 
-    while (1) {
-        // Clear the socket set
-        FD_ZERO(&readfds);
-        FD_ZERO(&controlfds);
-
-        // Add sockets to set
-        FD_SET(master_socket, &readfds);
-        max_fd = master_socket;
-        for (int i = 0; i < MAX_CLIENTS; i++) {
-            if (user[i].sockfd > 0) {
-                FD_SET(user[i].sockfd, &readfds);
-                if (user[i].sockfd > max_fd) {
-                    max_fd = user[i].sockfd;
-                }
+    // Only the descriptors with events are visited, however many clients are connected
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    watch(epoll_fd, EPOLL_CTL_ADD, master_socket, EPOLLIN | EPOLLET, TOKEN_MASTER, 0);
+    watch(epoll_fd, EPOLL_CTL_ADD, server.wake[0], EPOLLIN | EPOLLET, TOKEN_WAKE, 0);
+    // Lines of stdin are read one at a time, the rest stays buffered
+    watch(epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, EPOLLIN, TOKEN_STDIN, 0);
+    // Idle between the commands, anything arriving means the disk server left
+    watch(epoll_fd, EPOLL_CTL_ADD, bds_sockfd, EPOLLIN | EPOLLRDHUP, TOKEN_DISK, 0);
+
+    struct epoll_event events[FS_EVENTS];
+    bool running = true;
+    while (running) {
+        int n_events = epoll_wait(epoll_fd, events, FS_EVENTS, -1);
+        if (n_events < 0) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
             }
+            continue;
         }
-        FD_SET(STDIN_FILENO, &controlfds);
-        FD_SET(bds_sockfd, &controlfds);
 
-        // readfds - process new connection and client activity
-        activity = select(max_fd + 1, &readfds, NULL, NULL, &timeout);
-        if ((activity < 0) && (errno != EINTR)) {
-            perror("select");
-        }
+        for (int e = 0; e < n_events && running; e++) {
+            int token = (int)(u_int32_t)events[e].data.u64;
+            u_int32_t gen = events[e].data.u64 >> 32;
 
-        for (int i = 0; i < MAX_CLIENTS; i++) {
-            if (user[i].sockfd == 0 || !FD_ISSET(user[i].sockfd, &readfds)) {
-                continue;
-            }
-            // Read command from client
-            res = fs_get_cmd(&user[i], cmd_buffer, data_buffer);
-            if (res < 0) {
-                if (res == FS_EXIT) {
-                    fs_disconnect(&user[i]);
-                    connections--;
-                    printf("Client %d disconnected\n", i);
-                } else {
-                    printf("Failed to read command\n");
+            if (token >= 0) {
+                // The client may have left in this round, and the slot taken by another
+                Client* client = server.client[token];
+                if (client != NULL && client->gen == gen && read_client(&server, client, epoll_fd) < 0) {
+                    remove_client(&server, client);
                 }
-                continue;
-            }
-            CmdHeader* cmd = (CmdHeader*)cmd_buffer;
-            if (is_formatted || cmd->type == FS_FORMAT) {
-                res = fs_process_cmd(&user[i], &auth_list, cmd, data_buffer);
-                if (res < 0) {
-                    printf("Failed to process command\n");
-                } else if (cmd->type == FS_FORMAT) {
-                    is_formatted = true;
-                    strcpy(user[i].username, "root");
-                    for (int j = 0; j < MAX_CLIENTS; j++) {
-                        if (j == i || user[j].sockfd == 0) {
-                            continue;
+            } else if (token == TOKEN_WAKE) {
+                // Clients given back by the workers
+                int slot;
+                while (read(server.wake[0], &slot, sizeof(int)) == sizeof(int)) {
+                    Client* client = server.client[slot];
+                    client->busy = false;
+                    if (client->user.sockfd == 0) {
+                        remove_client(&server, client);
+                    } else if (!kick_client(&server, client)) {
+                        if (fs_frame_ready(&client->user)) {
+                            dispatch(&server, client);
+                        } else {
+                            rearm(epoll_fd, client);
                         }
-                        fs_warning(&user[j], "Disk formatted\n", 15);
-                        fs_disconnect(&user[j]);
-                        connections--;
                     }
-                } else if (cmd->type == FS_USERDEL) {
-                    for (int j = 0; j < MAX_CLIENTS; j++) {
-                        if (j == i || user[j].sockfd == 0 || user[j].id != res) {
-                            continue;
-                        }
-                        fs_warning(&user[j], "User deleted\n", 13);
-                        fs_disconnect(&user[j]);
-                        connections--;
+                }
+                // Kicked out by the command of another user, the busy ones when given back
+                pthread_mutex_lock(&server.lock);
+                bool kicked = server.kicked;
+                server.kicked = false;
+                pthread_mutex_unlock(&server.lock);
+                for (int i = 0; kicked && i < server.capacity; i++) {
+                    Client* client = server.client[i];
+                    if (client != NULL && !client->busy) {
+                        kick_client(&server, client);
                     }
                 }
-            } else {
-                fs_respond(&user[i], "\nPlease format the disk", 23);
-            }
-            res = fs_print_work_dir(&user[i]);
-        }
-
-        // Process new connection
-        if (FD_ISSET(master_socket, &readfds) && connections < MAX_CLIENTS) {
-            int new_socket = accept_new(master_socket, &address, &addrlen);
-            // Add new socket to array of sockets
-            int i = 0;
-            while (i < MAX_CLIENTS && user[i].sockfd != 0) {
-                i++;
-            }
-            user[i].sockfd = new_socket;
-            connections++;
-            if (is_formatted) {
-                res = fs_auth_user(&user[i], &auth_list);
-                if (res != 0) {
-                    printf("Failed to initialize user\n");
-                    fs_disconnect(&user[i]);
-                    connections--;
+            } else if (token == TOKEN_MASTER) {
+                // Process new connections until none is left
+                int new_socket;
+                while ((new_socket = accept_new(master_socket, &address, &addrlen)) >= 0) {
+                    fcntl(new_socket, F_SETFL, O_NONBLOCK);
+                    // Frames are coalesced in the write buffer, the prompt must not wait for an ack
+                    int opt = 1;
+                    setsockopt(new_socket, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+                    Client* client = add_client(&server, &vol, new_socket);
+                    if (client == NULL) {
+                        close(new_socket);
+                        continue;
+                    }
+                    // The login is answered once it arrives
+                    watch(epoll_fd, EPOLL_CTL_ADD, new_socket, EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT, client->slot, client->gen);
                 }
-            } else {
-                res = write(user[i].sockfd, "\0\0", 2);
-                if (res != 2) {
-                    perror("send");
-                    fs_disconnect(&user[i]);
-                    connections--;
+            } else if (token == TOKEN_STDIN) {
+                char* ch = fgets(buffer, 200, stdin);
+                if (ch == NULL) {
+                    running = false;
+                } else if (strncmp(buffer, "exit", 4) == 0) {
+                    // Wait for the commands changing the tree or the files
+                    pthread_rwlock_wrlock(&vol.tree_lock);
+                    fs_exit(&vol);
+                    for (int i = 0; i < server.capacity; i++) {
+                        if (server.client[i] != NULL && server.client[i]->user.sockfd > 0 && shutdown(server.client[i]->user.sockfd, SHUT_RDWR) < 0) {
+                            perror("shutdown");
+                        }
+                    }
+                    return 0;
                 }
-                res = fs_respond(&user[i], "Please format the disk", 22);
-            }
-            if (res >= 0) {
-                res = fs_print_work_dir(&user[i]);
-                printf("Adding to list of sockets as %d\n", i);
-            }
-        }
-
-        activity = select(bds_sockfd + 1, &controlfds, NULL, NULL, &timeout);
-        if ((activity < 0) && (errno != EINTR)) {
-            perror("select");
-        }
-
-        if (activity > 0 && FD_ISSET(STDIN_FILENO, &controlfds)) {
-            char* ch = fgets(data_buffer, 200, stdin);
-            if (ch == NULL) {
-                break;
-            } else if (strncmp(data_buffer, "exit", 4) == 0) {
-                return fs_exit(user);
-            }
-        }
-
-        if (activity > 0 && FD_ISSET(bds_sockfd, &controlfds)) {
-            nbytes = receive_response(bds_sockfd, data_buffer);
-            if (nbytes == 0) {
+            } else if (token == TOKEN_DISK && !disk_connected(&vol)) {
                 printf("Server disconnected\n");
-                break;
-            } else if (nbytes > 0) {
-                printf("%s\n", data_buffer);
+                running = false;
             }
         }
     }
 
+    pthread_rwlock_wrlock(&vol.tree_lock);
+    confirm_sync(&vol);
     return 0;
-}
\ No newline at end of file
+}
@@ -13,20 +13,57 @@
 #include <string.h>
 #include <stdbool.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <sys/types.h>
 
 // Sector size = 256 bytes
 #define SECTOR_SIZE 256
 
+// Sectors are locked by stripes of block_id % LOCK_STRIPES
+#define LOCK_STRIPES 256
+
+// State shared by all the connections to the disk
+typedef struct DiskState {
+    pthread_mutex_t arm_lock;  // Held while the arm is moving
+    int current_track;
+    long sector_count;   // Sectors accessed
+    long seek_count;     // Accesses that moved the arm
+    long seek_distance;  // Total tracks moved by the arm
+    pthread_rwlock_t sector_locks[LOCK_STRIPES];
+    pthread_mutex_t dirty_lock;
+    u_int8_t *dirty;   // Bitmap of sectors written since the last sync
+    long dirty_count;  // Number of dirty sectors
+    pthread_mutex_t sync_lock;  // Held through a flush, the writers only wait for dirty_lock
+    u_int8_t *flushing;         // Bitmap of sectors being flushed, swapped with dirty
+} DiskState;
+
+// Responses of a connection, written to its socket by its own sender so the arm never waits for a client
+typedef struct Outbox {
+    char *data;
+    size_t len;
+    size_t cap;
+    bool closed;  // No more responses, the sender exits once the rest is written
+    bool failed;  // The socket failed, the responses are dropped
+    pthread_mutex_t lock;
+    pthread_cond_t changed;  // Responses were added or written
+} Outbox;
+
+// Bytes of responses backlogged before the connection stops taking requests
+#define OUTBOX_MAX (64 * 1024)
+
+// Each connection works on its own copy, sharing the mapping and the state
 typedef struct BasicDisk {
     int n_cylinders;
     int n_sectors;
     int track_to_track_delay;
     int fd;
-    int current_track;
     char *diskfile;
+    DiskState *state;
     int socket_fd;
+    int pending;     // Requests of the connection queued or being served, under the queue lock
+    Outbox *outbox;  // Responses waiting for the socket, NULL to write them at once
 } BasicDisk;
 
 #define CMD_I 0  // Information request
@@ -34,27 +71,96 @@ typedef struct BasicDisk {
 #define CMD_W 2  // Write data to sectors
 #define CMD_E 3  // Exit
 #define CMD_S 4  // Sync
+#define CMD_RV 5 // Read a vector of sectors
+#define CMD_WV 6 // Write a vector of sectors
 #define INVALID_COMMAND -1
 
 #define MAX_BUF_SIZE 8192
-#define SIZE_CMD_BASIC 8
+#define SIZE_CMD_BASIC 12
+#define SIZE_RESP_BASIC 12
+
+// Block ids of a vectored command are carried in Command.data
+#define MAX_VEC_SECTORS (SECTOR_SIZE / 4)
 
 typedef struct Command {
     u_int16_t type;
     u_int16_t len;
     u_int32_t block_id;
+    u_int32_t tag;  // Request id, echoed in the response
     char data[SECTOR_SIZE];
 } Command;
 
+// Every command is answered with a response header followed by len bytes of payload
+typedef struct Response {
+    u_int32_t tag;
+    u_int16_t type;
+    u_int16_t status;  // 0 = success, otherwise payload is the error message
+    u_int32_t len;
+} Response;
+
+/**
+ * Vectored commands (CMD_RV / CMD_WV):
+ * [type:2][len:2 = #sectors][block_id:4, unused][tag:4][block ids: 4 * len]
+ * CMD_WV is followed by len * SECTOR_SIZE bytes of data.
+ * Payload of CMD_RV response is all the sectors in the order of the block ids.
+ */
+
 void init_disk(char *filename, BasicDisk *disk);
 
+void update_track(BasicDisk *disk, int cylinder);
+
+int arm_position(BasicDisk *disk);
+
+int read_from_socket(BasicDisk *disk, char *buffer, size_t len);
+
 void write_to_socket(BasicDisk *disk, char *response, size_t len);
 
-void info(BasicDisk *disk);
+/**
+ * @brief Send a response, queued in the outbox of the connection if it has one
+ */
+void respond(BasicDisk *disk, u_int32_t tag, u_int16_t type, u_int16_t status, char *payload, u_int32_t len);
 
-int read_sector(BasicDisk *disk, int cylinder, int sector);
+/**
+ * @brief Initialize an empty outbox
+ */
+void init_outbox(Outbox *outbox);
 
-int write_sector(BasicDisk *disk, int cylinder, int sector, int length, char *data);
+/**
+ * @brief Write the responses of the outbox to the socket as they come, until it is closed and empty
+ *        Run by the sender thread of the connection
+ */
+void send_outbox(BasicDisk *disk);
+
+/**
+ * @brief Wait until the outbox has room for more responses, the connection stops reading meanwhile
+ */
+void outbox_wait_room(BasicDisk *disk);
+
+/**
+ * @brief Close the outbox, the sender exits once the rest is written
+ */
+void close_outbox(BasicDisk *disk);
+
+void destroy_outbox(Outbox *outbox);
+
+void respond_error(BasicDisk *disk, u_int32_t tag, u_int16_t type, char *message);
+
+void info(BasicDisk *disk, u_int32_t tag);
+
+int read_sector(BasicDisk *disk, u_int32_t tag, int cylinder, int sector);
+
+int write_sector(BasicDisk *disk, u_int32_t tag, int cylinder, int sector, int length, char *data);
+
+int read_sectors(BasicDisk *disk, u_int32_t tag, int count, u_int32_t *block_ids, int *order);
+
+int write_sectors(BasicDisk *disk, u_int32_t tag, int count, u_int32_t *block_ids, char *data, int *order);
+
+/**
+ * @brief Flush the dirty sectors to the diskfile with msync and fdatasync
+ *        The dirty bitmap is swapped out first, sectors written meanwhile wait for the next flush
+ * @return int number of msync ranges, -1 if failed
+ */
+int sync_disk(BasicDisk *disk);
 
 void dystroy_disk(BasicDisk *disk);
 
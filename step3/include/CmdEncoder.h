@@ -42,6 +42,7 @@ typedef struct CmdHeader {
 #define FS_CHOWN 17
 #define FS_CHMOD 18
 #define FS_SU 19
+#define FS_APPEND 20
 
 #define FS_EXIT -233
 #define FS_INVALID 255
@@ -65,6 +66,13 @@ int get_passwd(char* data_buff, FILE* input, bool confirm);
  */
 int parse_command(char* cmd, CmdHeader* command, char** data, FILE* input);
 
+/**
+ * @brief Check if parsing a command reads more lines of input, like a password
+ * @param cmd char*: the command string
+ * @return bool true if parse_command will prompt and read the input
+ */
+bool cmd_reads_input(char* cmd);
+
 /**
  * @brief Print help message
  */
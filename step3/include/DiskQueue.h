@@ -0,0 +1,115 @@
+/**
+ * DiskQueue.h
+ *
+ * Request queue and arm scheduling policies of the disk server
+ */
+
+#ifndef DISKQUEUE_H
+#define DISKQUEUE_H
+
+#include <time.h>
+
+#include "BasicDisk.h"
+
+#define MAX_QUEUE 64  // Requests of all the connections
+
+#define SCHED_FCFS 0   // First come, first served
+#define SCHED_SSTF 1   // Shortest seek time first
+#define SCHED_SCAN 2   // Elevator, turns at the last request of the sweep
+#define SCHED_CLOOK 3  // Circular LOOK, only serves upwards
+#define SCHED_COUNT 4
+
+// Longest time a sync may wait for others to share its flush
+#define SYNC_WINDOW_US 2000
+
+typedef struct DiskRequest {
+    Command cmd;
+    char *data;       // Sector data of CMD_WV
+    BasicDisk *disk;  // Connection of the client, the response is sent to its socket
+    int cmin;         // Lowest cylinder touched
+    int cmax;         // Highest cylinder touched
+    bool is_write;
+    bool is_barrier;  // Requests of the same connection can not be reordered across a barrier
+} DiskRequest;
+
+// One queue is shared by all the connections and served by the arm thread
+typedef struct DiskQueue {
+    DiskRequest req[MAX_QUEUE];
+    int size;
+    int policy;
+    int direction;  // 1 = towards higher cylinders, -1 = towards lower
+    BasicDisk *sync_disks[MAX_QUEUE];  // Connections of the sync requests waiting for the group commit
+    u_int32_t sync_tags[MAX_QUEUE];
+    int sync_count;
+    struct timespec sync_start;  // Arrival of the oldest waiting sync
+    pthread_mutex_t lock;
+    pthread_cond_t changed;  // A request was added, taken or served
+} DiskQueue;
+
+/**
+ * @brief Get the policy from its name
+ * @param name char*: FCFS, SSTF, SCAN or CLOOK
+ * @return int policy, -1 if invalid
+ */
+int parse_policy(char *name);
+
+/**
+ * @brief Get the name of a policy
+ */
+const char *policy_name(int policy);
+
+/**
+ * @brief Initialize an empty queue
+ */
+void init_queue(DiskQueue *queue, int policy);
+
+/**
+ * @brief Receive one request from the socket of a connection, then add it to the queue once there is room
+ * @param disk BasicDisk struct: the connection
+ * @param queue DiskQueue struct: the shared queue
+ * @param type u_int16_t*: type of the command received
+ * @return int 1 if received, 0 if disconnected, -1 if failed
+ */
+int queue_receive(BasicDisk *disk, DiskQueue *queue, u_int16_t *type);
+
+/**
+ * @brief Take the next request to be served according to the policy, waiting if none
+ *        Sync requests are answered by the group commit of all the connections meanwhile
+ * @param disk BasicDisk struct: the disk, used to flush
+ * @param req DiskRequest struct: the request taken, to be given back to queue_done
+ */
+void queue_next(BasicDisk *disk, DiskQueue *queue, DiskRequest *req);
+
+/**
+ * @brief Order the sectors of a vectored request along the arm movement
+ * @param order int*: indices of the block ids in service order
+ */
+void queue_order(BasicDisk *disk, DiskQueue *queue, DiskRequest *req, int *order);
+
+/**
+ * @brief Release a request served by the arm
+ */
+void queue_done(DiskQueue *queue, DiskRequest *req);
+
+/**
+ * @brief Flush the disk once and answer all waiting sync requests
+ * @return int 0 if success, -1 if failed
+ */
+int queue_flush(BasicDisk *disk, DiskQueue *queue);
+
+/**
+ * @brief Drop the requests of a disconnected client that are not served yet
+ */
+void queue_drop(DiskQueue *queue, BasicDisk *disk);
+
+/**
+ * @brief Wait until no request of a connection is queued or being served
+ */
+void queue_wait_idle(DiskQueue *queue, BasicDisk *disk);
+
+/**
+ * @brief Print the seek counters of the arm, shared by all the connections
+ */
+void print_seek_stats(BasicDisk *disk, DiskQueue *queue);
+
+#endif
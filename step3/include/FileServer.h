@@ -11,8 +11,56 @@
 #include "CmdEncoder.h"
 #include "ClientCore.h"
 
+#define FS_CHUNK_SIZE (MAX_BUF_SIZE / 2)  // Bytes of payload of a frame at most
+#define FS_WINDOW 8                       // Frames sent before waiting for the acks
+#define FS_BATCH 16                       // Commands of a connection run before serving the others
+#define FS_WORKERS 4                      // Threads running the commands of the connections
+#define FS_EVENTS 64                      // Events taken by the main thread at once
+#define FS_PEER_TIMEOUT 10000             // Milliseconds the server waits for a client to read or ack
+
+#define FRAME_CMD 1     // Command header, followed by the data frames of the command
+#define FRAME_DATA 2    // Data of a command, or output of a response
+#define FRAME_PROMPT 3  // Working directory of the user, ends a response
+#define FRAME_FLUSH 4   // Working directory of the user no longer exists
+#define FRAME_ACK 5     // Only the credit, not acked itself
+
+typedef struct FrameHeader {
+    u_int16_t type;
+    u_int16_t credit;  // Frames of the peer consumed since the last frame sent
+    u_int32_t len;     // Bytes of payload, at most FS_CHUNK_SIZE
+    u_int32_t seq;     // Sequence number of the command, echoed by the frames of its response
+} FrameHeader;
+
+#define SIZE_FRAME_HEADER 12
+
+#define LOGIN_HEADER 36  // Lengths and hashed password of the login packet, followed by the name
+#define LOGIN_NAME 63    // Longest name of the login packet, the username of AuthUser keeps its end
+
+// The peer never has more than FS_WINDOW frames not consumed, plus the acks
+#define FRAME_BUF_SIZE ((FS_WINDOW + 1) * (SIZE_FRAME_HEADER + FS_CHUNK_SIZE))
+
+typedef struct FrameBuffer {
+    char data[FRAME_BUF_SIZE];
+    int start;  // First byte not consumed
+    int end;    // End of the bytes received
+} FrameBuffer;
+
+// Frames queued for the peer, written together when a response ends or the peer is waited for
+#define FRAME_TX_SIZE (2 * (SIZE_FRAME_HEADER + FS_CHUNK_SIZE))
+
+typedef struct FrameQueue {
+    char data[FRAME_TX_SIZE];
+    int len;       // Bytes queued
+    bool holding;  // The tree is locked, messages are held instead of waiting for the peer
+    char* held;    // Messages held, each one a frame header and its whole payload
+    int held_len;
+    int held_cap;
+} FrameQueue;
+
 /**
- * @brief Process a command from the user
+ * @brief Process a command from the user, locking the directory tree
+ *        exclusively if the command changes it and shared otherwise.
+ *        The response is held while the tree is locked and sent once it is released
  * @param user User struct: the user to process the command
  * @return int 0 if success, <0 if failed
  */
@@ -28,6 +76,32 @@ int fs_get_cmd(User* user, char* cmd, char* data);
  */
 int fs_login(AuthUser* auth, int sockfd);
 
+/**
+ * @brief Read what arrived of the login packet into the reassembly buffer, without waiting
+ * @param user User struct: the peer, on a non-blocking socket
+ * @return int 1 if the whole packet arrived, 0 if not yet, -1 if invalid or failed, FS_EXIT if disconnected
+ */
+int fs_poll_login(User* user);
+
+/**
+ * @brief Take the login packet from the reassembly buffer, the frames behind it are kept
+ * @param user User struct: the peer, fs_poll_login returned 1
+ * @param auth AuthUser struct: the name and the hashed password, will be updated
+ */
+void fs_take_login(User* user, AuthUser* auth);
+
+/**
+ * @brief Answer the login with the ID of the user, queued ahead of the frames
+ * @param user User struct: the peer, with a FrameQueue
+ */
+void fs_answer_login(User* user);
+
+/**
+ * @brief Check the login packet and initialize the user, the tree is locked by the caller
+ * @param user User struct: the peer, fs_poll_login returned 1
+ * @param list AuthList struct: the users
+ * @return int 0 if success, -1 if failed
+ */
 int fs_auth_user(User* user, AuthList* list);
 
 /**
@@ -43,14 +117,101 @@ int fs_data_len_check(char* cmd, char* data_ptr, int data_len, int res);
 int fs_print_work_dir(User* user);
 
 /**
- * @brief Send a response to the user and wait for confirmation
+ * @brief Read exactly len bytes from a socket
+ * @return int len if success, 0 if disconnected, -1 if failed
+ */
+int fs_recv_all(int sockfd, char* buffer, int len);
+
+/**
+ * @brief Attach the buffers to a connection and reset its window
+ * @param user User struct: the peer
+ * @param rx FrameBuffer struct: the buffer of the frames received
+ * @param tx FrameQueue struct: the buffer of the frames to be sent, NULL to write each frame at once
+ */
+void fs_init_frames(User* user, FrameBuffer* rx, FrameQueue* tx);
+
+/**
+ * @brief Read what the peer sent into the reassembly buffer, taking the credits of the frames.
+ *        Waits for the peer if nothing arrived, the socket may be non-blocking.
+ *        The server waits FS_PEER_TIMEOUT at most, the client as long as a command takes
+ * @param user User struct: the peer, user->unacked will be updated
+ * @return int bytes read, -1 if failed, FS_EXIT if disconnected
+ */
+int fs_read_frames(User* user);
+
+/**
+ * @brief Read all that already arrived from a non-blocking socket, without waiting
+ * @param user User struct: the peer, user->unacked will be updated
+ * @return int bytes read, 0 if nothing arrived, -1 if failed, FS_EXIT if disconnected
+ */
+int fs_poll_frames(User* user);
+
+/**
+ * @brief Write the queued frames, waiting for the socket if it is full.
+ *        Nothing is written while the messages are held
+ * @param user User struct: the peer
+ * @return int 0 if success, -1 if failed
+ */
+int fs_flush_frames(User* user);
+
+/**
+ * @brief Hold the messages sent from now on, the peer is not waited for while the tree is locked
+ * @param user User struct: the peer, with a FrameQueue
+ */
+void fs_hold_frames(User* user);
+
+/**
+ * @brief Send the messages held since fs_hold_frames, waiting for the peer as needed
+ * @param user User struct: the peer
+ * @return int 0 if success, -1 if failed, FS_EXIT if disconnected
+ */
+int fs_release_frames(User* user);
+
+/**
+ * @brief Check if a whole frame is in the reassembly buffer
+ * @param user User struct: the peer
+ * @return bool true if fs_recv_frame will not block
+ */
+bool fs_frame_ready(User* user);
+
+/**
+ * @brief Take the next frame, the frames arrived together are acked once all consumed
+ * @param user User struct: the peer
+ * @param header FrameHeader struct: header of the frame, will be updated
+ * @param payload char*: buffer of at least FS_CHUNK_SIZE bytes
+ * @return int length of the payload, -1 if failed, FS_EXIT if disconnected
+ */
+int fs_recv_frame(User* user, FrameHeader* header, char* payload);
+
+/**
+ * @brief Send a message in frames of FS_CHUNK_SIZE bytes at most,
+ *        waiting for the peer only when FS_WINDOW frames are not acked
+ * @param user User struct: the peer, user->seq is stamped on the frames
+ * @param type u_int16_t: type of the frames
+ * @param message char*: the message to be sent
+ * @param len int: the length of the message, one empty frame is sent if 0
+ * @return int 0 if success, -1 if failed, FS_EXIT if disconnected
+ */
+int fs_send_frames(User* user, u_int16_t type, char* message, int len);
+
+/**
+ * @brief Send a response to the user in data frames
  * @param user User struct: the user to send the response
  * @param message char*: the message to be sent
  * @param len int: the length of the message
- * @return int 0 if success, -1 if failed
+ * @return int 0 if success, -1 if failed, FS_EXIT if disconnected
  */
 int fs_respond(User* user, char* message, int len);
 
+/**
+ * @brief Send a file to the user chunk by chunk, the next chunks are read while one is sent.
+ *        The tree locked by the caller is released once the file is opened and locked
+ * @param user User struct: the user to send the file
+ * @param filename char*: the filename to be sent
+ * @return int 0 if success, <0 if failed
+ */
+int fs_cat_file(User* user, char* filename);
+
 /**
  * @brief Send a warning to the user
  */
@@ -62,15 +223,15 @@ int fs_warning(User* user, char* message, int len);
 int fs_error(User* user, char* message, int len);
 
 /**
- * @brief Disconnect the user
+ * @brief Disconnect the user, the queued frames are sent first
  */
 int fs_disconnect(User* user);
 
 /**
- * @brief Exit the file server
- * @param user_list User*: the list of users
+ * @brief Exit the file server, the connections are shut down by the caller
+ * @param vol Volume struct: the volume to be synced
  * @return int 0 if success, -1 if failed
  */
-int fs_exit(User* user_list);
+int fs_exit(Volume* vol);
 
 #endif
\ No newline at end of file
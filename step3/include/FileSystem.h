@@ -13,7 +13,10 @@
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <sys/types.h>
+#include <pthread.h>
 
 #define METABLOCKS_SIZE 3
 #define INODE_BITMAP_SIZE 32
@@ -47,45 +50,224 @@ typedef struct MetaBlocks {
     u_int32_t block_bitmap[BLOCK_BITMAP_SIZE];
 } MetaBlocks;  // Blk0[ superblock: 32 | padding: 96 | inode_bitmap: 128 ] Blk1-2[ block_bitmap:512 ]
 
+#define MAX_INFLIGHT 8  // Requests of one vectored I/O in flight
+#define MAX_PENDING 16  // Requests of one thread in flight
+
+#define IO_FREE 0
+#define IO_WAITING 1
+#define IO_DONE 2
+#define IO_FAILED 3
+
+typedef struct PendingIO {
+    u_int32_t tag;
+    int state;
+    char* buffer;   // Destination of the response payload
+    u_int32_t len;  // Expected length of the response payload
+} PendingIO;
+
+// Connection to the disk server, used by one thread at a time
+typedef struct DiskChannel {
+    int sockfd;
+    u_int32_t next_tag;
+    int inflight;
+    PendingIO pending[MAX_PENDING];
+} DiskChannel;
+
+#define CACHE_BLOCKS 128
+#define CACHE_HASH 256
+#define CACHE_RETRY -2  // cache_lock was released, the block must be looked up again
+
+typedef struct CacheEntry {
+    int block;        // Disk block idx, -1 if unused
+    int next;         // Next entry in the same hash bucket, -1 if last
+    bool dirty;       // Not written back to disk yet
+    bool referenced;  // Second chance of the CLOCK eviction
+    bool busy;        // Disk I/O in flight without cache_lock, the entry is left alone until it ends
+    char data[SIZE_BLOCK];
+} CacheEntry;
+
+typedef struct BlockCache {
+    CacheEntry entries[CACHE_BLOCKS];
+    int buckets[CACHE_HASH];
+    int hand;  // CLOCK hand
+    u_int32_t hits;
+    u_int32_t misses;
+    u_int32_t writebacks;  // Blocks written back to disk
+} BlockCache;
+
+#define INODE_CACHE_SIZE 256
+#define INODE_CACHE_HASH 256
+
+typedef struct InodeEntry {
+    int idx;          // Inode index, -1 if unused
+    int next;         // Next entry in the same hash bucket, -1 if last
+    bool dirty;       // Not written back to the inode table yet
+    bool lazy;        // Only timestamps changed, written back on sync or eviction
+    bool referenced;  // Second chance of the CLOCK eviction
+    char data[SIZE_INODE];
+} InodeEntry;
+
+typedef struct InodeCache {
+    InodeEntry entries[INODE_CACHE_SIZE];
+    int buckets[INODE_CACHE_HASH];
+    int hand;  // CLOCK hand
+    u_int32_t hits;
+    u_int32_t misses;
+} InodeCache;
+
+#define DENTRY_CACHE_SIZE 512
+#define DENTRY_CACHE_HASH 512
+#define DENTRY_NAME 28  // Longest name kept in the dentry cache
+
+#define DENTRY_NEGATIVE -1  // The name is known not to exist
+#define DENTRY_MISS -2      // The name is not cached
+
+typedef struct DentryEntry {
+    int parent;       // Inode index of the directory, -1 if unused
+    int next;         // Next entry in the same hash bucket, -1 if last
+    int inode_idx;    // Inode index of the name, DENTRY_NEGATIVE if it does not exist
+    u_int16_t mode;   // Inode mode of the name
+    u_int16_t len;    // Length of the name
+    bool referenced;  // Second chance of the CLOCK eviction
+    char name[DENTRY_NAME];
+} DentryEntry;
+
+typedef struct DentryCache {
+    DentryEntry entries[DENTRY_CACHE_SIZE];
+    int buckets[DENTRY_CACHE_HASH];
+    int hand;  // CLOCK hand
+    u_int32_t hits;
+    u_int32_t misses;
+} DentryCache;
+
+// Update of the access time on read
+#define ATIME_STRICT 0  // Always, the inode is written back
+#define ATIME_NO 1      // Never
+#define ATIME_REL 2     // Only if not newer than the mtime or older than RELATIME_THRESHOLD
+#define ATIME_LAZY 3    // Always, kept in the inode cache until sync or eviction
+
+#define RELATIME_THRESHOLD (24 * 60 * 60)
+#define MAX_OPTIONS_LEN 128
+
+// Contents of the files are locked by stripes of i_idx % INODE_LOCKS
+#define INODE_LOCKS 64
+
 typedef struct Volume {
     MetaBlocks* blockptr;
-    int sockfd;
+    u_int8_t meta_dirty;  // Bitmask of the metadata blocks changed since saved
+    u_int32_t inode_cursor;  // Next-fit cursors of the bitmaps, in words
+    u_int32_t block_cursor;
+    bool lazy_meta;       // Metadata blocks are saved on sync only
+    bool extents;         // New files map their blocks by extents
+    bool inline_data;     // Files small enough are kept in the inode
+    int atime_mode;
+    DiskChannel disk;  // Channel of the threads without their own
+    BlockCache cache;
+    InodeCache icache;
+    DentryCache dcache;           // Names of the directories, shared by all users
+    pthread_mutex_t cache_lock;   // Protects the block cache, released during disk I/O
+    pthread_cond_t cache_cond;    // Signalled when the disk I/O of a cache entry ends
+    pthread_mutex_t icache_lock;  // Protects the inode cache, recursive, taken before cache_lock
+    pthread_mutex_t dentry_lock;  // Protects the dentry cache
+    pthread_mutex_t alloc_lock;   // Protects the bitmaps, the free counts and the cursors
+    pthread_rwlock_t tree_lock;   // Directories and users: shared to look up, exclusive to change
+    pthread_rwlock_t inode_locks[INODE_LOCKS];
 } Volume;
 
 /**
- * @brief Initialize the volume
- * @param vol Volume struct: must contain valid sockfd
+ * @brief Set the mount options of the volume
+ * @param vol Volume struct: the volume, options are reset to default first
+ * @param options char*: comma separated options, NULL for default
+ *        strictatime, noatime, relatime, lazytime, lazymeta, extents, inline
+ * @return int 0 if success, -1 if an option is invalid
+ */
+int parse_mount_options(Volume* vol, char* options);
+
+/**
+ * @brief Initialize a connection to the disk server with no request in flight
+ * @param disk DiskChannel struct: the channel
+ * @param sockfd int: socket connected to the disk server
+ */
+void init_channel(DiskChannel* disk, int sockfd);
+
+/**
+ * @brief Make the calling thread send its requests through its own channel,
+ *        so they are not queued behind the requests of the other threads
+ * @param disk DiskChannel struct: initialized channel, must outlive the thread
+ */
+void attach_channel(DiskChannel* disk);
+
+/**
+ * @brief Initialize the volume, including the locks
+ * @param vol Volume struct: must contain an initialized disk channel, called once
  * @return int 0 if valid, -1 if need to format
  */
 int init_volume(Volume* vol);
 
 /**
  * @brief Format the disk by creating metadata blocks
- * @param vol Volume struct: must contain valid sockfd and blockptr->s_total_size
+ * @param vol Volume struct: must contain an initialized disk channel and blockptr->s_total_size
  * @return int 0 if success, -1 if failed. vol->blockptr will be updated
  */
 int format_disk(Volume* vol);
 
 /**
  * @brief Load metadata blocks from disk
- * @param vol Volume struct: must contain valid sockfd
+ * @param vol Volume struct: must contain an initialized disk channel
  * @return int 0 if success, -1 if failed. vol->blockptr will be updated
  */
 int load_meta_blocks(Volume* vol);
 
 /**
- * @brief Save metadata blocks to disk
+ * @brief Mark the metadata block containing a byte of MetaBlocks as changed
+ * @param vol Volume struct: the volume
+ * @param offset int: offset of the changed byte in MetaBlocks
+ */
+void mark_meta_dirty(Volume* vol, int offset);
+
+/**
+ * @brief Save the changed metadata blocks to disk, deferred to confirm_sync if lazy_meta
  * @param vol Volume struct: must be a valid disk
  * @return int 0 if success, -1 if failed
  */
 int save_meta_blocks(Volume* vol);
 
+/**
+ * @brief Find a zero bit in a bitmap word by word, starting from the cursor
+ * @param bitmap u_int32_t*: the bitmap
+ * @param nbits u_int32_t: number of valid bits
+ * @param cursor u_int32_t*: word to start from, will be updated to the word found
+ * @return int >=0 index of the bit, -1 if the bitmap is full
+ */
+int find_zero_bit(u_int32_t* bitmap, u_int32_t nbits, u_int32_t* cursor);
+
 /**
  * @brief Allocate a block
  * @return int >=0 block index, -1 if failed
  */
 int allocate_block(Volume* vol);
 
+/**
+ * @brief Allocate n blocks at once, nothing is allocated if there are not enough
+ * @param vol Volume struct: a valid disk
+ * @param n int: number of blocks
+ * @param out u_int32_t*: buffer of n data block idx
+ * @return int 0 if success, -1 if failed. out will be updated
+ */
+int allocate_blocks(Volume* vol, int n, u_int32_t* out);
+
+/**
+ * @brief Allocate n blocks in as few contiguous runs as possible, nothing is allocated if there are not enough
+ *        The blocks free from the goal are taken first, then the first run holding all the blocks,
+ *        and on a fragmented volume the smallest run holding the rest or else the largest run
+ * @param vol Volume struct: a valid disk
+ * @param n int: number of blocks
+ * @param goal int: block to start from, -1 if none
+ * @param out u_int32_t*: buffer of n data block idx, in the order of the runs
+ * @return int 0 if success, -1 if failed. out will be updated
+ */
+int allocate_extent(Volume* vol, int n, int goal, u_int32_t* out);
+
 /**
  * @brief Free a block
  * @param vol Volume struct: a valid disk
@@ -95,7 +277,114 @@ int allocate_block(Volume* vol);
 int free_block(Volume* vol, int data_block);
 
 /**
- * @brief Read a block from disk
+ * @brief Send a request to the disk server without waiting for the response
+ * @param vol Volume struct: a valid disk
+ * @param request char*: the request starting with a Command header, tag will be assigned
+ * @param req_len int: length of the request
+ * @param buffer char*: buffer to store the response payload, NULL if no payload
+ * @param len u_int32_t: expected length of the response payload
+ * @return int >=0 tag of the request, -1 if failed
+ */
+int submit_request(Volume* vol, char* request, int req_len, char* buffer, u_int32_t len);
+
+/**
+ * @brief Wait for the response of a submitted request, completions of
+ *        other requests arriving first are matched by their tags
+ * @param vol Volume struct: a valid disk
+ * @param tag int: tag returned by submit_request
+ * @return int 0 if success, -1 if failed. buffer of the request will be updated
+ */
+int wait_request(Volume* vol, int tag);
+
+/**
+ * @brief Check if the disk server closed the connection, only looked at while no request is in flight
+ * @param vol Volume struct: a valid disk
+ * @return bool false if disconnected
+ */
+bool disk_connected(Volume* vol);
+
+/**
+ * @brief Drop all the blocks, inodes and names in the caches without writing them back
+ * @param vol Volume struct: the volume
+ */
+void init_cache(Volume* vol);
+
+/**
+ * @brief Look up a name of a directory in the dentry cache
+ * @param vol Volume struct: the volume
+ * @param parent int: inode index of the directory
+ * @param name char*: the name, not terminated
+ * @param len int: length of the name
+ * @param mode u_int16_t*: inode mode of the name, updated if found
+ * @return int inode index of the name, DENTRY_NEGATIVE if it does not exist, DENTRY_MISS if not cached
+ */
+int lookup_dentry(Volume* vol, int parent, char* name, int len, u_int16_t* mode);
+
+/**
+ * @brief Keep a name of a directory in the dentry cache, evicting with CLOCK if the cache is full
+ *        Names longer than DENTRY_NAME are not kept
+ * @param vol Volume struct: the volume
+ * @param parent int: inode index of the directory
+ * @param name char*: the name, not terminated
+ * @param len int: length of the name
+ * @param inode_idx int: inode index of the name, DENTRY_NEGATIVE if it does not exist
+ * @param mode u_int16_t: inode mode of the name
+ */
+void insert_dentry(Volume* vol, int parent, char* name, int len, int inode_idx, u_int16_t mode);
+
+/**
+ * @brief Drop all the names of a directory from the dentry cache, once the directory is removed
+ * @param vol Volume struct: the volume
+ * @param parent int: inode index of the directory
+ */
+void drop_dentries(Volume* vol, int parent);
+
+/**
+ * @brief Write all the dirty inodes and blocks in the caches back to disk
+ * @param vol Volume struct: a valid disk
+ * @return int 0 if success, -1 if failed
+ */
+int flush_cache(Volume* vol);
+
+/**
+ * @brief Read an inode record through the inode cache
+ * @param vol Volume struct: a valid disk
+ * @param inode_idx int: inode index, must be valid
+ * @param buffer char*: buffer of SIZE_INODE bytes
+ * @return int 0 if success, -1 if failed. buffer will be updated
+ */
+int read_inode_record(Volume* vol, int inode_idx, char* buffer);
+
+/**
+ * @brief Write an inode record into the inode cache, written back to the
+ *        inode table on flush or eviction
+ * @param vol Volume struct: a valid disk
+ * @param inode_idx int: inode index, must be valid
+ * @param buffer char*: SIZE_INODE bytes to write
+ * @return int 0 if success, -1 if failed
+ */
+int write_inode_record(Volume* vol, int inode_idx, char* buffer);
+
+/**
+ * @brief Write an inode record whose timestamps changed only into the inode cache,
+ *        written back to the inode table on sync or eviction
+ * @param vol Volume struct: a valid disk
+ * @param inode_idx int: inode index, must be valid
+ * @param buffer char*: SIZE_INODE bytes to write
+ * @return int 0 if success, -1 if failed
+ */
+int touch_inode_record(Volume* vol, int inode_idx, char* buffer);
+
+/**
+ * @brief Write the dirty inodes back to the inode table, grouped by block
+ * @param vol Volume struct: a valid disk
+ * @param lazy bool: also write the inodes with lazy timestamps
+ * @return int 0 if success, -1 if failed
+ */
+int flush_inodes(Volume* vol, bool lazy);
+
+/**
+ * @brief Read a block through the block cache
  * @param vol Volume struct: a valid disk
  * @param disk_block int: block idx of disk (not data block idx)
  * @param buffer char*: buffer to store data
@@ -113,7 +402,7 @@ int read_block(Volume* vol, int disk_block, char* buffer);
 int read_data(Volume* vol, int data_block, char* buffer);
 
 /**
- * @brief Write a block to disk
+ * @brief Write a block into the block cache, written back on flush or eviction
  * @param vol Volume struct: a valid disk
  * @param disk_block int: block idx of disk (not data block idx)
  * @param buffer char*: data to write
@@ -131,7 +420,66 @@ int write_block(Volume* vol, int disk_block, char* buffer);
 int write_data(Volume* vol, int data_block, char* buffer);
 
 /**
- * @brief Confirm operation and sync to disk
+ * @brief Read a list of blocks from disk with vectored commands
+ * @param vol Volume struct: a valid disk
+ * @param count int: number of blocks
+ * @param disk_blocks u_int32_t*: block idx of disk (not data block idx)
+ * @param buffer char*: buffer to store data, count * SIZE_BLOCK bytes
+ * @return int 0 if success, -1 if failed. buffer will be updated
+ */
+int read_block_vec(Volume* vol, int count, u_int32_t* disk_blocks, char* buffer);
+
+/**
+ * @brief Read a list of data blocks from disk with vectored commands
+ * @param vol Volume struct: a valid disk
+ * @param count int: number of blocks
+ * @param data_blocks u_int32_t*: block idx of data blocks
+ * @param buffer char*: buffer to store data, count * SIZE_BLOCK bytes
+ * @return int 0 if success, -1 if failed. buffer will be updated
+ */
+int read_data_vec(Volume* vol, int count, u_int32_t* data_blocks, char* buffer);
+
+/**
+ * @brief Submit a read of data blocks with one vectored command, without waiting for it.
+ *        The blocks dirty in the cache are written back first
+ * @param vol Volume struct: a valid disk
+ * @param count int: number of blocks, at most MAX_VEC_SECTORS
+ * @param data_blocks u_int32_t*: block idx of data blocks
+ * @param buffer char*: buffer to store data, count * SIZE_BLOCK bytes, kept until finish_data_read
+ * @return int tag of the request, -1 if failed
+ */
+int submit_data_read(Volume* vol, int count, u_int32_t* data_blocks, char* buffer);
+
+/**
+ * @brief Wait for a read submitted by submit_data_read
+ * @param vol Volume struct: a valid disk
+ * @param tag int: tag returned by submit_data_read
+ * @return int 0 if success, -1 if failed. buffer of the request will be updated
+ */
+int finish_data_read(Volume* vol, int tag);
+
+/**
+ * @brief Write a list of blocks to disk with vectored commands
+ * @param vol Volume struct: a valid disk
+ * @param count int: number of blocks
+ * @param disk_blocks u_int32_t*: block idx of disk (not data block idx)
+ * @param buffer char*: data to write, count * SIZE_BLOCK bytes
+ * @return int 0 if success, -1 if failed
+ */
+int write_block_vec(Volume* vol, int count, u_int32_t* disk_blocks, char* buffer);
+
+/**
+ * @brief Write a list of data blocks to disk with vectored commands
+ * @param vol Volume struct: a valid disk
+ * @param count int: number of blocks
+ * @param data_blocks u_int32_t*: block idx of data blocks
+ * @param buffer char*: data to write, count * SIZE_BLOCK bytes
+ * @return int 0 if success, -1 if failed
+ */
+int write_data_vec(Volume* vol, int count, u_int32_t* data_blocks, char* buffer);
+
+/**
+ * @brief Confirm operation: flush the block cache and sync to disk
  * @param vol Volume struct: a valid disk
  * @return int 0 if success, -1 if failed
  */
@@ -12,6 +12,12 @@
 
 #define DIR_ENTEY_OFFSET 2
 #define DIR_INIT_SIZE 17  // 2 + (2 * 3 + 1) + (2 * 3 + 2)
+#define DIR_RECORD_HEAD 6  // Mode, inode and name length of a record
+
+#define SHIFT_CHUNK (32 * SIZE_BLOCK)  // Bytes moved at a time by shift_file
+
+#define STREAM_BLOCKS 16  // Blocks per chunk of a stream, one response chunk of the file server
+#define STREAM_RING 4     // Chunks of a stream, read ahead while the oldest is sent
 
 typedef struct FileType {
     Inode* inodeptr;
@@ -20,6 +26,22 @@ typedef struct FileType {
     u_int32_t start_block;
 } FileType;
 
+typedef struct StreamChunk {
+    int tag;         // Tag of the read in flight, -1 if none
+    u_int32_t cnt;   // Number of blocks
+    u_int32_t blocks[STREAM_BLOCKS];
+    char data[STREAM_BLOCKS * SIZE_BLOCK];
+} StreamChunk;
+
+typedef struct FileStream {
+    Inode* inodeptr;
+    u_int32_t next_block;  // Next block of the file to be read ahead
+    u_int32_t offset;      // Next byte of the file to be returned
+    int head;              // Chunk to be returned next
+    int count;             // Chunks read ahead
+    StreamChunk ring[STREAM_RING];
+} FileStream;
+
 typedef struct DirEntry {
     u_int16_t inode_mode;
     u_int16_t inode_idx;
@@ -27,12 +49,25 @@ typedef struct DirEntry {
     char* filename;
 } DirEntry;
 
+#define DIR_HASH_MIN 16  // Buckets of the name index of a small directory
+
+typedef struct DirIndex {
+    int size;   // Buckets, a power of two not smaller than the entries
+    int cap;    // Entries next can hold
+    int* head;  // First entry of each bucket, -1 if empty
+    int* next;  // Next entry of the same bucket by entry, -1 if last
+} DirIndex;
+
 typedef struct DirType {
     Inode* inodeptr;
     char* orig_data;
     DirEntry* dir_entries;
-    u_int16_t dir_size;
-    u_int16_t tot_size;
+    DirIndex* index;      // Entries by name, NULL if not built
+    u_int16_t* holes;     // Offsets of the free records, reused by new entries
+    u_int16_t n_holes;    // Free records
+    u_int16_t hole_size;  // Bytes of the free records
+    u_int16_t dir_size;   // Entries in use
+    u_int16_t tot_size;   // Bytes of the directory file, free records included
 } DirType;
 
 /**
@@ -43,6 +78,42 @@ typedef struct DirType {
  */
 int read_file(Volume* vol, FileType* file);
 
+/**
+ * @brief Read a range of a file, only the blocks in the range are mapped and read
+ * @param vol Volume struct: the formatted disk
+ * @param inodeptr Inode struct: the inode of the file
+ * @param offset u_int32_t: first byte to be read
+ * @param len u_int32_t: number of bytes to be read, cut at the end of the file
+ * @param buf char*: buffer of at least len bytes
+ * @return int number of bytes read, -1 if failed. buf will be updated
+ */
+int read_file_range(Volume* vol, Inode* inodeptr, u_int32_t offset, u_int32_t len, char* buf);
+
+/**
+ * @brief Open a file to be read chunk by chunk, the first chunks are read ahead
+ * @param vol Volume struct: the formatted disk
+ * @param inodeptr Inode struct: the inode of the file, kept until close_stream
+ * @param stream FileStream struct: the stream to be initialized
+ * @return int 0 if success, -1 if failed
+ */
+int open_stream(Volume* vol, Inode* inodeptr, FileStream* stream);
+
+/**
+ * @brief Return the next chunk of a stream, the chunk returned before is reused to read ahead
+ * @param vol Volume struct: the formatted disk
+ * @param stream FileStream struct: an opened stream
+ * @param data char**: pointer to the chunk, valid until the next call
+ * @return int number of bytes in the chunk, 0 at the end of the file, -1 if failed
+ */
+int read_stream(Volume* vol, FileStream* stream, char** data);
+
+/**
+ * @brief Close a stream, waiting for the reads still in flight
+ * @param vol Volume struct: the formatted disk
+ * @param stream FileStream struct: an opened stream
+ */
+void close_stream(Volume* vol, FileStream* stream);
+
 /**
  * @brief Write a file to disk
  * @param vol Volume struct: the formatted disk
@@ -52,12 +123,97 @@ int read_file(Volume* vol, FileType* file);
 int write_file(Volume* vol, FileType* file);
 
 /**
- * @brief Parse a directory from a file
+ * @brief Write a range of a file, only the blocks in the range are written
+ * @param vol Volume struct: the formatted disk
+ * @param inodeptr Inode struct: the inode of the file, will be updated
+ * @param offset u_int32_t: first byte to be written, a gap after the end of the file is filled with zeros
+ * @param len u_int32_t: number of bytes to be written, the file grows if needed
+ * @param buf char*: data to be written
+ * @return int number of bytes written, -1 if failed
+ */
+int write_file_range(Volume* vol, Inode* inodeptr, u_int32_t offset, u_int32_t len, char* buf);
+
+/**
+ * @brief Cut a file to size bytes, freeing the blocks after
+ * @param vol Volume struct: the formatted disk
+ * @param inodeptr Inode struct: the inode of the file, will be updated
+ * @param size u_int32_t: new size, nothing is done if not smaller
+ * @return int 0 if success, -1 if failed
+ */
+int truncate_file(Volume* vol, Inode* inodeptr, u_int32_t size);
+
+/**
+ * @brief Move the data of a file from pos to the end by delta bytes, SHIFT_CHUNK bytes at a time
+ * @param vol Volume struct: the formatted disk
+ * @param inodeptr Inode struct: the inode of the file, will be updated
+ * @param pos u_int32_t: first byte to be moved
+ * @param delta int: bytes to move by, the file grows if positive and is cut if negative
+ * @return int 0 if success, -1 if failed
+ */
+int shift_file(Volume* vol, Inode* inodeptr, u_int32_t pos, int delta);
+
+/**
+ * @brief Parse a directory from a file, the names are indexed and the free records are kept aside
  * @param file FileType struct: the original file to be parsed
  * @return int 0 if success, -1 if failed. dir will be updated & allocated
  */
 int parse_dir(FileType* file, DirType* dir);
 
+/**
+ * @brief Build the name index of a directory, sized to its entries
+ * @param dir DirType struct: the directory, dir->index will be replaced
+ * @return int 0 if success, -1 if failed
+ */
+int index_dir(DirType* dir);
+
+/**
+ * @brief Find an entry of a directory by name through its index
+ * @param dir DirType struct: an indexed directory
+ * @param name char*: the name, not terminated
+ * @param len int: length of the name
+ * @return int index of the entry, -1 if not found
+ */
+int index_dir_search(DirType* dir, char* name, int len);
+
+/**
+ * @brief Add an entry to the index of a directory, the buckets are doubled once outnumbered
+ * @param dir DirType struct: an indexed directory, the entry must be in dir->dir_entries
+ * @param entry_idx int: index of the entry
+ * @return int 0 if success, -1 if failed
+ */
+int index_dir_add(DirType* dir, int entry_idx);
+
+/**
+ * @brief Remove an entry from the index of a directory, before it is removed from dir->dir_entries
+ *        The last entry is taken as moved into its place
+ * @param dir DirType struct: an indexed directory
+ * @param entry_idx int: index of the entry
+ */
+void index_dir_remove(DirType* dir, int entry_idx);
+
+/**
+ * @brief Add an entry to a directory, only the record and the header are written
+ *        A free record the entry fits in is reused, otherwise the entry is appended
+ * @param vol Volume struct: the formatted disk
+ * @param dir DirType struct: a parsed directory, will be updated
+ * @param mode u_int16_t: inode mode of the entry
+ * @param inode_idx u_int16_t: inode index of the entry
+ * @param name char*: the name, not terminated
+ * @param len u_int16_t: length of the name
+ * @return int index of the new entry, -1 if failed
+ */
+int dir_add_entry(Volume* vol, DirType* dir, u_int16_t mode, u_int16_t inode_idx, char* name, u_int16_t len);
+
+/**
+ * @brief Remove an entry from a directory by marking its record free
+ *        The directory is compacted once half of it is free or no entry is left
+ * @param vol Volume struct: the formatted disk
+ * @param dir DirType struct: a parsed directory, will be updated
+ * @param entry_idx int: index of the entry, the last entry is moved into its place
+ * @return int 0 if success, -1 if failed
+ */
+int dir_remove_entry(Volume* vol, DirType* dir, int entry_idx);
+
 /**
  * @brief Initialize a directory
  * @param file FileType struct: the target file to be initialized, must contain valid inodeptr
@@ -75,7 +231,7 @@ int init_dir(FileType* file, bool is_root);
 int encode_dir(DirType* dir, FileType* file);
 
 /**
- * @brief Free a directory
+ * @brief Free a directory, its index and its free records
  * @param dir DirType struct: the directory to be freed
  */
 void free_dir(DirType* dir);
@@ -31,8 +31,23 @@
 #define OTHER_W 0b000010
 #define OTHER_X 0b000001
 
+#define INODE_EXTENTS 0b0001  // i_flags: blocks are mapped by extents
+#define INODE_INLINE 0b0010   // i_flags: data is kept in the inode, no blocks
+
+#define INLINE_SIZE 36  // Bytes of data kept in the inode
+
+#define EXTENTS_INODE 4                              // Extents kept in the inode
+#define EXTENTS_BLOCK (SIZE_BLOCK / sizeof(Extent))  // Extents spilled into the extent block
+#define EXTENTS_MAX (EXTENTS_INODE + EXTENTS_BLOCK)  // A file needing more is converted to pointers
+
+typedef struct Extent {
+    u_int32_t e_start;  // First data block
+    u_int32_t e_len;    // Number of blocks, 0 if unused
+} Extent;
+
 typedef struct Inode {
-    u_int8_t i_mode;        // File mode, 0 = unused, 1 = file, 2 = directory
+    u_int8_t i_mode : 4;    // File mode, 0 = unused, 1 = file, 2 = directory
+    u_int8_t i_flags : 4;   // Format flags, INODE_EXTENTS | INODE_INLINE
     u_int8_t i_nlink;       // Links count
     u_int16_t i_uid;        // User ID
     u_int16_t i_prem;       // Permissions
@@ -43,10 +58,19 @@ typedef struct Inode {
     u_int32_t i_atime;      // Access time
     u_int32_t i_mtime;      // Modification time
     u_int32_t i_ctime;      // Creation time
-    u_int32_t i_direct[7];  // Pointers to data blocks
-    u_int32_t i_indirect;   // Pointer to indirect block
-    u_int32_t i_dindirect;  // Pointer to double indirect block
-} Inode;                    // Total = 64 bytes
+    union {
+        struct {
+            u_int32_t i_direct[7];  // Pointers to data blocks
+            u_int32_t i_indirect;   // Pointer to indirect block
+            u_int32_t i_dindirect;  // Pointer to double indirect block
+        };
+        struct {
+            Extent i_extent[EXTENTS_INODE];  // Extents of the first blocks, if INODE_EXTENTS
+            u_int32_t i_extent_block;        // Pointer to the extent block, used if more extents
+        };
+        char i_data[INLINE_SIZE];  // Data of the file, if INODE_INLINE
+    };
+} Inode;  // Total = 64 bytes
 
 /**
  * @brief Allocate an inode
@@ -61,21 +85,73 @@ int allocate_inode(Volume* vol);
 int free_inode(Volume* vol, int inode_idx);
 
 /**
- * @brief Read an inode from disk
+ * @brief Lock the contents of a file, the stripe of the inode is shared by a few inodes
+ * @param vol Volume struct: the formatted disk
+ * @param inode_idx int: inode index
+ * @param write bool: exclusive to change the file, shared to read it
+ */
+void lock_inode(Volume* vol, int inode_idx, bool write);
+
+/**
+ * @brief Lock the contents of a file exclusively if no one holds its stripe
+ * @param vol Volume struct: the formatted disk
+ * @param inode_idx int: inode index
+ * @return int 0 if locked, -1 if the stripe is busy
+ */
+int try_lock_inode(Volume* vol, int inode_idx);
+
+/**
+ * @brief Unlock the contents of a file locked by lock_inode
+ * @param vol Volume struct: the formatted disk
+ * @param inode_idx int: inode index
+ */
+void unlock_inode(Volume* vol, int inode_idx);
+
+/**
+ * @brief Read an inode through the inode cache
  * @param vol Volume struct: the formatted disk
  * @param inode Inode struct: must contain valid i_idx
  */
 int read_inode(Volume* vol, Inode* inode);
 
 /**
- * @brief Write an inode to disk
+ * @brief Write an inode into the inode cache, written back on flush or eviction
  * @param vol Volume struct: the formatted disk
  * @param inode Inode struct: the inode to be written
  */
 int write_inode(Volume* vol, Inode* inode);
 
 /**
- * @brief Helper function to allocate blocks for a file
+ * @brief Update the access time of an inode according to the atime mode of the volume
+ * @param vol Volume struct: the formatted disk
+ * @param inode Inode struct: the inode read, will be updated
+ * @return int 0 if success, -1 if failed
+ */
+int touch_inode(Volume* vol, Inode* inode);
+
+/**
+ * @brief Helper function to read the extents of a file
+ * @param vol Volume struct: the formatted disk
+ * @param inodeptr Inode struct: the inode of the file, in extent mode
+ * @param block_cnt u_int32_t: blocks of the file to be covered by the extents
+ * @param extents Extent*: buffer of EXTENTS_MAX extents
+ * @return int number of extents, -1 if failed
+ */
+int _read_extents(Volume* vol, Inode* inodeptr, u_int32_t block_cnt, Extent* extents);
+
+/**
+ * @brief Helper function to write the extents of a file, allocating or freeing the extent block
+ * @param vol Volume struct: the formatted disk
+ * @param inodeptr Inode struct: the inode of the file, will be updated
+ * @param extents Extent*: the extents of the file
+ * @param count int: number of extents
+ * @param old_count int: number of extents before the update
+ * @return int 0 if success, -1 if failed
+ */
+int _write_extents(Volume* vol, Inode* inodeptr, Extent* extents, int count, int old_count);
+
+/**
+ * @brief Helper function to allocate blocks for a file, by pointers or by extents
  * @param vol Volume struct: the formatted disk
  * @param inodeptr Inode struct: the inode of the file, will be updated
  * @param block_cnt u_int32_t: total block count of the file
@@ -86,7 +162,7 @@ int write_inode(Volume* vol, Inode* inode);
 int _allocate_file_blocks(Volume* vol, Inode* inodeptr, u_int32_t block_cnt, u_int32_t* indirect, u_int32_t* dindirect);
 
 /**
- * @brief Helper function to free blocks of a file
+ * @brief Helper function to free blocks of a file, by pointers or by extents
  * @param vol Volume struct: the formatted disk
  * @param inodeptr Inode struct: the inode of the file, will be updated
  * @param block_cnt u_int32_t: total block count of the file
@@ -96,6 +172,17 @@ int _allocate_file_blocks(Volume* vol, Inode* inodeptr, u_int32_t block_cnt, u_i
  */
 int _free_file_blocks(Volume* vol, Inode* inodeptr, u_int32_t block_cnt, u_int32_t* indirect, u_int32_t* dindirect);
 
+/**
+ * @brief Helper function to map file blocks to data blocks, by pointers or by extents
+ * @param vol Volume struct: the formatted disk
+ * @param inodeptr Inode struct: the inode of the file, blocks in range must be allocated
+ * @param start u_int32_t: first block of the file to be mapped
+ * @param cnt u_int32_t: number of blocks to be mapped
+ * @param blocks u_int32_t*: buffer of cnt data block idx
+ * @return int 0 if success, -1 if failed. blocks will be updated
+ */
+int _map_file_blocks(Volume* vol, Inode* inodeptr, u_int32_t start, u_int32_t cnt, u_int32_t* blocks);
+
 /**
  * @brief Print inode information
  * @param vol Volume struct: the formatted disk, contains the socket file descriptor
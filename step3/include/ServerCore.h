@@ -23,15 +23,10 @@
 #include <string.h>
 #include <stdbool.h>
 
-#define MAX_CLIENTS 30
 #define MAX_BUF_SIZE 8192
 
 int init_server(struct sockaddr_in *address, int PORT);
 
 int accept_new(int master_socket, struct sockaddr_in *address, int *addrlen);
 
-void disconnect(int *client_socket, pid_t *pid_list, int status);
-
-void check_exit(fd_set *controlfds, int *client_socket, pid_t *pid_list);
-
 #endif
\ No newline at end of file
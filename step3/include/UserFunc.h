@@ -22,13 +22,21 @@
 #define PERMISSION_DENIED -8
 #define INVALID_USER -9
 #define PASSWORD_MISMATCH -10
+#define INODE_BUSY -11  // A stream holds the file, retried once User.busy_inode is released
+#define PEER_FAILURE -12  // The response could not be sent, nothing more is written to the peer
 
 typedef struct User {
     int sockfd;
+    int unacked;             // Frames sent to the peer and not acked yet
+    int credit;              // Frames of the peer consumed and not acked yet
+    struct FrameBuffer* rx;  // Frames received from the peer
+    struct FrameQueue* tx;   // Frames to be sent to the peer, NULL if written at once
+    u_int32_t seq;           // Sequence number of the command being answered
     Volume* vol;
     u_int16_t id;
     DirType cur_dir;
     u_int32_t cache_time;
+    int busy_inode;          // Inode the last command waits for, -1 for all of them
     char username[64];
     char path[1024];
 } User;
@@ -53,7 +61,7 @@ DirEntry* _search_parent(DirType* parent, u_int16_t inode_idx);
 
 int _make_target_entry(User* user, char* targetname, u_int16_t mode);
 
-int _remove_target_entry(User* user, int entry_idx, size_t len);
+int _remove_target_entry(User* user, int entry_idx);
 
 int _remove_inode_link(Volume* vol, int inode_idx);
 
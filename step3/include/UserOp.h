@@ -83,14 +83,13 @@ int u_list_dir(User* user, AuthList* list, bool is_long, char** data, int* len);
 int u_stat_file(User* user, char* filename, char** data, int* len);
 
 /**
- * @brief Print file contents
- * @param user User struct: the user to print the file
- * @param filename char*: the filename to be printed
- * @param data char**: the data to be printed
- * @param len int*: the length of data
- * @return int 0 if success, -1 if failed
+ * @brief Open a file to be read, checking the read permission
+ * @param user User struct: the user to read the file
+ * @param filename char*: the filename to be opened
+ * @param inode Inode struct: the inode of the file, will be updated
+ * @return int 0 if success, <0 if failed. The file is locked for reading until unlock_inode
  */
-int u_cat_file(User* user, char* filename, char** data, int* len);
+int u_open_file(User* user, char* filename, Inode* inode);
 
 /**
  * @brief Write to a file
@@ -102,6 +101,16 @@ int u_cat_file(User* user, char* filename, char** data, int* len);
  */
 int u_write_file(User* user, char* filename, int length, char* data);
 
+/**
+ * @brief Append to a file
+ * @param user User struct: the user to append the file
+ * @param filename char*: the filename to be appended
+ * @param length int: the length of data
+ * @param data char*: the data to be appended
+ * @return int 0 if success, -1 if failed
+ */
+int u_append_file(User* user, char* filename, int length, char* data);
+
 /**
  * @brief Insert to a file
  * @param user User struct: the user to insert the file
@@ -34,17 +34,103 @@ void init_disk(char *filename, BasicDisk *disk) {
         exit(-1);
     }
 
+    // Keep the file open for fdatasync
     disk->fd = fd;
     disk->diskfile = disk_map;
 
-    close(fd);
+    DiskState *state = (DiskState *)malloc(sizeof(DiskState));
+    if (state == NULL) {
+        perror("malloc");
+        exit(-1);
+    }
+    pthread_mutex_init(&state->arm_lock, NULL);
+    state->current_track = 0;
+    state->sector_count = 0;
+    state->seek_count = 0;
+    state->seek_distance = 0;
+    for (int i = 0; i < LOCK_STRIPES; i++) {
+        pthread_rwlock_init(&state->sector_locks[i], NULL);
+    }
+    pthread_mutex_init(&state->dirty_lock, NULL);
+    pthread_mutex_init(&state->sync_lock, NULL);
+    state->dirty = (u_int8_t *)calloc((disk->n_cylinders * disk->n_sectors + 7) / 8, 1);
+    state->flushing = (u_int8_t *)calloc((disk->n_cylinders * disk->n_sectors + 7) / 8, 1);
+    state->dirty_count = 0;
+    if (state->dirty == NULL || state->flushing == NULL) {
+        perror("calloc");
+        exit(-1);
+    }
+    disk->state = state;
 }
 
-// Update track and delay
+// Mark a sector as written since the last sync
+static void mark_dirty(BasicDisk *disk, long block_id) {
+    DiskState *state = disk->state;
+    u_int8_t mask = 1 << (block_id % 8);
+    pthread_mutex_lock(&state->dirty_lock);
+    if (!(state->dirty[block_id / 8] & mask)) {
+        state->dirty[block_id / 8] |= mask;
+        state->dirty_count++;
+    }
+    pthread_mutex_unlock(&state->dirty_lock);
+}
+
+// Lock the stripes of the sectors in ascending order, shared for reading
+static void lock_sectors(BasicDisk *disk, int count, u_int32_t *block_ids, bool write, u_int8_t *stripes) {
+    memset(stripes, 0, LOCK_STRIPES / 8);
+    for (int i = 0; i < count; i++) {
+        int stripe = block_ids[i] % LOCK_STRIPES;
+        stripes[stripe / 8] |= 1 << (stripe % 8);
+    }
+    for (int i = 0; i < LOCK_STRIPES; i++) {
+        if (stripes[i / 8] & (1 << (i % 8))) {
+            if (write) {
+                pthread_rwlock_wrlock(&disk->state->sector_locks[i]);
+            } else {
+                pthread_rwlock_rdlock(&disk->state->sector_locks[i]);
+            }
+        }
+    }
+}
+
+static void unlock_sectors(BasicDisk *disk, u_int8_t *stripes) {
+    for (int i = LOCK_STRIPES - 1; i >= 0; i--) {
+        if (stripes[i / 8] & (1 << (i % 8))) {
+            pthread_rwlock_unlock(&disk->state->sector_locks[i]);
+        }
+    }
+}
+
+// Update track and delay, the arm is shared by all the connections
 void update_track(BasicDisk *disk, int cylinder) {
-    int track_diff = abs(disk->current_track - cylinder);
-    disk->current_track = cylinder;
+    pthread_mutex_lock(&disk->state->arm_lock);
+    int track_diff = abs(disk->state->current_track - cylinder);
+    disk->state->current_track = cylinder;
+    disk->state->seek_distance += track_diff;
+    disk->state->seek_count += track_diff > 0;
     usleep(track_diff * disk->track_to_track_delay);
+    pthread_mutex_unlock(&disk->state->arm_lock);
+}
+
+// Current track of the shared arm
+int arm_position(BasicDisk *disk) {
+    pthread_mutex_lock(&disk->state->arm_lock);
+    int track = disk->state->current_track;
+    pthread_mutex_unlock(&disk->state->arm_lock);
+    return track;
+}
+
+// Read exactly len bytes from the socket of the disk
+int read_from_socket(BasicDisk *disk, char *buffer, size_t len) {
+    size_t received = 0;
+    while (received < len) {
+        int nbytes = read(disk->socket_fd, buffer + received, len - received);
+        if (nbytes <= 0) {
+            return nbytes;
+        }
+        received += nbytes;
+    }
+    return received;
 }
 
 // Write to the socket of the disk
@@ -55,37 +141,184 @@ void write_to_socket(BasicDisk *disk, char *response, size_t len) {
     }
 }
 
+// Write the whole iovec to the socket, -1 if failed
+static int _send_all(int sockfd, struct iovec *iov, int iovcnt, size_t total) {
+    size_t sent = 0;
+    while (sent < total) {
+        ssize_t nbytes = writev(sockfd, iov, iovcnt);
+        if (nbytes < 0) {
+            perror("Error writing to socket");
+            return -1;
+        }
+        sent += nbytes;
+        // Skip the part already sent
+        for (int i = 0; i < iovcnt && nbytes > 0; i++) {
+            size_t skip = (size_t)nbytes < iov[i].iov_len ? (size_t)nbytes : iov[i].iov_len;
+            iov[i].iov_base = (char *)iov[i].iov_base + skip;
+            iov[i].iov_len -= skip;
+            nbytes -= skip;
+        }
+    }
+    return 0;
+}
+
+// Append a response to the outbox, the caller never waits for the socket
+static void _outbox_put(Outbox *outbox, Response *header, char *payload, u_int32_t len) {
+    pthread_mutex_lock(&outbox->lock);
+    size_t need = outbox->len + SIZE_RESP_BASIC + len;
+    if (!outbox->failed && need > outbox->cap) {
+        size_t cap = outbox->cap == 0 ? MAX_BUF_SIZE : outbox->cap;
+        while (cap < need) {
+            cap *= 2;
+        }
+        char *data = (char *)realloc(outbox->data, cap);
+        if (data == NULL) {
+            perror("realloc");
+            outbox->failed = true;
+        } else {
+            outbox->data = data;
+            outbox->cap = cap;
+        }
+    }
+    if (!outbox->failed) {
+        memcpy(outbox->data + outbox->len, header, SIZE_RESP_BASIC);
+        if (len > 0) {
+            memcpy(outbox->data + outbox->len + SIZE_RESP_BASIC, payload, len);
+        }
+        outbox->len = need;
+    }
+    pthread_cond_broadcast(&outbox->changed);
+    pthread_mutex_unlock(&outbox->lock);
+}
+
+// Send the response header and the payload of a request
+void respond(BasicDisk *disk, u_int32_t tag, u_int16_t type, u_int16_t status, char *payload, u_int32_t len) {
+    Response header;
+    header.tag = tag;
+    header.type = type;
+    header.status = status;
+    header.len = len;
+    if (disk->outbox != NULL) {
+        _outbox_put(disk->outbox, &header, payload, len);
+        return;
+    }
+    struct iovec iov[2];
+    iov[0].iov_base = &header;
+    iov[0].iov_len = SIZE_RESP_BASIC;
+    iov[1].iov_base = payload;
+    iov[1].iov_len = len;
+    _send_all(disk->socket_fd, iov, len > 0 ? 2 : 1, SIZE_RESP_BASIC + len);
+}
+
+void init_outbox(Outbox *outbox) {
+    outbox->data = NULL;
+    outbox->len = 0;
+    outbox->cap = 0;
+    outbox->closed = false;
+    outbox->failed = false;
+    pthread_mutex_init(&outbox->lock, NULL);
+    pthread_cond_init(&outbox->changed, NULL);
+}
+
+void send_outbox(BasicDisk *disk) {
+    Outbox *outbox = disk->outbox;
+    char *buffer = NULL;
+    size_t cap = 0;
+    pthread_mutex_lock(&outbox->lock);
+    while (1) {
+        while (outbox->len == 0 && !outbox->closed) {
+            pthread_cond_wait(&outbox->changed, &outbox->lock);
+        }
+        if (outbox->len == 0) {
+            break;
+        }
+        // Swap the buffers, the arm appends to the other one while this one is written
+        char *data = outbox->data;
+        size_t data_cap = outbox->cap;
+        size_t len = outbox->len;
+        outbox->data = buffer;
+        outbox->cap = cap;
+        outbox->len = 0;
+        buffer = data;
+        cap = data_cap;
+        pthread_mutex_unlock(&outbox->lock);
+
+        struct iovec iov = {buffer, len};
+        int res = _send_all(disk->socket_fd, &iov, 1, len);
+
+        pthread_mutex_lock(&outbox->lock);
+        if (res < 0) {
+            outbox->failed = true;
+            outbox->len = 0;
+        }
+        pthread_cond_broadcast(&outbox->changed);
+    }
+    pthread_mutex_unlock(&outbox->lock);
+    free(buffer);
+}
+
+void outbox_wait_room(BasicDisk *disk) {
+    Outbox *outbox = disk->outbox;
+    pthread_mutex_lock(&outbox->lock);
+    while (outbox->len >= OUTBOX_MAX && !outbox->failed) {
+        pthread_cond_wait(&outbox->changed, &outbox->lock);
+    }
+    pthread_mutex_unlock(&outbox->lock);
+}
+
+void close_outbox(BasicDisk *disk) {
+    Outbox *outbox = disk->outbox;
+    pthread_mutex_lock(&outbox->lock);
+    outbox->closed = true;
+    pthread_cond_broadcast(&outbox->changed);
+    pthread_mutex_unlock(&outbox->lock);
+}
+
+void destroy_outbox(Outbox *outbox) {
+    pthread_mutex_destroy(&outbox->lock);
+    pthread_cond_destroy(&outbox->changed);
+    free(outbox->data);
+}
+
+// Respond with an error message
+void respond_error(BasicDisk *disk, u_int32_t tag, u_int16_t type, char *message) {
+    fprintf(stderr, "%s", message);
+    respond(disk, tag, type, 1, message, strlen(message));
+}
+
 /*
  * Command: I
  * Information request
  */
-void info(BasicDisk *disk) {
-    static u_int16_t response[2];
+void info(BasicDisk *disk, u_int32_t tag) {
+    u_int16_t response[2];
     response[0] = disk->n_cylinders;
     response[1] = disk->n_sectors;
     fprintf(stdout, "%d %d\n", disk->n_cylinders, disk->n_sectors);
-    write_to_socket(disk, (char *)response, 4);
+    respond(disk, tag, CMD_I, 0, (char *)response, 4);
 }
 
 /*
  * Command: R <cylinder> <sector>
  * Read a sector
  */
-int read_sector(BasicDisk *disk, int cylinder, int sector) {
+int read_sector(BasicDisk *disk, u_int32_t tag, int cylinder, int sector) {
     // Check if the cylinder and sector are valid
     if (cylinder < 0 || cylinder >= disk->n_cylinders ||
         sector < 0 || sector >= disk->n_sectors) {
-        fprintf(stderr, "Invalid cylinder or sector\n");
-        write_to_socket(disk, "No - Invalid cylinder or sector\n", 33);
+        respond_error(disk, tag, CMD_R, "No - Invalid cylinder or sector\n");
         return -1;
     }
+    u_int32_t block_id = cylinder * disk->n_sectors + sector;
+    char buffer[SECTOR_SIZE];
+    u_int8_t stripes[LOCK_STRIPES / 8];
+    lock_sectors(disk, 1, &block_id, false, stripes);
     update_track(disk, cylinder);
+    disk->state->sector_count++;
+    memcpy(buffer, disk->diskfile + block_id * SECTOR_SIZE, SECTOR_SIZE);
+    unlock_sectors(disk, stripes);
 
-    int offset = (cylinder * disk->n_sectors + sector) * SECTOR_SIZE;
-    char *sector_data = disk->diskfile + offset;
-
-    write_to_socket(disk, sector_data, SECTOR_SIZE);
-    // fprintf(stdout, "%.*s\n", SECTOR_SIZE, sector_data);
+    respond(disk, tag, CMD_R, 0, buffer, SECTOR_SIZE);
     return 0;
 }
 
@@ -93,51 +326,184 @@ int read_sector(BasicDisk *disk, int cylinder, int sector) {
  * Command: W <cylinder> <sector> <length> <data>
  * Write data to a sector
  */
-int write_sector(BasicDisk *disk, int cylinder, int sector, int length, char *data) {
+int write_sector(BasicDisk *disk, u_int32_t tag, int cylinder, int sector, int length, char *data) {
     // Check if the cylinder and sector are valid
     if (cylinder < 0 || cylinder >= disk->n_cylinders ||
         sector < 0 || sector >= disk->n_sectors) {
-        fprintf(stderr, "Invalid cylinder or sector\n");
-        write_to_socket(disk, "No - Invalid cylinder or sector\n", 33);
+        respond_error(disk, tag, CMD_W, "No - Invalid cylinder or sector\n");
         return -1;
     }
     if (length < 0 || length > SECTOR_SIZE) {
-        fprintf(stderr, "Invalid length\n");
-        write_to_socket(disk, "No - Invalid length\n", 21);
+        respond_error(disk, tag, CMD_W, "No - Invalid length\n");
         return -1;
     }
+    u_int32_t block_id = cylinder * disk->n_sectors + sector;
+    u_int8_t stripes[LOCK_STRIPES / 8];
+    lock_sectors(disk, 1, &block_id, true, stripes);
     update_track(disk, cylinder);
+    disk->state->sector_count++;
 
-    int offset = (cylinder * disk->n_sectors + sector) * SECTOR_SIZE;
-    char *sector_data = disk->diskfile + offset;
+    char *sector_data = disk->diskfile + block_id * SECTOR_SIZE;
 
     // Write the data to the sector
     memcpy(sector_data, data, length);
 
     // Fill the rest of the sector with 0
     memset(sector_data + length, 0, SECTOR_SIZE - length);
+    mark_dirty(disk, block_id);
+    unlock_sectors(disk, stripes);
 
-    // write_to_socket(disk, "Yes\n");
-    write_to_socket(disk, "", 1);
+    respond(disk, tag, CMD_W, 0, NULL, 0);
     fprintf(stdout, "Yes\n");
     return 0;
+}
+
+/*
+ * Command: RV <count> <block_id...>
+ * Read a vector of sectors in one response, served in the given order (NULL for as is)
+ */
+int read_sectors(BasicDisk *disk, u_int32_t tag, int count, u_int32_t *block_ids, int *order) {
+    char response[MAX_VEC_SECTORS * SECTOR_SIZE];
+    u_int8_t stripes[LOCK_STRIPES / 8];
+    if (count <= 0 || count > MAX_VEC_SECTORS) {
+        respond_error(disk, tag, CMD_RV, "No - Invalid vector length\n");
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (block_ids[i] >= (u_int32_t)(disk->n_cylinders * disk->n_sectors)) {
+            respond_error(disk, tag, CMD_RV, "No - Invalid cylinder or sector\n");
+            return -1;
+        }
+    }
+    lock_sectors(disk, count, block_ids, false, stripes);
+    for (int k = 0; k < count; k++) {
+        int i = order == NULL ? k : order[k];
+        update_track(disk, block_ids[i] / disk->n_sectors);
+        disk->state->sector_count++;
+        memcpy(response + i * SECTOR_SIZE, disk->diskfile + block_ids[i] * SECTOR_SIZE, SECTOR_SIZE);
+    }
+    unlock_sectors(disk, stripes);
+    respond(disk, tag, CMD_RV, 0, response, count * SECTOR_SIZE);
+    return 0;
+}
 
-    // int end_sector = sector + length / SECTOR_SIZE;
-    // int end_cylinder = cylinder + end_sector / disk->n_sectors;
-    // if (cylinder < 0 || end_cylinder >= disk->n_cylinders ||
-    //     sector < 0 || sector >= disk->n_sectors) {
-    //     fprintf(disk->stderr_fd, "Invalid cylinder or sector\n");
-    //     return;
-    // }
+/*
+ * Command: WV <count> <block_id...> <data>
+ * Write a vector of sectors, data contains count * SECTOR_SIZE bytes
+ */
+int write_sectors(BasicDisk *disk, u_int32_t tag, int count, u_int32_t *block_ids, char *data, int *order) {
+    if (count <= 0 || count > MAX_VEC_SECTORS) {
+        respond_error(disk, tag, CMD_WV, "No - Invalid vector length\n");
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (block_ids[i] >= (u_int32_t)(disk->n_cylinders * disk->n_sectors)) {
+            respond_error(disk, tag, CMD_WV, "No - Invalid cylinder or sector\n");
+            return -1;
+        }
+    }
+    u_int8_t stripes[LOCK_STRIPES / 8];
+    lock_sectors(disk, count, block_ids, true, stripes);
+    for (int k = 0; k < count; k++) {
+        int i = order == NULL ? k : order[k];
+        update_track(disk, block_ids[i] / disk->n_sectors);
+        disk->state->sector_count++;
+        memcpy(disk->diskfile + block_ids[i] * SECTOR_SIZE, data + i * SECTOR_SIZE, SECTOR_SIZE);
+        mark_dirty(disk, block_ids[i]);
+    }
+    unlock_sectors(disk, stripes);
+    respond(disk, tag, CMD_WV, 0, NULL, 0);
+    return 0;
+}
 
-    // int offset = (cylinder * disk->n_sectors + sector) * SECTOR_SIZE;
-    // char *sector_data = disk->diskfile + offset;
+int sync_disk(BasicDisk *disk) {
+    DiskState *state = disk->state;
+    long total = disk->n_cylinders * disk->n_sectors;
+    pthread_mutex_lock(&state->sync_lock);
 
-    // // Write the data to the sector
-    // write(disk->socket_fd, data, length);
+    // Take the dirty sectors, the writers are not blocked by the flush
+    pthread_mutex_lock(&state->dirty_lock);
+    long count = state->dirty_count;
+    u_int8_t *flushing = state->dirty;
+    state->dirty = state->flushing;
+    state->flushing = flushing;
+    state->dirty_count = 0;
+    pthread_mutex_unlock(&state->dirty_lock);
+    if (count == 0) {
+        pthread_mutex_unlock(&state->sync_lock);
+        return 0;
+    }
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    long per_page = page_size > SECTOR_SIZE ? page_size / SECTOR_SIZE : 1;
+    long start = -1;
+    int ranges = 0;
+    int res = 0;
+
+    // msync each run of pages containing dirty sectors
+    for (long page = 0; page * per_page < total; page++) {
+        bool dirty = false;
+        for (long i = page * per_page; i < (page + 1) * per_page && i < total; i++) {
+            if (flushing[i / 8] & (1 << (i % 8))) {
+                dirty = true;
+                break;
+            }
+        }
+        if (dirty && start < 0) {
+            start = page;
+        }
+        if (start >= 0 && (!dirty || (page + 1) * per_page >= total)) {
+            long end = dirty ? page + 1 : page;
+            long len = (end - start) * per_page * SECTOR_SIZE;
+            if (len > total * SECTOR_SIZE - start * per_page * SECTOR_SIZE) {
+                len = total * SECTOR_SIZE - start * per_page * SECTOR_SIZE;
+            }
+            if (msync(disk->diskfile + start * per_page * SECTOR_SIZE, len, MS_SYNC) < 0) {
+                perror("msync");
+                res = -1;
+                break;
+            }
+            ranges++;
+            start = -1;
+        }
+    }
+    if (res == 0 && fdatasync(disk->fd) < 0) {
+        perror("fdatasync");
+        res = -1;
+    }
+
+    pthread_mutex_lock(&state->dirty_lock);
+    if (res < 0) {
+        // Kept dirty for the next flush
+        for (long i = 0; i < total; i++) {
+            if ((flushing[i / 8] & (1 << (i % 8))) && !(state->dirty[i / 8] & (1 << (i % 8)))) {
+                state->dirty[i / 8] |= 1 << (i % 8);
+                state->dirty_count++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&state->dirty_lock);
+    memset(flushing, 0, (total + 7) / 8);
+    pthread_mutex_unlock(&state->sync_lock);
+#ifdef _DEBUG
+    if (res == 0) {
+        printf("Synced %ld sectors in %d ranges\n", count, ranges);
+    }
+#endif
+    return res < 0 ? -1 : ranges;
 }
 
 void dystroy_disk(BasicDisk *disk) {
+    DiskState *state = disk->state;
+    for (int i = 0; i < LOCK_STRIPES; i++) {
+        pthread_rwlock_destroy(&state->sector_locks[i]);
+    }
+    pthread_mutex_destroy(&state->arm_lock);
+    pthread_mutex_destroy(&state->dirty_lock);
+    pthread_mutex_destroy(&state->sync_lock);
+    free(state->dirty);
+    free(state->flushing);
+    free(state);
     if (munmap(disk->diskfile, disk->n_cylinders * disk->n_sectors * SECTOR_SIZE) < 0) {
         perror("Error unmapping the diskfile from memory");
         exit(-1);
@@ -38,6 +38,8 @@ int _cmd_type(char* cmd) {
             }
         case 'w':
             return FS_WRITE;
+        case 'a':
+            return FS_APPEND;
         case 'i':
             return FS_INSERT;
         case 'd':
@@ -173,6 +175,11 @@ int get_passwd(char* data_buff, FILE* input, bool confirm) {
     return 0;
 }
 
+bool cmd_reads_input(char* cmd) {
+    int type = _cmd_type(cmd);
+    return type == FS_PASSWD || type == FS_SU;
+}
+
 int parse_command(char* cmd, CmdHeader* command, char** data, FILE* input) {
     int res;
     static const char* alnum = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
@@ -257,9 +264,11 @@ int parse_command(char* cmd, CmdHeader* command, char** data, FILE* input) {
             command->type = FS_CAT;
             return 0;
 
-        case FS_WRITE: {
+        case FS_WRITE:
+        case FS_APPEND: {
+            int type = _cmd_type(cmd);
             char* type_token = strtok(cmd, " \t");
-            if (type_token == NULL || strcmp(type_token, "w") != 0) {
+            if (type_token == NULL || strcmp(type_token, type == FS_WRITE ? "w" : "a") != 0) {
                 return -1;
             }
             char* name_token = strtok(NULL, " \t");
@@ -282,7 +291,7 @@ int parse_command(char* cmd, CmdHeader* command, char** data, FILE* input) {
             }
             strcpy(command->name, name_token);
             command->name_len = strlen(command->name);
-            command->type = FS_WRITE;
+            command->type = type;
             if ((u_int32_t)res != command->data_len) {
                 return res;
             }
@@ -525,6 +534,7 @@ void print_help() {
         "ls [-l]                                    List directory contents\n"
         "cat <filename>                             Print file contents\n"
         "w <filename> <length> <data>               Write to a file\n"
+        "a <filename> <length> <data>               Append to a file\n"
         "i <filename> <position> <length> <data>    Insert to a file\n"
         "d <filename> <position> <length>           Delete from a file\n"
         "pwd                                        Print working directory\n"
@@ -0,0 +1,383 @@
+#include "DiskQueue.h"
+
+static const char *policy_names[SCHED_COUNT] = {"FCFS", "SSTF", "SCAN", "CLOOK"};
+
+int parse_policy(char *name) {
+    for (int i = 0; i < SCHED_COUNT; i++) {
+        if (strcasecmp(name, policy_names[i]) == 0) {
+            return i;
+        }
+    }
+    if (strcasecmp(name, "C-LOOK") == 0) {
+        return SCHED_CLOOK;
+    }
+    return -1;
+}
+
+const char *policy_name(int policy) {
+    if (policy < 0 || policy >= SCHED_COUNT) {
+        return "Unknown";
+    }
+    return policy_names[policy];
+}
+
+void init_queue(DiskQueue *queue, int policy) {
+    queue->size = 0;
+    queue->policy = policy;
+    queue->direction = 1;
+    queue->sync_count = 0;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->changed, NULL);
+}
+
+int queue_receive(BasicDisk *disk, DiskQueue *queue, u_int16_t *type) {
+    DiskRequest request;
+    DiskRequest *req = &request;
+    Command *cmd = &req->cmd;
+    int nbytes = read_from_socket(disk, (char *)cmd, SIZE_CMD_BASIC);
+    if (nbytes <= 0) {
+        return nbytes;
+    }
+    printf("Received command: %d, len: %d, block_id: %d, tag: %u\n", cmd->type, cmd->len, cmd->block_id, cmd->tag);
+    *type = cmd->type;
+
+    // Receive the payload of the command
+    int payload = 0;
+    if (cmd->type == CMD_W) {
+        payload = cmd->len;
+    } else if (cmd->type == CMD_RV || cmd->type == CMD_WV) {
+        payload = cmd->len * sizeof(u_int32_t);
+    }
+    if (payload > SECTOR_SIZE) {
+        // The stream can not be recovered, answered once the arm is done with the connection
+        queue_wait_idle(queue, disk);
+        respond_error(disk, cmd->tag, cmd->type, "No - Invalid length\n");
+        return -1;
+    }
+    if (payload > 0 && read_from_socket(disk, cmd->data, payload) <= 0) {
+        return -1;
+    }
+    req->data = NULL;
+    if (cmd->type == CMD_WV) {
+        req->data = (char *)malloc(cmd->len * SECTOR_SIZE);
+        if (req->data == NULL || read_from_socket(disk, req->data, cmd->len * SECTOR_SIZE) <= 0) {
+            free(req->data);
+            return -1;
+        }
+    }
+
+    // Cylinders touched by the request, -1 if no disk access
+    req->disk = disk;
+    req->is_write = cmd->type == CMD_W || cmd->type == CMD_WV;
+    req->is_barrier = false;
+    req->cmin = -1;
+    req->cmax = -1;
+    switch (cmd->type) {
+        case CMD_I:
+            break;
+
+        case CMD_R:
+        case CMD_W:
+            req->cmin = cmd->block_id / disk->n_sectors;
+            req->cmax = req->cmin;
+            break;
+
+        case CMD_RV:
+        case CMD_WV: {
+            u_int32_t *ids = (u_int32_t *)cmd->data;
+            for (int i = 0; i < cmd->len; i++) {
+                int cylinder = ids[i] / disk->n_sectors;
+                if (req->cmin < 0 || cylinder < req->cmin) {
+                    req->cmin = cylinder;
+                }
+                if (cylinder > req->cmax) {
+                    req->cmax = cylinder;
+                }
+            }
+            break;
+        }
+
+        default:
+            // Sync, exit and invalid commands keep their order
+            req->is_barrier = true;
+            break;
+    }
+
+    // Wait for room, the connection stops reading meanwhile
+    pthread_mutex_lock(&queue->lock);
+    while (queue->size == MAX_QUEUE) {
+        pthread_cond_wait(&queue->changed, &queue->lock);
+    }
+    queue->req[queue->size++] = *req;
+    disk->pending++;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+    return 1;
+}
+
+// Two requests conflict if reordering them could change the result
+static bool _conflict(DiskRequest *a, DiskRequest *b) {
+    if (a->is_barrier || b->is_barrier) {
+        return a->disk == b->disk;
+    }
+    if (!a->is_write && !b->is_write) {
+        return false;
+    }
+    if (a->cmin < 0 || b->cmin < 0) {
+        return false;
+    }
+    return a->cmin <= b->cmax && b->cmin <= a->cmax;
+}
+
+static bool _eligible(DiskQueue *queue, int idx) {
+    for (int i = 0; i < idx; i++) {
+        if (_conflict(&queue->req[i], &queue->req[idx])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int _distance(DiskRequest *req, int head) {
+    if (head < req->cmin) {
+        return req->cmin - head;
+    } else if (head > req->cmax) {
+        return head - req->cmax;
+    }
+    return 0;
+}
+
+// Nearest eligible request, only in the direction of the arm if dir != 0
+static int _nearest(DiskQueue *queue, int head, int dir) {
+    int best = -1, best_dist = 0;
+    for (int i = 0; i < queue->size; i++) {
+        DiskRequest *req = &queue->req[i];
+        if (!_eligible(queue, i)) {
+            continue;
+        }
+        if ((dir > 0 && req->cmax < head) || (dir < 0 && req->cmin > head)) {
+            continue;
+        }
+        int dist = _distance(req, head);
+        if (best < 0 || dist < best_dist) {
+            best = i;
+            best_dist = dist;
+        }
+    }
+    return best;
+}
+
+// Pick the next request to be served according to the policy, -1 if empty
+static int _pick(BasicDisk *disk, DiskQueue *queue) {
+    if (queue->size == 0) {
+        return -1;
+    }
+    // Requests without disk access are served at once
+    for (int i = 0; i < queue->size; i++) {
+        if (queue->req[i].cmin < 0 && _eligible(queue, i)) {
+            return i;
+        }
+    }
+    int head = arm_position(disk);
+    int idx = -1;
+    switch (queue->policy) {
+        case SCHED_SSTF:
+            idx = _nearest(queue, head, 0);
+            break;
+
+        case SCHED_SCAN:
+            idx = _nearest(queue, head, queue->direction);
+            if (idx < 0) {
+                // Turn around at the last request, the arm never moves without I/O
+                queue->direction = -queue->direction;
+                idx = _nearest(queue, head, queue->direction);
+            }
+            break;
+
+        case SCHED_CLOOK:
+            idx = _nearest(queue, head, 1);
+            if (idx < 0) {
+                // Jump back to the lowest request
+                idx = _nearest(queue, 0, 1);
+            }
+            break;
+
+        default:
+            break;
+    }
+    if (idx < 0) {
+        // FCFS: the oldest request is always eligible
+        idx = 0;
+    }
+    return idx;
+}
+
+void queue_order(BasicDisk *disk, DiskQueue *queue, DiskRequest *req, int *order) {
+    if (req->cmd.type != CMD_RV && req->cmd.type != CMD_WV) {
+        return;
+    }
+    int count = req->cmd.len > MAX_VEC_SECTORS ? MAX_VEC_SECTORS : req->cmd.len;
+    u_int32_t *ids = (u_int32_t *)req->cmd.data;
+    for (int i = 0; i < count; i++) {
+        order[i] = i;
+    }
+    if (queue->policy == SCHED_FCFS) {
+        return;
+    }
+    int dir = 1;
+    if (queue->policy == SCHED_SCAN) {
+        dir = queue->direction;
+    } else if (queue->policy == SCHED_SSTF) {
+        int head = arm_position(disk);
+        dir = abs(head - req->cmin) <= abs(head - req->cmax) ? 1 : -1;
+    }
+    // Insertion sort by block id along the direction of the arm
+    for (int i = 1; i < count; i++) {
+        int cur = order[i];
+        int j = i - 1;
+        while (j >= 0 && (dir > 0 ? ids[order[j]] > ids[cur] : ids[order[j]] < ids[cur])) {
+            order[j + 1] = order[j];
+            j--;
+        }
+        order[j + 1] = cur;
+    }
+}
+
+// Remove a request from the queue, its data is kept by the caller
+static void _remove(DiskQueue *queue, int idx) {
+    memmove(&queue->req[idx], &queue->req[idx + 1], sizeof(DiskRequest) * (queue->size - idx - 1));
+    queue->size--;
+}
+
+// Add a sync request to the group commit
+static void _sync(DiskQueue *queue, DiskRequest *req) {
+    if (queue->sync_count == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &queue->sync_start);
+    }
+    queue->sync_disks[queue->sync_count] = req->disk;
+    queue->sync_tags[queue->sync_count++] = req->cmd.tag;
+}
+
+// Check if the group commit window of the waiting syncs has closed
+static bool _sync_due(DiskQueue *queue) {
+    if (queue->sync_count == 0) {
+        return false;
+    }
+    if (queue->sync_count == MAX_QUEUE) {
+        return true;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed = (now.tv_sec - queue->sync_start.tv_sec) * 1000000 + (now.tv_nsec - queue->sync_start.tv_nsec) / 1000;
+    return elapsed >= SYNC_WINDOW_US;
+}
+
+// Flush for the waiting syncs, the lock is held but released during the flush
+static int _flush(BasicDisk *disk, DiskQueue *queue) {
+    BasicDisk *disks[MAX_QUEUE];
+    u_int32_t tags[MAX_QUEUE];
+    int count = queue->sync_count;
+    memcpy(disks, queue->sync_disks, sizeof(BasicDisk *) * count);
+    memcpy(tags, queue->sync_tags, sizeof(u_int32_t) * count);
+    queue->sync_count = 0;
+    pthread_mutex_unlock(&queue->lock);
+
+    int res = sync_disk(disk);
+#ifdef _DEBUG
+    printf("Group commit of %d sync requests\n", count);
+#endif
+    for (int i = 0; i < count; i++) {
+        if (res < 0) {
+            respond_error(disks[i], tags[i], CMD_S, "No - Sync failed\n");
+        } else {
+            respond(disks[i], tags[i], CMD_S, 0, NULL, 0);
+        }
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    for (int i = 0; i < count; i++) {
+        disks[i]->pending--;
+    }
+    pthread_cond_broadcast(&queue->changed);
+    return res < 0 ? -1 : 0;
+}
+
+void queue_next(BasicDisk *disk, DiskQueue *queue, DiskRequest *req) {
+    pthread_mutex_lock(&queue->lock);
+    while (1) {
+        // Flush the waiting syncs once idle or when the window is over
+        if (queue->sync_count > 0 && (queue->size == 0 || _sync_due(queue))) {
+            _flush(disk, queue);
+            continue;
+        }
+        int idx = _pick(disk, queue);
+        if (idx < 0) {
+            pthread_cond_wait(&queue->changed, &queue->lock);
+            continue;
+        }
+        DiskRequest *next = &queue->req[idx];
+        if (next->cmd.type == CMD_S) {
+            // Answered after the flush shared by the syncs nearby
+            _sync(queue, next);
+            _remove(queue, idx);
+            continue;
+        }
+        *req = *next;
+        _remove(queue, idx);
+        pthread_cond_broadcast(&queue->changed);
+        pthread_mutex_unlock(&queue->lock);
+        return;
+    }
+}
+
+void queue_done(DiskQueue *queue, DiskRequest *req) {
+    free(req->data);
+    req->data = NULL;
+    pthread_mutex_lock(&queue->lock);
+    req->disk->pending--;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+int queue_flush(BasicDisk *disk, DiskQueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    int res = _flush(disk, queue);
+    pthread_mutex_unlock(&queue->lock);
+    return res;
+}
+
+void queue_drop(DiskQueue *queue, BasicDisk *disk) {
+    pthread_mutex_lock(&queue->lock);
+    for (int i = queue->size - 1; i >= 0; i--) {
+        if (queue->req[i].disk == disk) {
+            free(queue->req[i].data);
+            _remove(queue, i);
+            disk->pending--;
+        }
+    }
+    for (int i = queue->sync_count - 1; i >= 0; i--) {
+        if (queue->sync_disks[i] == disk) {
+            queue->sync_count--;
+            queue->sync_disks[i] = queue->sync_disks[queue->sync_count];
+            queue->sync_tags[i] = queue->sync_tags[queue->sync_count];
+            disk->pending--;
+        }
+    }
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void queue_wait_idle(DiskQueue *queue, BasicDisk *disk) {
+    pthread_mutex_lock(&queue->lock);
+    while (disk->pending > 0) {
+        pthread_cond_wait(&queue->changed, &queue->lock);
+    }
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void print_seek_stats(BasicDisk *disk, DiskQueue *queue) {
+    DiskState *state = disk->state;
+    double average = state->sector_count == 0 ? 0 : (double)state->seek_distance / state->sector_count;
+    printf("[%s] Sectors: %ld, Seeks: %ld, Total seek distance: %ld, Average: %.2f\n",
+           policy_name(queue->policy), state->sector_count, state->seek_count, state->seek_distance, average);
+}
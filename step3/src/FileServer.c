@@ -1,7 +1,29 @@
 #include "FileServer.h"
 #include "ServerCore.h"
+#include <sys/uio.h>
+#include <poll.h>
 
-int fs_process_cmd(User* user, AuthList* list, CmdHeader* command, char* data) {
+// Check if a command changes the directories or the users
+bool _changes_tree(u_int16_t type) {
+    switch (type) {
+        case FS_FORMAT:
+        case FS_MK:
+        case FS_MKDIR:
+        case FS_RM:
+        case FS_RMDIR:
+        case FS_USERADD:
+        case FS_USERDEL:
+        case FS_PASSWD:
+        case FS_CHMOD:
+        case FS_CHOWN:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+int _process_cmd(User* user, AuthList* list, CmdHeader* command, char* data) {
     int data_len, res;
     char* data_ptr = NULL;
 #ifdef _DEBUG
@@ -16,7 +38,7 @@ int fs_process_cmd(User* user, AuthList* list, CmdHeader* command, char* data) {
         if (res < 0) {
             return -1;
         } else if (res == FLUSH_DIR) {
-            fs_respond(user, "\0F\0\0", 4);
+            fs_send_frames(user, FRAME_FLUSH, NULL, 0);
             return 0;
         }
     }
@@ -94,13 +116,13 @@ int fs_process_cmd(User* user, AuthList* list, CmdHeader* command, char* data) {
             break;
 
         case FS_CAT:
-            // Catch a file
-            res = u_cat_file(user, command->name, &data_ptr, &data_len);
-            if (res >= 0) {
-                fs_respond(user, data_ptr, data_len);
-                fs_respond(user, "\n", 1);
-                free(data_ptr);
-            }
+            // Catch a file, sent chunk by chunk as it is read
+            res = fs_cat_file(user, command->name);
+            break;
+
+        case FS_APPEND:
+            // Append to a file
+            res = u_append_file(user, command->name, command->data_len, data);
             break;
 
         case FS_INSERT:
@@ -156,7 +178,7 @@ int fs_process_cmd(User* user, AuthList* list, CmdHeader* command, char* data) {
 
     switch (res) {
         case FLUSH_DIR:
-            fs_respond(user, "\0F\0\0", 4);
+            fs_send_frames(user, FRAME_FLUSH, NULL, 0);
             break;
 
         case GENERIC_ERROR:
@@ -205,30 +227,65 @@ int fs_process_cmd(User* user, AuthList* list, CmdHeader* command, char* data) {
     return res;
 }
 
+// Wait until the streams holding an inode are done, -1 for all the inodes
+void _wait_inode(Volume* vol, int inode_idx) {
+    int first = inode_idx < 0 ? 0 : inode_idx;
+    int last = inode_idx < 0 ? INODE_LOCKS - 1 : inode_idx;
+    for (int i = first; i <= last; i++) {
+        lock_inode(vol, i, true);
+        unlock_inode(vol, i);
+    }
+}
+
+int fs_process_cmd(User* user, AuthList* list, CmdHeader* command, char* data) {
+    int res;
+    fs_hold_frames(user);
+    do {
+        // Changes of the tree run alone, lookups and the contents of the files are shared
+        if (_changes_tree(command->type)) {
+            pthread_rwlock_wrlock(&user->vol->tree_lock);
+        } else {
+            pthread_rwlock_rdlock(&user->vol->tree_lock);
+        }
+        res = _process_cmd(user, list, command, data);
+        pthread_rwlock_unlock(&user->vol->tree_lock);
+        // A stream takes the tree again to finish, so it is never waited for with the tree locked
+        if (res == INODE_BUSY) {
+            _wait_inode(user->vol, user->busy_inode);
+        }
+    } while (res == INODE_BUSY);
+    // The client is waited for only once the tree is released
+    fs_release_frames(user);
+    return res;
+}
+
 int fs_get_cmd(User* user, char* cmd, char* data) {
-    int nbytes = receive_response(user->sockfd, cmd);
-    if (nbytes == 0) {
-        // Client disconnected
-        return FS_EXIT;
+    FrameHeader header;
+    int nbytes = fs_recv_frame(user, &header, cmd);
+    if (nbytes < 0) {
+        return nbytes;
     }
-    if (write(user->sockfd, "", 1) != 1) {
-        perror("send");
+    if (header.type != FRAME_CMD) {
+        print_err("fs_get_cmd:\tCommand expected");
         return -1;
     }
+    // The response is sent with the sequence number of the command
+    user->seq = header.seq;
+    // End of the filename
+    cmd[nbytes] = '\0';
     CmdHeader* command = (CmdHeader*)cmd;
     if (command->type == (u_int16_t)FS_EXIT) {
         // @todo exit
         return FS_EXIT;
     }
     if (command->data_len > 0 && command->type != FS_DELETE) {
-        for (int i = 0; (u_int32_t)i < command->data_len; i += MAX_BUF_SIZE / 2) {
-            nbytes = receive_response(user->sockfd, data + i);
-            if (nbytes == 0) {
-                // Client disconnected
-                return FS_EXIT;
+        for (u_int32_t i = 0; i < command->data_len; i += nbytes) {
+            nbytes = fs_recv_frame(user, &header, data + i);
+            if (nbytes < 0) {
+                return nbytes;
             }
-            if (write(user->sockfd, "", 1) != 1) {
-                perror("send");
+            if (header.type != FRAME_DATA || header.seq != user->seq || nbytes == 0) {
+                print_err("fs_get_cmd:\tData expected");
                 return -1;
             }
         }
@@ -244,9 +301,10 @@ int fs_login(AuthUser* auth, int sockfd) {
         perror("send");
         return -1;
     }
-    char response[200];
-    int nbytes = receive_response(sockfd, response);
-    if (nbytes == 0) {
+    // Only the user ID, the framed messages may follow in the same segment
+    char response[2];
+    int nbytes = fs_recv_all(sockfd, response, 2);
+    if (nbytes <= 0) {
         // Client disconnected
         return FS_EXIT;
     }
@@ -257,16 +315,55 @@ int fs_login(AuthUser* auth, int sockfd) {
     return 0;
 }
 
+int fs_poll_login(User* user) {
+    FrameBuffer* rx = user->rx;
+    while (1) {
+        if (rx->end - rx->start >= LOGIN_HEADER) {
+            u_int16_t name_len;
+            memcpy(&name_len, rx->data + rx->start, sizeof(u_int16_t));
+            if (name_len == 0 || name_len > LOGIN_NAME) {
+                print_err("fs_poll_login:\tInvalid name length");
+                return -1;
+            }
+            if (rx->end - rx->start >= LOGIN_HEADER + name_len) {
+                return 1;
+            }
+        }
+        int nbytes = read(user->sockfd, rx->data + rx->end, FRAME_BUF_SIZE - rx->end);
+        if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return 0;
+        } else if (nbytes < 0) {
+            perror("recv");
+            return -1;
+        } else if (nbytes == 0) {
+            return FS_EXIT;
+        }
+        rx->end += nbytes;
+    }
+}
+
+void _frame_take_credit(User* user);
+
+void fs_take_login(User* user, AuthUser* auth) {
+    FrameBuffer* rx = user->rx;
+    memcpy(auth, rx->data + rx->start, LOGIN_HEADER);
+    memcpy(auth->username, rx->data + rx->start + LOGIN_HEADER, auth->name_len);
+    auth->username[auth->name_len] = 0;
+    rx->start += LOGIN_HEADER + auth->name_len;
+    // Frames sent right behind the login
+    _frame_take_credit(user);
+}
+
+void fs_answer_login(User* user) {
+    FrameQueue* tx = user->tx;
+    memcpy(tx->data + tx->len, &user->id, sizeof(u_int16_t));
+    tx->len += sizeof(u_int16_t);
+}
+
 int fs_auth_user(User* user, AuthList* list) {
     AuthUser auth;
-    char* pack = (char*)&auth;
-    int res = read(user->sockfd, pack, 4 + 32 + 64);
-    if (res < 0) {
-        perror("recv");
-        return -1;
-    }
+    fs_take_login(user, &auth);
     user->id = 0;
-    auth.username[auth.name_len] = 0;
     strcpy(user->username, auth.username);
     AuthUser* entry = search_user(list, user->username);
     if (entry == NULL) {
@@ -279,7 +376,7 @@ int fs_auth_user(User* user, AuthList* list) {
         }
     }
     // Copy user info
-    res = u_init_user(user);
+    int res = u_init_user(user);
     if (res < 0) {
         print_err("fs_auth_user:\tFailed to initialize user");
         return -1;
@@ -291,11 +388,7 @@ int fs_auth_user(User* user, AuthList* list) {
     }
     strcpy(user->username, entry->username);
     user->id = entry->id;
-    res = write(user->sockfd, (char*)&user->id, 2);
-    if (res != 2) {
-        perror("send");
-        return -1;
-    }
+    fs_answer_login(user);
     return 0;
 }
 
@@ -322,27 +415,365 @@ int fs_data_len_check(char* cmd, char* data_ptr, int data_len, int res) {
 int fs_print_work_dir(User* user) {
     char path[1200];
     sprintf(path, "\n\033[1;32m%s\033[0m:\033[1;34m%.1024s\033[0m$ ", user->username, user->path);
-    fs_respond(user, path, strlen(path));
+    fs_send_frames(user, FRAME_PROMPT, path, strlen(path));
+    // The prompt ends the response
+    return fs_flush_frames(user);
+}
+
+int fs_recv_all(int sockfd, char* buffer, int len) {
+    int received = 0;
+    while (received < len) {
+        int nbytes = read(sockfd, buffer + received, len - received);
+        if (nbytes < 0) {
+            perror("recv");
+            return -1;
+        } else if (nbytes == 0) {
+            return 0;
+        }
+        received += nbytes;
+    }
+    return received;
+}
+
+void fs_init_frames(User* user, FrameBuffer* rx, FrameQueue* tx) {
+    user->rx = rx;
+    user->tx = tx;
+    user->unacked = 0;
+    user->credit = 0;
+    user->seq = 0;
+    rx->start = 0;
+    rx->end = 0;
+    if (tx != NULL) {
+        tx->len = 0;
+        tx->holding = false;
+        tx->held = NULL;
+        tx->held_len = 0;
+        tx->held_cap = 0;
+    }
+}
+
+// Wait until the socket is ready, it may be non-blocking. -1 if the peer is not ready in timeout ms
+int _frame_wait(int sockfd, short events, int timeout) {
+    struct pollfd pfd;
+    pfd.fd = sockfd;
+    pfd.events = events;
+    int res = poll(&pfd, 1, timeout);
+    if (res < 0 && errno != EINTR) {
+        perror("poll");
+        return -1;
+    } else if (res == 0) {
+        // A stalled client is dropped, the main thread sees the connection end
+        print_err("Peer timed out");
+        shutdown(sockfd, SHUT_RDWR);
+        return -1;
+    }
     return 0;
 }
 
-int fs_respond(User* user, char* message, int len) {
-    char buffer[200];
-    for (int i = 0; i < len; i += MAX_BUF_SIZE / 2) {
-        size_t write_len = len - i > MAX_BUF_SIZE / 2 ? MAX_BUF_SIZE / 2 : len - i;
-        if (write(user->sockfd, message + i, write_len) != (ssize_t)write_len) {
-            perror("send");
+// The server gives up on a stalled client, the client waits for the server as long as a command takes
+int _frame_timeout(User* user) {
+    return user->tx != NULL ? FS_PEER_TIMEOUT : -1;
+}
+
+// Write all the bytes, waiting while the socket is full
+int _frame_send_all(int sockfd, struct iovec* iov, int iovcnt, int timeout) {
+    while (iovcnt > 0) {
+        ssize_t nbytes = writev(sockfd, iov, iovcnt);
+        if (nbytes < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("send");
+                return -1;
+            }
+            if (_frame_wait(sockfd, POLLOUT, timeout) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        while (iovcnt > 0 && (size_t)nbytes >= iov->iov_len) {
+            nbytes -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + nbytes;
+            iov->iov_len -= nbytes;
+        }
+    }
+    return 0;
+}
+
+bool _frame_complete(FrameBuffer* rx) {
+    FrameHeader header;
+    if (rx->end - rx->start < SIZE_FRAME_HEADER) {
+        return false;
+    }
+    memcpy(&header, rx->data + rx->start, SIZE_FRAME_HEADER);
+    return rx->end - rx->start >= SIZE_FRAME_HEADER + (int)header.len;
+}
+
+void _frame_take_credit(User* user) {
+    FrameBuffer* rx = user->rx;
+    int pos = rx->start;
+    while (rx->end - pos >= SIZE_FRAME_HEADER) {
+        FrameHeader header;
+        memcpy(&header, rx->data + pos, SIZE_FRAME_HEADER);
+        if (header.len > FS_CHUNK_SIZE || rx->end - pos < SIZE_FRAME_HEADER + (int)header.len) {
+            break;
+        }
+        // Credits behind a frame not consumed yet are taken in place
+        if (header.credit > 0) {
+            user->unacked -= header.credit;
+            header.credit = 0;
+            memcpy(rx->data + pos, &header, SIZE_FRAME_HEADER);
+        }
+        // Acks in front are dropped, the others when they are reached
+        if (header.type == FRAME_ACK && pos == rx->start) {
+            rx->start += SIZE_FRAME_HEADER + header.len;
+        }
+        pos += SIZE_FRAME_HEADER + header.len;
+    }
+}
+
+int _frame_write(User* user, u_int16_t type, char* payload, u_int32_t len) {
+    FrameHeader header;
+    header.type = type;
+    header.credit = user->credit;
+    header.len = len;
+    header.seq = user->seq;
+    FrameQueue* tx = user->tx;
+    if (tx == NULL) {
+        struct iovec iov[2] = {{&header, SIZE_FRAME_HEADER}, {payload, len}};
+        if (_frame_send_all(user->sockfd, iov, 2, _frame_timeout(user)) < 0) {
+            return -1;
+        }
+    } else {
+        if (tx->len + SIZE_FRAME_HEADER + (int)len > FRAME_TX_SIZE && fs_flush_frames(user) < 0) {
+            return -1;
+        }
+        memcpy(tx->data + tx->len, &header, SIZE_FRAME_HEADER);
+        if (len > 0) {
+            memcpy(tx->data + tx->len + SIZE_FRAME_HEADER, payload, len);
+        }
+        tx->len += SIZE_FRAME_HEADER + len;
+    }
+    user->credit = 0;
+    return 0;
+}
+
+int fs_flush_frames(User* user) {
+    FrameQueue* tx = user->tx;
+    if (tx == NULL || tx->len == 0 || tx->holding) {
+        return 0;
+    }
+    struct iovec iov = {tx->data, tx->len};
+    tx->len = 0;
+    return _frame_send_all(user->sockfd, &iov, 1, _frame_timeout(user));
+}
+
+void fs_hold_frames(User* user) {
+    if (user->tx != NULL) {
+        user->tx->holding = true;
+    }
+}
+
+// Keep a message until the tree is released, growing the buffer as needed
+int _frame_hold(User* user, u_int16_t type, char* message, int len) {
+    FrameQueue* tx = user->tx;
+    int need = tx->held_len + SIZE_FRAME_HEADER + len;
+    if (need > tx->held_cap) {
+        int cap = tx->held_cap == 0 ? FRAME_TX_SIZE : tx->held_cap;
+        while (cap < need) {
+            cap *= 2;
+        }
+        char* held = (char*)realloc(tx->held, cap);
+        if (held == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        tx->held = held;
+        tx->held_cap = cap;
+    }
+    FrameHeader header;
+    header.type = type;
+    header.credit = 0;
+    header.len = len;
+    header.seq = user->seq;
+    memcpy(tx->held + tx->held_len, &header, SIZE_FRAME_HEADER);
+    if (len > 0) {
+        memcpy(tx->held + tx->held_len + SIZE_FRAME_HEADER, message, len);
+    }
+    tx->held_len = need;
+    return 0;
+}
+
+int fs_release_frames(User* user) {
+    FrameQueue* tx = user->tx;
+    if (tx == NULL || !tx->holding) {
+        return 0;
+    }
+    tx->holding = false;
+    int res = 0;
+    for (int pos = 0; pos < tx->held_len && res == 0;) {
+        FrameHeader header;
+        memcpy(&header, tx->held + pos, SIZE_FRAME_HEADER);
+        res = fs_send_frames(user, header.type, tx->held + pos + SIZE_FRAME_HEADER, header.len);
+        pos += SIZE_FRAME_HEADER + header.len;
+    }
+    tx->held_len = 0;
+    return res;
+}
+
+// Read what arrived into the reassembly buffer, 0 if nothing on a non-blocking socket
+int _frame_read(User* user) {
+    FrameBuffer* rx = user->rx;
+    // Ack the frames consumed before waiting for the peer
+    if (user->credit > 0 && _frame_write(user, FRAME_ACK, NULL, 0) < 0) {
+        return -1;
+    }
+    if (fs_flush_frames(user) < 0) {
+        return -1;
+    }
+    if (rx->start > 0) {
+        memmove(rx->data, rx->data + rx->start, rx->end - rx->start);
+        rx->end -= rx->start;
+        rx->start = 0;
+    }
+    if (rx->end == FRAME_BUF_SIZE) {
+        print_err("fs_read_frames:\tFrame buffer full");
+        return -1;
+    }
+    int nbytes = read(user->sockfd, rx->data + rx->end, FRAME_BUF_SIZE - rx->end);
+    if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    } else if (nbytes < 0) {
+        perror("recv");
+        return -1;
+    } else if (nbytes == 0) {
+        // Peer disconnected
+        return FS_EXIT;
+    }
+    rx->end += nbytes;
+    _frame_take_credit(user);
+    return nbytes;
+}
+
+int fs_read_frames(User* user) {
+    while (1) {
+        int nbytes = _frame_read(user);
+        if (nbytes != 0) {
+            return nbytes;
+        }
+        if (_frame_wait(user->sockfd, POLLIN, _frame_timeout(user)) < 0) {
             return -1;
         }
-        // Wait for the client
-        do {
-            int nbytes = receive_response(user->sockfd, buffer);
-            if (nbytes == 0) {
-                // Client disconnected
-                return FS_EXIT;
+    }
+}
+
+int fs_poll_frames(User* user) {
+    int total = 0;
+    while (1) {
+        int nbytes = _frame_read(user);
+        if (nbytes <= 0) {
+            return nbytes < 0 ? nbytes : total;
+        }
+        total += nbytes;
+    }
+}
+
+bool fs_frame_ready(User* user) {
+    return _frame_complete(user->rx);
+}
+
+int fs_recv_frame(User* user, FrameHeader* header, char* payload) {
+    FrameBuffer* rx = user->rx;
+    while (!_frame_complete(rx)) {
+        if (rx->end - rx->start >= SIZE_FRAME_HEADER) {
+            memcpy(header, rx->data + rx->start, SIZE_FRAME_HEADER);
+            if (header->len > FS_CHUNK_SIZE) {
+                print_err("fs_recv_frame:\tInvalid frame length");
+                return -1;
             }
-        } while (buffer[0] != 0);
+        }
+        int res = fs_read_frames(user);
+        if (res < 0) {
+            return res;
+        }
     }
+    memcpy(header, rx->data + rx->start, SIZE_FRAME_HEADER);
+    memcpy(payload, rx->data + rx->start + SIZE_FRAME_HEADER, header->len);
+    rx->start += SIZE_FRAME_HEADER + header->len;
+    user->credit++;
+    _frame_take_credit(user);
+    // One ack for the frames arrived together
+    if (!_frame_complete(rx) && _frame_write(user, FRAME_ACK, NULL, 0) < 0) {
+        return -1;
+    }
+    return header->len;
+}
+
+int fs_send_frames(User* user, u_int16_t type, char* message, int len) {
+    if (user->tx != NULL && user->tx->holding) {
+        return _frame_hold(user, type, message, len);
+    }
+    int i = 0;
+    do {
+        int chunk_len = len - i > FS_CHUNK_SIZE ? FS_CHUNK_SIZE : len - i;
+        // Wait for the peer only if the window is full
+        while (user->unacked >= FS_WINDOW) {
+            int res = fs_read_frames(user);
+            if (res < 0) {
+                return res;
+            }
+        }
+        if (_frame_write(user, type, message + i, chunk_len) < 0) {
+            return -1;
+        }
+        user->unacked++;
+        i += chunk_len;
+    } while (i < len);
+    return 0;
+}
+
+int fs_respond(User* user, char* message, int len) {
+    return fs_send_frames(user, FRAME_DATA, message, len);
+}
+
+int fs_cat_file(User* user, char* filename) {
+    Inode inode;
+    int res = u_open_file(user, filename, &inode);
+    if (res < 0) {
+        return res;
+    }
+    FileStream stream;
+    res = open_stream(user->vol, &inode, &stream);
+    // Only the file stays locked while the client receives it
+    pthread_rwlock_unlock(&user->vol->tree_lock);
+    fs_release_frames(user);
+    while (res >= 0) {
+        char* chunk;
+        int len = read_stream(user->vol, &stream, &chunk);
+        if (len <= 0) {
+            res = len;
+            break;
+        }
+        // The next chunks are read by the disk while the client receives this one
+        if (fs_respond(user, chunk, len) != 0) {
+            res = PEER_FAILURE;
+            break;
+        }
+    }
+    close_stream(user->vol, &stream);
+    unlock_inode(user->vol, inode.i_idx);
+    pthread_rwlock_rdlock(&user->vol->tree_lock);
+    fs_hold_frames(user);
+    if (res == PEER_FAILURE) {
+        print_err("fs_cat_file:\tFailed to send file");
+        return res;
+    } else if (res < 0) {
+        print_err("fs_cat_file:\tFailed to read file");
+        return DISK_FAILURE;
+    }
+    fs_respond(user, "\n", 1);
     return 0;
 }
 
@@ -363,21 +794,24 @@ int fs_error(User* user, char* message, int len) {
 }
 
 int fs_disconnect(User* user) {
+    // A warning may be queued before the connection is closed
+    fs_flush_frames(user);
     close(user->sockfd);
     user->sockfd = 0;
+    user->unacked = 0;
+    user->credit = 0;
     free_dir(&user->cur_dir);
+    if (user->tx != NULL) {
+        free(user->tx->held);
+        user->tx->held = NULL;
+        user->tx->held_len = 0;
+        user->tx->held_cap = 0;
+    }
     return 0;
 }
 
-int fs_exit(User* user_list) {
+int fs_exit(Volume* vol) {
     fprintf(stdout, "Exiting...\n");
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (user_list[i].sockfd > 0) {
-            if (shutdown(user_list[i].sockfd, SHUT_RDWR) < 0) {
-                perror("shutdown");
-            }
-            free_dir(&user_list[i].cur_dir);
-        }
-    }
+    confirm_sync(vol);
     return 0;
-}
\ No newline at end of file
+}
@@ -1,21 +1,96 @@
 #include "FileSystem.h"
 #include "BasicDisk.h"
+#include <sys/socket.h>
+
+// Receive exactly len bytes from the disk server
+int _recv_all(int sockfd, char* buffer, int len) {
+    int received = 0;
+    while (received < len) {
+        int n = read(sockfd, buffer + received, len - received);
+        if (n <= 0) {
+            return -1;
+        }
+        received += n;
+    }
+    return received;
+}
+
+int parse_mount_options(Volume* vol, char* options) {
+    vol->atime_mode = ATIME_STRICT;
+    vol->lazy_meta = false;
+    vol->extents = false;
+    vol->inline_data = false;
+    if (options == NULL) {
+        return 0;
+    }
+    char buffer[MAX_OPTIONS_LEN];
+    strncpy(buffer, options, MAX_OPTIONS_LEN - 1);
+    buffer[MAX_OPTIONS_LEN - 1] = '\0';
+    for (char* opt = strtok(buffer, ","); opt != NULL; opt = strtok(NULL, ",")) {
+        if (strcmp(opt, "strictatime") == 0) {
+            vol->atime_mode = ATIME_STRICT;
+        } else if (strcmp(opt, "noatime") == 0) {
+            vol->atime_mode = ATIME_NO;
+        } else if (strcmp(opt, "relatime") == 0) {
+            vol->atime_mode = ATIME_REL;
+        } else if (strcmp(opt, "lazytime") == 0) {
+            vol->atime_mode = ATIME_LAZY;
+        } else if (strcmp(opt, "lazymeta") == 0) {
+            vol->lazy_meta = true;
+        } else if (strcmp(opt, "extents") == 0) {
+            vol->extents = true;
+        } else if (strcmp(opt, "inline") == 0) {
+            vol->inline_data = true;
+        } else {
+            fprintf(stderr, "Error: Unknown option %s\n", opt);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Locks shared by the worker threads
+void _init_locks(Volume* vol) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&vol->icache_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_mutex_init(&vol->cache_lock, NULL);
+    pthread_cond_init(&vol->cache_cond, NULL);
+    pthread_mutex_init(&vol->dentry_lock, NULL);
+    pthread_mutex_init(&vol->alloc_lock, NULL);
+    pthread_rwlock_init(&vol->tree_lock, NULL);
+    for (int i = 0; i < INODE_LOCKS; i++) {
+        pthread_rwlock_init(&vol->inode_locks[i], NULL);
+    }
+}
 
 int init_volume(Volume* vol) {
+    _init_locks(vol);
+    init_cache(vol);
+    vol->cache.hits = 0;
+    vol->cache.misses = 0;
+    vol->cache.writebacks = 0;
+    vol->icache.hits = 0;
+    vol->icache.misses = 0;
+    vol->dcache.hits = 0;
+    vol->dcache.misses = 0;
+    vol->meta_dirty = 0;
+    vol->inode_cursor = 0;
+    vol->block_cursor = 0;
     // Load MetaBlocks
     vol->blockptr->super_block.s_blocks_count = 3;
     load_meta_blocks(vol);
     // Get the volume information
-    u_int16_t cmd_info[2] = {CMD_I, 0};
-    int n = write(vol->sockfd, (char*)cmd_info, 4);
-    if (n < 0) {
-        perror("write");
-        exit(1);
-    }
-    char response[20];
-    n = read(vol->sockfd, response, 20);
-    if (n < 0) {
-        perror("read");
+    Command cmd;
+    cmd.type = CMD_I;
+    cmd.len = 0;
+    cmd.block_id = 0;
+    char response[4];
+    int tag = submit_request(vol, (char*)&cmd, SIZE_CMD_BASIC, response, 4);
+    if (tag < 0 || wait_request(vol, tag) < 0) {
+        perror("init_volume");
         exit(1);
     }
     u_int16_t* info = (u_int16_t*)response;
@@ -36,7 +111,28 @@ int init_volume(Volume* vol) {
     return 0;
 }
 
+// Write the changed metadata blocks only
+int _write_meta_blocks(Volume* vol) {
+    char* meta = (char*)vol->blockptr;
+    int res = 0;
+    pthread_mutex_lock(&vol->alloc_lock);
+    for (int i = 0; i < METABLOCKS_SIZE && res == 0; i++) {
+        if ((vol->meta_dirty & (1 << i)) == 0) {
+            continue;
+        }
+        res = write_block(vol, i, meta + i * SIZE_BLOCK);
+        if (res == 0) {
+            vol->meta_dirty &= ~(1 << i);
+        }
+    }
+    pthread_mutex_unlock(&vol->alloc_lock);
+    return res;
+}
+
 int format_disk(Volume* vol) {
+    // Blocks of the old file system are dropped
+    init_cache(vol);
+
     // Initialize super block
     SuperBlock* sb = &vol->blockptr->super_block;
     sb->s_magic = MAGIC_NUM;
@@ -67,13 +163,18 @@ int format_disk(Volume* vol) {
 #endif
 
     // Initialize inode bitmap
+    pthread_mutex_lock(&vol->alloc_lock);
     memset(vol->blockptr->inode_bitmap, 0, sizeof(vol->blockptr->inode_bitmap));
+    vol->inode_cursor = 0;
+    vol->block_cursor = 0;
 
     // Initialize block bitmap
     memset(vol->blockptr->block_bitmap, 0, sizeof(vol->blockptr->block_bitmap));
 
     // Write metadata blocks to disk
-    if (save_meta_blocks(vol) < 0) {
+    vol->meta_dirty = (1 << METABLOCKS_SIZE) - 1;
+    pthread_mutex_unlock(&vol->alloc_lock);
+    if (_write_meta_blocks(vol) < 0) {
         print_err("Failed to save meta blocks");
         return -1;
     }
@@ -91,33 +192,46 @@ int load_meta_blocks(Volume* vol) {
     return 0;
 }
 
+void mark_meta_dirty(Volume* vol, int offset) {
+    vol->meta_dirty |= 1 << (offset / SIZE_BLOCK);
+}
+
 int save_meta_blocks(Volume* vol) {
-    char buffer[METABLOCKS_SIZE * SIZE_BLOCK];
-    memcpy(buffer, vol->blockptr, sizeof(MetaBlocks));
-    for (int i = 0; i < METABLOCKS_SIZE; i++) {
-        if (write_block(vol, i, buffer + i * SIZE_BLOCK) < 0) {
-            return -1;
-        }
+    if (vol->lazy_meta) {
+        return 0;
     }
-    return 0;
+    return _write_meta_blocks(vol);
 }
 
-int allocate_block(Volume* vol) {
-    SuperBlock* sb = &vol->blockptr->super_block;
-    if (sb->s_free_blocks_count == 0) {
-        return -1;
+int find_zero_bit(u_int32_t* bitmap, u_int32_t nbits, u_int32_t* cursor) {
+    u_int32_t nwords = (nbits + BITMAP_WIDTH - 1) / BITMAP_WIDTH;
+    if (*cursor >= nwords) {
+        *cursor = 0;
     }
-    for (int i = 0; (u_int32_t)i < sb->s_blocks_count; i++) {
-        if ((vol->blockptr->block_bitmap[i / BITMAP_WIDTH] & (1UL << (i % BITMAP_WIDTH))) == 0) {
-            vol->blockptr->block_bitmap[i / BITMAP_WIDTH] |= (1UL << (i % BITMAP_WIDTH));
-            sb->s_free_blocks_count--;
-            return i;
+    for (u_int32_t n = 0; n < nwords; n++) {
+        u_int32_t w = (*cursor + n) % nwords;
+        if (bitmap[w] == 0xffffffff) {
+            continue;
+        }
+        u_int32_t bit = w * BITMAP_WIDTH + __builtin_ctz(~bitmap[w]);
+        if (bit < nbits) {
+            *cursor = w;
+            return bit;
         }
     }
     return -1;
 }
 
-int free_block(Volume* vol, int data_block) {
+int allocate_block(Volume* vol) {
+    u_int32_t block;
+    if (allocate_blocks(vol, 1, &block) < 0) {
+        return -1;
+    }
+    return block;
+}
+
+// Free a block, alloc_lock held
+int _free_block(Volume* vol, int data_block) {
     SuperBlock* sb = &vol->blockptr->super_block;
     if (data_block < 0 || (u_int32_t)data_block >= sb->s_blocks_count) {
         return -1;
@@ -127,32 +241,819 @@ int free_block(Volume* vol, int data_block) {
     }
     vol->blockptr->block_bitmap[data_block / BITMAP_WIDTH] &= ~(1UL << (data_block % BITMAP_WIDTH));
     sb->s_free_blocks_count++;
+    mark_meta_dirty(vol, 0);
+    mark_meta_dirty(vol, offsetof(MetaBlocks, block_bitmap) + data_block / BITMAP_WIDTH * sizeof(u_int32_t));
     return 0;
 }
 
-int read_block(Volume* vol, int disk_block, char* buffer) {
+// Allocate n blocks word by word, alloc_lock held
+int _allocate_blocks(Volume* vol, int n, u_int32_t* out) {
     SuperBlock* sb = &vol->blockptr->super_block;
-    if (disk_block < 0 || (u_int32_t)disk_block >= sb->s_blocks_count + sb->s_first_data_block) {
-        print_err("Invalid block index");
-        printf("Disk block: %d\n", disk_block);
+    u_int32_t* bitmap = vol->blockptr->block_bitmap;
+    if (n < 0 || sb->s_free_blocks_count < (u_int32_t)n) {
+        return -1;
+    }
+    for (int i = 0; i < n;) {
+        int bit = find_zero_bit(bitmap, sb->s_blocks_count, &vol->block_cursor);
+        if (bit < 0) {
+            // Free count mismatch, roll back
+            while (i > 0) {
+                _free_block(vol, out[--i]);
+            }
+            return -1;
+        }
+        // Take all the free blocks of the word
+        u_int32_t w = bit / BITMAP_WIDTH;
+        while (i < n && (u_int32_t)bit < sb->s_blocks_count) {
+            bitmap[w] |= 1UL << (bit % BITMAP_WIDTH);
+            out[i++] = bit;
+            if (bitmap[w] == 0xffffffff) {
+                break;
+            }
+            bit = w * BITMAP_WIDTH + __builtin_ctz(~bitmap[w]);
+        }
+        mark_meta_dirty(vol, offsetof(MetaBlocks, block_bitmap) + w * sizeof(u_int32_t));
+    }
+    sb->s_free_blocks_count -= n;
+    mark_meta_dirty(vol, 0);
+    return 0;
+}
+
+int allocate_blocks(Volume* vol, int n, u_int32_t* out) {
+    pthread_mutex_lock(&vol->alloc_lock);
+    int res = _allocate_blocks(vol, n, out);
+    pthread_mutex_unlock(&vol->alloc_lock);
+    return res;
+}
+
+// Length of the free run from start, at most max blocks
+u_int32_t _free_run_length(u_int32_t* bitmap, u_int32_t start, u_int32_t end, u_int32_t max) {
+    u_int32_t pos = start;
+    while (pos < end && pos - start < max) {
+        if (pos % BITMAP_WIDTH == 0 && bitmap[pos / BITMAP_WIDTH] == 0 && pos + BITMAP_WIDTH <= end) {
+            pos += BITMAP_WIDTH;
+        } else if ((bitmap[pos / BITMAP_WIDTH] & (1UL << (pos % BITMAP_WIDTH))) == 0) {
+            pos++;
+        } else {
+            break;
+        }
+    }
+    return pos - start < max ? pos - start : max;
+}
+
+// Find a free run for n blocks from the cursor: the first one long enough,
+// or the smallest one long enough if best, otherwise the largest one
+int _find_free_run(Volume* vol, u_int32_t n, bool best, u_int32_t* len) {
+    u_int32_t* bitmap = vol->blockptr->block_bitmap;
+    u_int32_t nbits = vol->blockptr->super_block.s_blocks_count;
+    u_int32_t origin = vol->block_cursor * BITMAP_WIDTH;
+    if (origin >= nbits) {
+        origin = 0;
+    }
+    // Do not split the run under the cursor
+    while (origin > 0 && (bitmap[(origin - 1) / BITMAP_WIDTH] & (1UL << ((origin - 1) % BITMAP_WIDTH))) == 0) {
+        origin--;
+    }
+
+    int found = -1;
+    u_int32_t found_len = 0;
+    int largest = -1;
+    u_int32_t largest_len = 0;
+    for (int seg = 0; seg < 2; seg++) {
+        u_int32_t pos = seg == 0 ? origin : 0;
+        u_int32_t end = seg == 0 ? nbits : origin;
+        while (pos < end) {
+            if (pos % BITMAP_WIDTH == 0 && bitmap[pos / BITMAP_WIDTH] == 0xffffffff) {
+                pos += BITMAP_WIDTH;
+                continue;
+            }
+            if (bitmap[pos / BITMAP_WIDTH] & (1UL << (pos % BITMAP_WIDTH))) {
+                pos++;
+                continue;
+            }
+            u_int32_t run = _free_run_length(bitmap, pos, end, end - pos);
+            if (run >= n && (found < 0 || run < found_len)) {
+                found = pos;
+                found_len = run;
+                if (!best || run == n) {
+                    *len = n;
+                    return found;
+                }
+            }
+            if (run > largest_len) {
+                largest = pos;
+                largest_len = run;
+            }
+            pos += run;
+        }
+    }
+    if (found >= 0) {
+        *len = n;
+        return found;
+    }
+    *len = largest_len;
+    return largest;
+}
+
+// Allocate n blocks by runs, alloc_lock held
+int _allocate_extent(Volume* vol, int n, int goal, u_int32_t* out) {
+    SuperBlock* sb = &vol->blockptr->super_block;
+    u_int32_t* bitmap = vol->blockptr->block_bitmap;
+    if (n < 0 || sb->s_free_blocks_count < (u_int32_t)n) {
         return -1;
     }
+    int i = 0;
+    while (i < n) {
+        u_int32_t len = 0;
+        int start = -1;
+        if (i == 0 && goal >= 0 && (u_int32_t)goal < sb->s_blocks_count) {
+            // Continue right after the blocks the file already has
+            len = _free_run_length(bitmap, goal, sb->s_blocks_count, n);
+            start = len > 0 ? goal : -1;
+        }
+        if (start < 0) {
+            // The first run must hold all the blocks, the rest of a split is best fit
+            start = _find_free_run(vol, n - i, i > 0, &len);
+        }
+        if (start < 0 || len == 0) {
+            // Free count mismatch, roll back
+            while (i > 0) {
+                _free_block(vol, out[--i]);
+            }
+            return -1;
+        }
+#ifdef _DEBUG
+        printf("Allocated extent: %d +%u\n", start, len);
+#endif
+        for (u_int32_t bit = start; bit < start + len; bit++) {
+            bitmap[bit / BITMAP_WIDTH] |= 1UL << (bit % BITMAP_WIDTH);
+            mark_meta_dirty(vol, offsetof(MetaBlocks, block_bitmap) + bit / BITMAP_WIDTH * sizeof(u_int32_t));
+            out[i++] = bit;
+        }
+        sb->s_free_blocks_count -= len;
+        vol->block_cursor = (start + len) / BITMAP_WIDTH;
+    }
+    mark_meta_dirty(vol, 0);
+    return 0;
+}
+
+int allocate_extent(Volume* vol, int n, int goal, u_int32_t* out) {
+    pthread_mutex_lock(&vol->alloc_lock);
+    int res = _allocate_extent(vol, n, goal, out);
+    pthread_mutex_unlock(&vol->alloc_lock);
+    return res;
+}
+
+int free_block(Volume* vol, int data_block) {
+    pthread_mutex_lock(&vol->alloc_lock);
+    int res = _free_block(vol, data_block);
+    pthread_mutex_unlock(&vol->alloc_lock);
+    return res;
+}
+
+// Channel of the calling thread, the one of the volume if the thread has none
+static __thread DiskChannel* _thread_disk = NULL;
+
+DiskChannel* _channel(Volume* vol) {
+    return _thread_disk != NULL ? _thread_disk : &vol->disk;
+}
+
+void init_channel(DiskChannel* disk, int sockfd) {
+    disk->sockfd = sockfd;
+    disk->next_tag = 0;
+    disk->inflight = 0;
+    for (int i = 0; i < MAX_PENDING; i++) {
+        disk->pending[i].state = IO_FREE;
+    }
+}
+
+void attach_channel(DiskChannel* disk) {
+    _thread_disk = disk;
+}
+
+int submit_request(Volume* vol, char* request, int req_len, char* buffer, u_int32_t len) {
+    DiskChannel* disk = _channel(vol);
+    PendingIO* io = NULL;
+    for (int i = 0; i < MAX_PENDING; i++) {
+        if (disk->pending[i].state == IO_FREE) {
+            io = &disk->pending[i];
+            break;
+        }
+    }
+    if (io == NULL) {
+        print_err("Too many pending requests");
+        return -1;
+    }
+    Command* cmd = (Command*)request;
+    cmd->tag = disk->next_tag;
+    disk->next_tag = (disk->next_tag + 1) & 0x7fffffff;
+    if (write(disk->sockfd, request, req_len) != req_len) {
+        perror("submit_request");
+        return -1;
+    }
+    io->tag = cmd->tag;
+    io->state = IO_WAITING;
+    io->buffer = buffer;
+    io->len = len;
+    disk->inflight++;
+    return io->tag;
+}
+
+// Receive one response and complete the matching request
+int _reap_response(DiskChannel* disk) {
+    Response header;
+    if (_recv_all(disk->sockfd, (char*)&header, SIZE_RESP_BASIC) < 0) {
+        print_err("Disk server disconnected");
+        return -1;
+    }
+    PendingIO* io = NULL;
+    for (int i = 0; i < MAX_PENDING; i++) {
+        if (disk->pending[i].state == IO_WAITING && disk->pending[i].tag == header.tag) {
+            io = &disk->pending[i];
+            break;
+        }
+    }
+    if (io != NULL && header.status == 0 && header.len == io->len) {
+        if (header.len > 0 && _recv_all(disk->sockfd, io->buffer, header.len) < 0) {
+            return -1;
+        }
+        io->state = IO_DONE;
+        disk->inflight--;
+        return 0;
+    }
+    // Drop the payload of a failed or unknown request
+    char message[SIZE_BLOCK];
+    for (u_int32_t left = header.len; left > 0;) {
+        u_int32_t n = left > SIZE_BLOCK ? SIZE_BLOCK : left;
+        if (_recv_all(disk->sockfd, message, n) < 0) {
+            return -1;
+        }
+        if (left == header.len) {
+            fprintf(stderr, "Error: Request %u: %.*s", header.tag, (int)n, message);
+        }
+        left -= n;
+    }
+    if (io != NULL) {
+        io->state = IO_FAILED;
+        disk->inflight--;
+    }
+    return 0;
+}
+
+int wait_request(Volume* vol, int tag) {
+    DiskChannel* disk = _channel(vol);
+    PendingIO* io = NULL;
+    for (int i = 0; i < MAX_PENDING; i++) {
+        if (disk->pending[i].state != IO_FREE && disk->pending[i].tag == (u_int32_t)tag) {
+            io = &disk->pending[i];
+            break;
+        }
+    }
+    if (io == NULL) {
+        return -1;
+    }
+    while (io->state == IO_WAITING) {
+        if (_reap_response(disk) < 0) {
+            io->state = IO_FREE;
+            disk->inflight--;
+            return -1;
+        }
+    }
+    int res = io->state == IO_DONE ? 0 : -1;
+    io->state = IO_FREE;
+    return res;
+}
+
+bool disk_connected(Volume* vol) {
+    DiskChannel* disk = _channel(vol);
+    // Otherwise the bytes arrived are responses still to be reaped
+    if (disk->inflight > 0) {
+        return true;
+    }
+    char byte;
+    return recv(disk->sockfd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) != 0;
+}
+
+// Read a block from disk, bypassing the cache
+int _read_disk_block(Volume* vol, int disk_block, char* buffer) {
     Command cmd;
     cmd.type = CMD_R;
     cmd.len = SIZE_BLOCK;
     cmd.block_id = disk_block;
-    int n = write(vol->sockfd, &cmd, SIZE_CMD_BASIC);
-    if (n < 0) {
+    int tag = submit_request(vol, (char*)&cmd, SIZE_CMD_BASIC, buffer, SIZE_BLOCK);
+    if (tag < 0 || wait_request(vol, tag) < 0) {
+        printf("Read block %d failed\n", disk_block);
+        return -1;
+    }
+    return 0;
+}
+
+// Write a block to disk, bypassing the cache
+int _write_disk_block(Volume* vol, int disk_block, char* buffer) {
+    Command cmd;
+    cmd.type = CMD_W;
+    cmd.len = SIZE_BLOCK;
+    cmd.block_id = disk_block;
+    memcpy(cmd.data, buffer, SIZE_BLOCK);
+    int tag = submit_request(vol, (char*)&cmd, sizeof(Command), NULL, 0);
+    if (tag < 0 || wait_request(vol, tag) < 0) {
+        printf("Write block %d failed\n", disk_block);
+        return -1;
+    }
+    return 0;
+}
+
+void init_cache(Volume* vol) {
+    pthread_mutex_lock(&vol->icache_lock);
+    pthread_mutex_lock(&vol->cache_lock);
+    BlockCache* cache = &vol->cache;
+    for (int i = 0; i < CACHE_BLOCKS; i++) {
+        cache->entries[i].block = -1;
+        cache->entries[i].next = -1;
+        cache->entries[i].dirty = false;
+        cache->entries[i].referenced = false;
+        cache->entries[i].busy = false;
+    }
+    for (int i = 0; i < CACHE_HASH; i++) {
+        cache->buckets[i] = -1;
+    }
+    cache->hand = 0;
+
+    InodeCache* icache = &vol->icache;
+    for (int i = 0; i < INODE_CACHE_SIZE; i++) {
+        icache->entries[i].idx = -1;
+        icache->entries[i].next = -1;
+        icache->entries[i].dirty = false;
+        icache->entries[i].lazy = false;
+        icache->entries[i].referenced = false;
+    }
+    for (int i = 0; i < INODE_CACHE_HASH; i++) {
+        icache->buckets[i] = -1;
+    }
+    icache->hand = 0;
+    pthread_mutex_unlock(&vol->cache_lock);
+    pthread_mutex_unlock(&vol->icache_lock);
+
+    pthread_mutex_lock(&vol->dentry_lock);
+    DentryCache* dcache = &vol->dcache;
+    for (int i = 0; i < DENTRY_CACHE_SIZE; i++) {
+        dcache->entries[i].parent = -1;
+        dcache->entries[i].next = -1;
+        dcache->entries[i].referenced = false;
+    }
+    for (int i = 0; i < DENTRY_CACHE_HASH; i++) {
+        dcache->buckets[i] = -1;
+    }
+    dcache->hand = 0;
+    pthread_mutex_unlock(&vol->dentry_lock);
+}
+
+// FNV-1a hash of a name in a directory
+u_int32_t _dentry_hash(int parent, char* name, int len) {
+    u_int32_t hash = 2166136261u ^ (u_int32_t)parent;
+    for (int i = 0; i < len; i++) {
+        hash = (hash ^ (u_int8_t)name[i]) * 16777619u;
+    }
+    return hash % DENTRY_CACHE_HASH;
+}
+
+// Find the cache entry of a name, -1 if not cached, dentry_lock held
+int _dcache_lookup(Volume* vol, int parent, char* name, int len) {
+    DentryCache* dcache = &vol->dcache;
+    int idx = dcache->buckets[_dentry_hash(parent, name, len)];
+    while (idx >= 0) {
+        DentryEntry* entry = &dcache->entries[idx];
+        if (entry->parent == parent && entry->len == len && memcmp(entry->name, name, len) == 0) {
+            break;
+        }
+        idx = entry->next;
+    }
+    return idx;
+}
+
+// Remove an entry from its hash bucket, dentry_lock held
+void _dcache_unlink(Volume* vol, int idx) {
+    DentryCache* dcache = &vol->dcache;
+    DentryEntry* entry = &dcache->entries[idx];
+    int* link = &dcache->buckets[_dentry_hash(entry->parent, entry->name, entry->len)];
+    while (*link != idx) {
+        link = &dcache->entries[*link].next;
+    }
+    *link = entry->next;
+    entry->parent = -1;
+}
+
+int lookup_dentry(Volume* vol, int parent, char* name, int len, u_int16_t* mode) {
+    if (len > DENTRY_NAME) {
+        return DENTRY_MISS;
+    }
+    pthread_mutex_lock(&vol->dentry_lock);
+    int res = DENTRY_MISS;
+    int idx = _dcache_lookup(vol, parent, name, len);
+    if (idx >= 0) {
+        DentryEntry* entry = &vol->dcache.entries[idx];
+        entry->referenced = true;
+        *mode = entry->mode;
+        res = entry->inode_idx;
+        vol->dcache.hits++;
+    } else {
+        vol->dcache.misses++;
+    }
+    pthread_mutex_unlock(&vol->dentry_lock);
+    return res;
+}
+
+void insert_dentry(Volume* vol, int parent, char* name, int len, int inode_idx, u_int16_t mode) {
+    if (len > DENTRY_NAME) {
+        return;
+    }
+    pthread_mutex_lock(&vol->dentry_lock);
+    DentryCache* dcache = &vol->dcache;
+    int idx = _dcache_lookup(vol, parent, name, len);
+    if (idx < 0) {
+        // Take an entry with CLOCK
+        while (1) {
+            idx = dcache->hand;
+            dcache->hand = (dcache->hand + 1) % DENTRY_CACHE_SIZE;
+            DentryEntry* entry = &dcache->entries[idx];
+            if (entry->parent < 0) {
+                break;
+            }
+            if (entry->referenced) {
+                entry->referenced = false;
+                continue;
+            }
+            _dcache_unlink(vol, idx);
+            break;
+        }
+        DentryEntry* entry = &dcache->entries[idx];
+        u_int32_t bucket = _dentry_hash(parent, name, len);
+        entry->parent = parent;
+        entry->len = len;
+        memcpy(entry->name, name, len);
+        entry->next = dcache->buckets[bucket];
+        dcache->buckets[bucket] = idx;
+    }
+    DentryEntry* entry = &dcache->entries[idx];
+    entry->inode_idx = inode_idx;
+    entry->mode = mode;
+    entry->referenced = true;
+    pthread_mutex_unlock(&vol->dentry_lock);
+}
+
+void drop_dentries(Volume* vol, int parent) {
+    pthread_mutex_lock(&vol->dentry_lock);
+    for (int i = 0; i < DENTRY_CACHE_SIZE; i++) {
+        if (vol->dcache.entries[i].parent == parent) {
+            _dcache_unlink(vol, i);
+        }
+    }
+    pthread_mutex_unlock(&vol->dentry_lock);
+}
+
+// Find the cache entry of a disk block, -1 if not cached
+int _cache_lookup(Volume* vol, int disk_block) {
+    BlockCache* cache = &vol->cache;
+    int idx = cache->buckets[disk_block % CACHE_HASH];
+    while (idx >= 0 && cache->entries[idx].block != disk_block) {
+        idx = cache->entries[idx].next;
+    }
+    return idx;
+}
+
+// Wait until the entry of a disk block has no disk I/O in flight, -1 if not cached, cache_lock held
+int _cache_wait(Volume* vol, int disk_block) {
+    int idx;
+    while ((idx = _cache_lookup(vol, disk_block)) >= 0 && vol->cache.entries[idx].busy) {
+        pthread_cond_wait(&vol->cache_cond, &vol->cache_lock);
+    }
+    return idx;
+}
+
+// Remove an entry from its hash bucket
+void _cache_unlink(Volume* vol, int idx) {
+    BlockCache* cache = &vol->cache;
+    CacheEntry* entry = &cache->entries[idx];
+    int* link = &cache->buckets[entry->block % CACHE_HASH];
+    while (*link != idx) {
+        link = &cache->entries[*link].next;
+    }
+    *link = entry->next;
+    entry->block = -1;
+    entry->next = -1;
+    entry->dirty = false;
+}
+
+// Take an entry for a disk block, evicting with CLOCK if the cache is full, cache_lock held.
+// CACHE_RETRY if cache_lock was released to write a dirty entry back
+int _cache_insert(Volume* vol, int disk_block) {
+    BlockCache* cache = &vol->cache;
+    int idx;
+    int scanned = 0;
+    while (1) {
+        idx = cache->hand;
+        cache->hand = (cache->hand + 1) % CACHE_BLOCKS;
+        CacheEntry* entry = &cache->entries[idx];
+        if (entry->block < 0) {
+            break;
+        }
+        if (++scanned > 2 * CACHE_BLOCKS) {
+            // Every entry is busy
+            pthread_cond_wait(&vol->cache_cond, &vol->cache_lock);
+            return CACHE_RETRY;
+        }
+        if (entry->busy) {
+            continue;
+        }
+        if (entry->referenced) {
+            entry->referenced = false;
+            continue;
+        }
+        if (entry->dirty) {
+            // Written back without cache_lock, the entry is evicted on a later pass
+            entry->busy = true;
+            pthread_mutex_unlock(&vol->cache_lock);
+            int res = _write_disk_block(vol, entry->block, entry->data);
+            pthread_mutex_lock(&vol->cache_lock);
+            entry->busy = false;
+            if (res == 0) {
+                entry->dirty = false;
+                cache->writebacks++;
+            }
+            pthread_cond_broadcast(&vol->cache_cond);
+            return res < 0 ? -1 : CACHE_RETRY;
+        }
+        _cache_unlink(vol, idx);
+        break;
+    }
+    CacheEntry* entry = &cache->entries[idx];
+    entry->block = disk_block;
+    entry->next = cache->buckets[disk_block % CACHE_HASH];
+    entry->dirty = false;
+    entry->referenced = true;
+    cache->buckets[disk_block % CACHE_HASH] = idx;
+    return idx;
+}
+
+// Find or take the entry of a disk block, miss set if it is newly taken, cache_lock held
+int _cache_get(Volume* vol, int disk_block, bool* miss) {
+    while (1) {
+        int idx = _cache_wait(vol, disk_block);
+        if (idx >= 0) {
+            *miss = false;
+            return idx;
+        }
+        idx = _cache_insert(vol, disk_block);
+        if (idx != CACHE_RETRY) {
+            *miss = true;
+            return idx;
+        }
+    }
+}
+
+// Update the cached blocks to be written to disk, cache_lock held.
+// They stay busy and dirty until the write is done, released by _cache_put_dirty
+int _cache_update(Volume* vol, int count, u_int32_t* blocks, u_int32_t offset, char* buffer, u_int32_t* updated) {
+    for (int i = 0; i < count; i++) {
+        int idx = _cache_lookup(vol, blocks[i] + offset);
+        if (idx >= 0 && vol->cache.entries[idx].busy) {
+            pthread_cond_wait(&vol->cache_cond, &vol->cache_lock);
+            i = -1;
+        }
+    }
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        int idx = _cache_lookup(vol, blocks[i] + offset);
+        if (idx >= 0) {
+            CacheEntry* entry = &vol->cache.entries[idx];
+            memcpy(entry->data, buffer + i * SIZE_BLOCK, SIZE_BLOCK);
+            entry->busy = true;
+            entry->dirty = true;
+            updated[n++] = blocks[i] + offset;
+        }
+    }
+    return n;
+}
+
+// Find the cache entry of an inode, -1 if not cached
+int _icache_lookup(Volume* vol, int inode_idx) {
+    InodeCache* icache = &vol->icache;
+    int idx = icache->buckets[inode_idx % INODE_CACHE_HASH];
+    while (idx >= 0 && icache->entries[idx].idx != inode_idx) {
+        idx = icache->entries[idx].next;
+    }
+    return idx;
+}
+
+// Write the inodes of an inode table block back from the cache
+int _write_inode_block(Volume* vol, int inode_blk) {
+    SuperBlock* sb = &vol->blockptr->super_block;
+    char buffer[SIZE_BLOCK];
+    if (read_block(vol, inode_blk, buffer) < 0) {
         return -1;
     }
-    n = read(vol->sockfd, buffer, SIZE_BLOCK);
-    if (n < 200) {
-        printf("Read block %d: %d\n", disk_block, n);
+    int first = (inode_blk - METABLOCKS_SIZE) * sb->s_inodes_per_block;
+    for (int i = 0; i < sb->s_inodes_per_block; i++) {
+        int idx = _icache_lookup(vol, first + i);
+        if (idx >= 0 && (vol->icache.entries[idx].dirty || vol->icache.entries[idx].lazy)) {
+            memcpy(buffer + i * SIZE_INODE, vol->icache.entries[idx].data, SIZE_INODE);
+            vol->icache.entries[idx].dirty = false;
+            vol->icache.entries[idx].lazy = false;
+        }
+    }
+    return write_block(vol, inode_blk, buffer);
+}
+
+// Take an entry for an inode, evicting with CLOCK if the cache is full
+int _icache_insert(Volume* vol, int inode_idx) {
+    SuperBlock* sb = &vol->blockptr->super_block;
+    InodeCache* icache = &vol->icache;
+    int idx;
+    while (1) {
+        idx = icache->hand;
+        icache->hand = (icache->hand + 1) % INODE_CACHE_SIZE;
+        InodeEntry* entry = &icache->entries[idx];
+        if (entry->idx < 0) {
+            break;
+        }
+        if (entry->referenced) {
+            entry->referenced = false;
+            continue;
+        }
+        if ((entry->dirty || entry->lazy) && _write_inode_block(vol, METABLOCKS_SIZE + entry->idx / sb->s_inodes_per_block) < 0) {
+            return -1;
+        }
+        // Unlink from the hash bucket
+        int* link = &icache->buckets[entry->idx % INODE_CACHE_HASH];
+        while (*link != idx) {
+            link = &icache->entries[*link].next;
+        }
+        *link = entry->next;
+        break;
+    }
+    InodeEntry* entry = &icache->entries[idx];
+    entry->idx = inode_idx;
+    entry->next = icache->buckets[inode_idx % INODE_CACHE_HASH];
+    entry->dirty = false;
+    entry->lazy = false;
+    entry->referenced = true;
+    icache->buckets[inode_idx % INODE_CACHE_HASH] = idx;
+    return idx;
+}
+
+// Read an inode record, icache_lock held
+int _read_inode_record(Volume* vol, int inode_idx, char* buffer) {
+    SuperBlock* sb = &vol->blockptr->super_block;
+    int idx = _icache_lookup(vol, inode_idx);
+    if (idx >= 0) {
+        vol->icache.hits++;
+    } else {
+        vol->icache.misses++;
+        char block[SIZE_BLOCK];
+        int inode_blk = METABLOCKS_SIZE + inode_idx / sb->s_inodes_per_block;
+        // Not held during the read, the inode may be cached by another thread meanwhile
+        pthread_mutex_unlock(&vol->icache_lock);
+        int res = read_block(vol, inode_blk, block);
+        pthread_mutex_lock(&vol->icache_lock);
+        if (res < 0) {
+            return -1;
+        }
+        idx = _icache_lookup(vol, inode_idx);
+        if (idx < 0) {
+            idx = _icache_insert(vol, inode_idx);
+            if (idx < 0) {
+                return -1;
+            }
+            memcpy(vol->icache.entries[idx].data, block + inode_idx % sb->s_inodes_per_block * SIZE_INODE, SIZE_INODE);
+        }
+    }
+    InodeEntry* entry = &vol->icache.entries[idx];
+    entry->referenced = true;
+    memcpy(buffer, entry->data, SIZE_INODE);
+    return 0;
+}
+
+int read_inode_record(Volume* vol, int inode_idx, char* buffer) {
+    pthread_mutex_lock(&vol->icache_lock);
+    int res = _read_inode_record(vol, inode_idx, buffer);
+    pthread_mutex_unlock(&vol->icache_lock);
+    return res;
+}
+
+// Write an inode record, icache_lock held
+int _write_inode_record(Volume* vol, int inode_idx, char* buffer) {
+    int idx = _icache_lookup(vol, inode_idx);
+    if (idx >= 0) {
+        vol->icache.hits++;
+    } else {
+        // The whole inode is overwritten, no need to read it
+        vol->icache.misses++;
+        idx = _icache_insert(vol, inode_idx);
+        if (idx < 0) {
+            return -1;
+        }
+    }
+    InodeEntry* entry = &vol->icache.entries[idx];
+    memcpy(entry->data, buffer, SIZE_INODE);
+    entry->dirty = true;
+    entry->referenced = true;
+    return 0;
+}
+
+int write_inode_record(Volume* vol, int inode_idx, char* buffer) {
+    pthread_mutex_lock(&vol->icache_lock);
+    int res = _write_inode_record(vol, inode_idx, buffer);
+    pthread_mutex_unlock(&vol->icache_lock);
+    return res;
+}
+
+// Write the timestamps of an inode record, icache_lock held
+int _touch_inode_record(Volume* vol, int inode_idx, char* buffer) {
+    int idx = _icache_lookup(vol, inode_idx);
+    if (idx < 0 || vol->icache.entries[idx].dirty) {
+        // Not worth keeping lazily
+        return write_inode_record(vol, inode_idx, buffer);
+    }
+    vol->icache.hits++;
+    InodeEntry* entry = &vol->icache.entries[idx];
+    memcpy(entry->data, buffer, SIZE_INODE);
+    entry->lazy = true;
+    entry->referenced = true;
+    return 0;
+}
+
+int touch_inode_record(Volume* vol, int inode_idx, char* buffer) {
+    pthread_mutex_lock(&vol->icache_lock);
+    int res = _touch_inode_record(vol, inode_idx, buffer);
+    pthread_mutex_unlock(&vol->icache_lock);
+    return res;
+}
+
+// Write the dirty inodes back, icache_lock held
+int _flush_inodes(Volume* vol, bool lazy) {
+    SuperBlock* sb = &vol->blockptr->super_block;
+    InodeCache* icache = &vol->icache;
+    for (int i = 0; i < INODE_CACHE_SIZE; i++) {
+        // Other dirty inodes of the same block are written together
+        InodeEntry* entry = &icache->entries[i];
+        if (entry->idx >= 0 && (entry->dirty || (lazy && entry->lazy))) {
+            if (_write_inode_block(vol, METABLOCKS_SIZE + entry->idx / sb->s_inodes_per_block) < 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+int flush_inodes(Volume* vol, bool lazy) {
+    pthread_mutex_lock(&vol->icache_lock);
+    int res = _flush_inodes(vol, lazy);
+    pthread_mutex_unlock(&vol->icache_lock);
+    return res;
+}
+
+// Read a block through the cache, cache_lock held
+int _read_block(Volume* vol, int disk_block, char* buffer) {
+    SuperBlock* sb = &vol->blockptr->super_block;
+    if (disk_block < 0 || (u_int32_t)disk_block >= sb->s_blocks_count + sb->s_first_data_block) {
+        print_err("Invalid block index");
+        printf("Disk block: %d\n", disk_block);
         return -1;
     }
+    bool miss;
+    int idx = _cache_get(vol, disk_block, &miss);
+    if (idx < 0) {
+        return -1;
+    }
+    CacheEntry* entry = &vol->cache.entries[idx];
+    if (!miss) {
+        vol->cache.hits++;
+    } else {
+        // Read without cache_lock, others wait for the entry until it is filled
+        vol->cache.misses++;
+        entry->busy = true;
+        pthread_mutex_unlock(&vol->cache_lock);
+        int res = _read_disk_block(vol, disk_block, entry->data);
+        pthread_mutex_lock(&vol->cache_lock);
+        entry->busy = false;
+        pthread_cond_broadcast(&vol->cache_cond);
+        if (res < 0) {
+            _cache_unlink(vol, idx);
+            return -1;
+        }
+    }
+    entry->referenced = true;
+    memcpy(buffer, entry->data, SIZE_BLOCK);
     return 0;
 }
 
+int read_block(Volume* vol, int disk_block, char* buffer) {
+    pthread_mutex_lock(&vol->cache_lock);
+    int res = _read_block(vol, disk_block, buffer);
+    pthread_mutex_unlock(&vol->cache_lock);
+    return res;
+}
+
 int read_data(Volume* vol, int data_block, char* buffer) {
     if (data_block < 0) {
         print_err("Invalid data block index");
@@ -161,28 +1062,38 @@ int read_data(Volume* vol, int data_block, char* buffer) {
     return read_block(vol, data_block + vol->blockptr->super_block.s_first_data_block, buffer);
 }
 
-int write_block(Volume* vol, int disk_block, char* buffer) {
+// Write a block into the cache, cache_lock held
+int _write_block(Volume* vol, int disk_block, char* buffer) {
     SuperBlock* sb = &vol->blockptr->super_block;
     if (disk_block < 0 || (u_int32_t)disk_block >= sb->s_blocks_count + sb->s_first_data_block) {
         print_err("Invalid block index");
         return -1;
     }
-    Command cmd;
-    cmd.type = CMD_W;
-    cmd.len = SIZE_BLOCK;
-    cmd.block_id = disk_block;
-    memcpy(cmd.data, buffer, SIZE_BLOCK);
-    int n = write(vol->sockfd, &cmd, sizeof(Command));
-    if (n < 0) {
+    // The whole block is overwritten, no need to read it on a miss
+    bool miss;
+    int idx = _cache_get(vol, disk_block, &miss);
+    if (idx < 0) {
         return -1;
     }
-    char response[SIZE_BLOCK];
-    do {
-        n = read(vol->sockfd, response, SIZE_BLOCK);
-    } while (response[0] != 0 && n > 0);
+    if (!miss) {
+        vol->cache.hits++;
+    } else {
+        vol->cache.misses++;
+    }
+    CacheEntry* entry = &vol->cache.entries[idx];
+    memcpy(entry->data, buffer, SIZE_BLOCK);
+    entry->dirty = true;
+    entry->referenced = true;
     return 0;
 }
 
+int write_block(Volume* vol, int disk_block, char* buffer) {
+    pthread_mutex_lock(&vol->cache_lock);
+    int res = _write_block(vol, disk_block, buffer);
+    pthread_mutex_unlock(&vol->cache_lock);
+    return res;
+}
+
 int write_data(Volume* vol, int data_block, char* buffer) {
     if (data_block < 0) {
         print_err("Invalid data block index");
@@ -191,23 +1102,257 @@ int write_data(Volume* vol, int data_block, char* buffer) {
     return write_block(vol, data_block + vol->blockptr->super_block.s_first_data_block, buffer);
 }
 
+// Send vectored commands of at most MAX_VEC_SECTORS blocks each,
+// keeping up to MAX_INFLIGHT of them in flight
+int _block_vec_io(Volume* vol, int type, int count, u_int32_t* blocks, u_int32_t offset, char* buffer) {
+    SuperBlock* sb = &vol->blockptr->super_block;
+    char request[SIZE_CMD_BASIC + SECTOR_SIZE + MAX_VEC_SECTORS * SIZE_BLOCK];
+    Command* cmd = (Command*)request;
+    int tags[MAX_INFLIGHT];
+    int issued = 0, finished = 0, res = 0;
+    for (int i = 0; i < count && res == 0; i += MAX_VEC_SECTORS) {
+        int n = count - i > MAX_VEC_SECTORS ? MAX_VEC_SECTORS : count - i;
+        cmd->type = type;
+        cmd->len = n;
+        cmd->block_id = blocks[i] + offset;
+        u_int32_t* ids = (u_int32_t*)cmd->data;
+        for (int j = 0; j < n; j++) {
+            ids[j] = blocks[i + j] + offset;
+            if (ids[j] >= sb->s_blocks_count + sb->s_first_data_block) {
+                print_err("Invalid block index");
+                printf("Disk block: %u\n", ids[j]);
+                res = -1;
+            }
+        }
+        if (res < 0) {
+            break;
+        }
+        int req_len = SIZE_CMD_BASIC + n * sizeof(u_int32_t);
+        if (type == CMD_WV) {
+            memcpy(request + req_len, buffer + i * SIZE_BLOCK, n * SIZE_BLOCK);
+            req_len += n * SIZE_BLOCK;
+        }
+        // Wait for the oldest request if the window is full
+        if (issued - finished == MAX_INFLIGHT) {
+            if (wait_request(vol, tags[finished % MAX_INFLIGHT]) < 0) {
+                res = -1;
+            }
+            finished++;
+        }
+        int tag;
+        if (type == CMD_RV) {
+            tag = submit_request(vol, request, req_len, buffer + i * SIZE_BLOCK, n * SIZE_BLOCK);
+        } else {
+            tag = submit_request(vol, request, req_len, NULL, 0);
+        }
+        if (tag < 0) {
+            res = -1;
+            break;
+        }
+        tags[issued % MAX_INFLIGHT] = tag;
+        issued++;
+    }
+    // Collect the rest of the responses
+    for (; finished < issued; finished++) {
+        if (wait_request(vol, tags[finished % MAX_INFLIGHT]) < 0) {
+            res = -1;
+        }
+    }
+    if (res < 0) {
+        print_err("Vectored I/O failed");
+    }
+    return res;
+}
+
+// Mark the dirty entries of the blocks busy and copy them out, cache_lock held.
+// They are taken at once when none is busy, no entry is kept busy while waiting for another
+int _cache_take_dirty(Volume* vol, int count, u_int32_t* blocks, u_int32_t offset, u_int32_t* dirty, char* buffer) {
+    for (int i = 0; i < count; i++) {
+        int idx = _cache_lookup(vol, blocks[i] + offset);
+        if (idx >= 0 && vol->cache.entries[idx].busy) {
+            pthread_cond_wait(&vol->cache_cond, &vol->cache_lock);
+            i = -1;
+        }
+    }
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        int idx = _cache_lookup(vol, blocks[i] + offset);
+        if (idx >= 0 && vol->cache.entries[idx].dirty) {
+            vol->cache.entries[idx].busy = true;
+            dirty[n] = blocks[i] + offset;
+            memcpy(buffer + n++ * SIZE_BLOCK, vol->cache.entries[idx].data, SIZE_BLOCK);
+        }
+    }
+    return n;
+}
+
+// Release the entries taken by _cache_take_dirty, clean if they were written back, cache_lock held
+void _cache_put_dirty(Volume* vol, int n, u_int32_t* dirty, int res) {
+    for (int i = 0; i < n; i++) {
+        CacheEntry* entry = &vol->cache.entries[_cache_lookup(vol, dirty[i])];
+        entry->busy = false;
+        if (res == 0) {
+            entry->dirty = false;
+            vol->cache.writebacks++;
+        }
+    }
+    pthread_cond_broadcast(&vol->cache_cond);
+}
+
+// Write back the blocks dirty in the cache before they are read from disk
+int _cache_writeback(Volume* vol, int count, u_int32_t* blocks, u_int32_t offset) {
+    u_int32_t dirty[MAX_VEC_SECTORS];
+    char buffer[MAX_VEC_SECTORS * SIZE_BLOCK];
+    int res = 0;
+    for (int i = 0; i < count && res == 0; i += MAX_VEC_SECTORS) {
+        // Written by vectored commands of MAX_VEC_SECTORS blocks, without cache_lock
+        int len = count - i > MAX_VEC_SECTORS ? MAX_VEC_SECTORS : count - i;
+        pthread_mutex_lock(&vol->cache_lock);
+        int n = _cache_take_dirty(vol, len, blocks + i, offset, dirty, buffer);
+        pthread_mutex_unlock(&vol->cache_lock);
+        if (n == 0) {
+            continue;
+        }
+        res = _block_vec_io(vol, CMD_WV, n, dirty, 0, buffer);
+        pthread_mutex_lock(&vol->cache_lock);
+        _cache_put_dirty(vol, n, dirty, res);
+        pthread_mutex_unlock(&vol->cache_lock);
+    }
+    return res;
+}
+
+// Vectored I/O goes to disk directly, keeping the cached copies coherent:
+// dirty copies are written back before a read, copies are updated by a write and clean once it is done
+int _cached_vec_io(Volume* vol, int type, int count, u_int32_t* blocks, u_int32_t offset, char* buffer) {
+    if (type == CMD_RV) {
+        if (_cache_writeback(vol, count, blocks, offset) < 0) {
+            return -1;
+        }
+        return _block_vec_io(vol, type, count, blocks, offset, buffer);
+    }
+    u_int32_t* updated = (u_int32_t*)malloc(count * sizeof(u_int32_t));
+    if (updated == NULL && count > 0) {
+        print_err("Failed to allocate memory");
+        return -1;
+    }
+    pthread_mutex_lock(&vol->cache_lock);
+    int n = _cache_update(vol, count, blocks, offset, buffer, updated);
+    pthread_mutex_unlock(&vol->cache_lock);
+    int res = _block_vec_io(vol, type, count, blocks, offset, buffer);
+    // Kept dirty if the write failed, the cached copies are newer than the disk
+    pthread_mutex_lock(&vol->cache_lock);
+    _cache_put_dirty(vol, n, updated, res);
+    pthread_mutex_unlock(&vol->cache_lock);
+    free(updated);
+    return res;
+}
+
+int read_block_vec(Volume* vol, int count, u_int32_t* disk_blocks, char* buffer) {
+    return _cached_vec_io(vol, CMD_RV, count, disk_blocks, 0, buffer);
+}
+
+int read_data_vec(Volume* vol, int count, u_int32_t* data_blocks, char* buffer) {
+    return _cached_vec_io(vol, CMD_RV, count, data_blocks, vol->blockptr->super_block.s_first_data_block, buffer);
+}
+
+int submit_data_read(Volume* vol, int count, u_int32_t* data_blocks, char* buffer) {
+    SuperBlock* sb = &vol->blockptr->super_block;
+    Command cmd;
+    if (count <= 0 || count > MAX_VEC_SECTORS) {
+        print_err("Invalid block count");
+        return -1;
+    }
+    cmd.type = CMD_RV;
+    cmd.len = count;
+    cmd.block_id = data_blocks[0] + sb->s_first_data_block;
+    u_int32_t* ids = (u_int32_t*)cmd.data;
+    for (int i = 0; i < count; i++) {
+        if (data_blocks[i] >= sb->s_blocks_count) {
+            print_err("Invalid block index");
+            printf("Data block: %u\n", data_blocks[i]);
+            return -1;
+        }
+        ids[i] = data_blocks[i] + sb->s_first_data_block;
+    }
+    // Blocks dirty in the cache are newer than the disk
+    if (_cache_writeback(vol, count, data_blocks, sb->s_first_data_block) < 0) {
+        return -1;
+    }
+    return submit_request(vol, (char*)&cmd, SIZE_CMD_BASIC + count * sizeof(u_int32_t), buffer, count * SIZE_BLOCK);
+}
+
+int finish_data_read(Volume* vol, int tag) {
+    if (wait_request(vol, tag) < 0) {
+        print_err("Vectored I/O failed");
+        return -1;
+    }
+    return 0;
+}
+
+int write_block_vec(Volume* vol, int count, u_int32_t* disk_blocks, char* buffer) {
+    return _cached_vec_io(vol, CMD_WV, count, disk_blocks, 0, buffer);
+}
+
+int write_data_vec(Volume* vol, int count, u_int32_t* data_blocks, char* buffer) {
+    return _cached_vec_io(vol, CMD_WV, count, data_blocks, vol->blockptr->super_block.s_first_data_block, buffer);
+}
+
+int flush_cache(Volume* vol) {
+    if (flush_inodes(vol, false) < 0) {
+        return -1;
+    }
+    BlockCache* cache = &vol->cache;
+    u_int32_t blocks[CACHE_BLOCKS];
+    int count = 0;
+    // Snapshot of the dirty blocks in ascending order, written back with vectored commands
+    pthread_mutex_lock(&vol->cache_lock);
+    for (int i = 0; i < CACHE_BLOCKS; i++) {
+        if (cache->entries[i].block >= 0 && cache->entries[i].dirty) {
+            int j = count++;
+            while (j > 0 && blocks[j - 1] > (u_int32_t)cache->entries[i].block) {
+                blocks[j] = blocks[j - 1];
+                j--;
+            }
+            blocks[j] = cache->entries[i].block;
+        }
+    }
+    if (count == 0) {
+        pthread_mutex_unlock(&vol->cache_lock);
+        return 0;
+    }
+    u_int32_t* dirty = (u_int32_t*)malloc(count * sizeof(u_int32_t));
+    char* buffer = (char*)malloc(count * SIZE_BLOCK);
+    if (dirty == NULL || buffer == NULL) {
+        pthread_mutex_unlock(&vol->cache_lock);
+        print_err("Failed to allocate memory");
+        free(dirty);
+        free(buffer);
+        return -1;
+    }
+    // Busy until written, a block read from disk meanwhile must not be older than its cached copy
+    int n = _cache_take_dirty(vol, count, blocks, 0, dirty, buffer);
+    pthread_mutex_unlock(&vol->cache_lock);
+    int res = n == 0 ? 0 : _block_vec_io(vol, CMD_WV, n, dirty, 0, buffer);
+    pthread_mutex_lock(&vol->cache_lock);
+    _cache_put_dirty(vol, n, dirty, res);
+    pthread_mutex_unlock(&vol->cache_lock);
+    free(dirty);
+    free(buffer);
+    return res;
+}
+
 int confirm_sync(Volume* vol) {
-    // Send sync command
+    if (_write_meta_blocks(vol) < 0 || flush_inodes(vol, true) < 0 || flush_cache(vol) < 0) {
+        print_err("Failed to flush the block cache");
+        return -1;
+    }
+    // Send sync command and wait for response
     Command cmd;
     cmd.type = CMD_S;
     cmd.len = 0;
-    int n = write(vol->sockfd, &cmd, SIZE_CMD_BASIC);
-    if (n < 0) {
-        print_err("Sync failed");
-        return -1;
-    }
-    // Wait for response
-    char response[SIZE_BLOCK];
-    do {
-        printf("Syncing...\n");
-        n = read(vol->sockfd, response, SIZE_BLOCK);
-    } while (response[0] != 0 && n > 0);
-    if (n < 0) {
+    cmd.block_id = 0;
+    int tag = submit_request(vol, (char*)&cmd, SIZE_CMD_BASIC, NULL, 0);
+    if (tag < 0 || wait_request(vol, tag) < 0) {
         print_err("Sync failed");
         return -1;
     }
@@ -216,7 +1361,7 @@ int confirm_sync(Volume* vol) {
 
 int print_vol_info(Volume* vol, char** data, int* len) {
     SuperBlock* sb = &vol->blockptr->super_block;
-    char* buffer = (char*)malloc(SIZE_BLOCK + sb->s_inodes_count + sb->s_blocks_count);
+    char* buffer = (char*)malloc(2 * SIZE_BLOCK + sb->s_inodes_count + sb->s_blocks_count);
     char* ptr = buffer;
     ptr += sprintf(ptr, "Volume information:\n");
     ptr += sprintf(ptr, "    Block size: %8d    Inode size: %8d\n", sb->s_block_size, SIZE_INODE);
@@ -224,6 +1369,18 @@ int print_vol_info(Volume* vol, char** data, int* len) {
     ptr += sprintf(ptr, "   Free blocks: %8d   Free inodes: %8d\n", sb->s_free_blocks_count, sb->s_free_inodes_count);
     double used = (double)(sb->s_free_blocks_count * sb->s_block_size + sb->s_free_inodes_count * SIZE_INODE) / sb->s_total_size * 100;
     ptr += sprintf(ptr, "   Total space: %8d    Used space: %7.2f%%\n", sb->s_total_size, 100 - used);
+    BlockCache* cache = &vol->cache;
+    u_int32_t lookups = cache->hits + cache->misses;
+    ptr += sprintf(ptr, "    Cache hits: %8u  Cache misses: %8u    Hit rate: %7.2f%%\n", cache->hits, cache->misses,
+                   lookups == 0 ? 0 : (double)cache->hits / lookups * 100);
+    InodeCache* icache = &vol->icache;
+    lookups = icache->hits + icache->misses;
+    ptr += sprintf(ptr, "    Inode hits: %8u  Inode misses: %8u    Hit rate: %7.2f%%\n", icache->hits, icache->misses,
+                   lookups == 0 ? 0 : (double)icache->hits / lookups * 100);
+    DentryCache* dcache = &vol->dcache;
+    lookups = dcache->hits + dcache->misses;
+    ptr += sprintf(ptr, "   Dentry hits: %8u Dentry misses: %8u    Hit rate: %7.2f%%\n", dcache->hits, dcache->misses,
+                   lookups == 0 ? 0 : (double)dcache->hits / lookups * 100);
 
     static const char* Braille_table[] = {
         "⠀", "⠁", "⠂", "⠃", "⠄", "⠅", "⠆", "⠇", "⡀", "⡁", "⡂", "⡃", "⡄", "⡅", "⡆", "⡇",
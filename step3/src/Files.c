@@ -1,157 +1,249 @@
 #include "Files.h"
-
-int _read_indirect(Volume* vol, u_int32_t* indirect, char** data, u_int16_t* block_cnt, u_int32_t last_size, int start) {
-    if (start < 0) {
-        start = 0;
-    }
-    for (int i = start; i < BLOCK_ENTRIES && *block_cnt > 0; i++) {
-        if (*block_cnt > 1) {
-            if (read_data(vol, indirect[i], *data) < 0) {
-                return -1;
-            }
-            *data += SIZE_BLOCK;
-            (*block_cnt)--;
-        } else {
-            char buffer[SIZE_BLOCK];
-            if (read_data(vol, indirect[i], buffer) < 0) {
-                return -1;
-            }
-            memcpy(*data, buffer, last_size);
-            *data += last_size;
-            (*block_cnt) = 0;
-        }
-    }
-    return 0;
-}
+#include <stdint.h>
 
 int read_file(Volume* vol, FileType* file) {
     if (file->inodeptr == NULL) {
         print_err("Invalid inode");
         return -1;
     }
-    file->inodeptr->i_atime = time(NULL);
     u_int32_t start_block = file->start_block;
     file->size = file->inodeptr->i_size;
-    u_int16_t block_cnt = file->inodeptr->i_blocks - start_block;
+    if (file->inodeptr->i_flags & INODE_INLINE) {
+        if (start_block != 0) {
+            print_err("Invalid start block");
+            return -1;
+        }
+        // Data is in the inode, no block to read
+        file->data = (char*)malloc(file->size);
+        if (file->data == NULL) {
+            print_err("read_file: malloc");
+            return -1;
+        }
+        memcpy(file->data, file->inodeptr->i_data, file->size);
+        if (touch_inode(vol, file->inodeptr) < 0) {
+            free(file->data);
+            return -1;
+        }
+        return 0;
+    }
+    int block_cnt = (int)file->inodeptr->i_blocks - (int)start_block;
     if (start_block != 0 && block_cnt <= 0) {
         print_err("Invalid start block");
         return -1;
     }
-    file->data = (char*)malloc(file->size - start_block * SIZE_BLOCK);
-    char* ptr = file->data;
-    char buffer[SIZE_BLOCK + 10];
-    u_int32_t last_size = file->inodeptr->i_size % SIZE_BLOCK;
-    if (last_size == 0 && block_cnt > 0) {
-        last_size = SIZE_BLOCK;
-    }
-
-    // Direct blocks
-    for (int i = start_block; i < INODE_DIRECT && block_cnt > 0; i++) {
-        if (block_cnt > 1) {
-            if (read_data(vol, file->inodeptr->i_direct[i], ptr) < 0) {
-                print_err("read_data");
-                free(file->data);
-                return -1;
-            }
-            ptr += SIZE_BLOCK;
-            block_cnt--;
-        } else {
-            if (read_data(vol, file->inodeptr->i_direct[i], buffer) < 0) {
-                print_err("read_data");
-                free(file->data);
-                return -1;
-            }
-            memcpy(ptr, buffer, last_size);
-            ptr += last_size;
-            block_cnt = 0;
-        }
+    // Data is read in whole blocks, the tail of the last block is ignored
+    file->data = (char*)malloc(block_cnt * SIZE_BLOCK);
+    u_int32_t* blocks = (u_int32_t*)malloc(sizeof(u_int32_t) * block_cnt);
+    if (file->data == NULL || blocks == NULL) {
+        print_err("read_file: malloc");
+        free(file->data);
+        free(blocks);
+        return -1;
     }
 
-    // Indirect block
-    u_int32_t indirect[BLOCK_ENTRIES];
-    if (block_cnt > 0 && start_block < INODE_INDIRECT) {
-        if (read_data(vol, file->inodeptr->i_indirect, (char*)indirect) < 0) {
-            print_err("read_data");
-            free(file->data);
+    // Map all blocks first, then read them with vectored commands
+    if (_map_file_blocks(vol, file->inodeptr, start_block, block_cnt, blocks) < 0) {
+        print_err("_map_file_blocks");
+        free(file->data);
+        free(blocks);
+        return -1;
+    }
+    if (read_data_vec(vol, block_cnt, blocks, file->data) < 0) {
+        print_err("read_data_vec");
+        free(file->data);
+        free(blocks);
+        return -1;
+    }
+    free(blocks);
+
+    // Update access time
+    if (touch_inode(vol, file->inodeptr) < 0) {
+        free(file->data);
+        return -1;
+    }
+#ifdef _DEBUG
+    printf("File read: %u bytes\n", file->size);
+#endif
+    return 0;
+}
+
+int read_file_range(Volume* vol, Inode* inodeptr, u_int32_t offset, u_int32_t len, char* buf) {
+    if (inodeptr == NULL) {
+        print_err("Invalid inode");
+        return -1;
+    }
+    if (offset >= inodeptr->i_size) {
+        return 0;
+    }
+    if (len > inodeptr->i_size - offset) {
+        len = inodeptr->i_size - offset;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    if (inodeptr->i_flags & INODE_INLINE) {
+        memcpy(buf, inodeptr->i_data + offset, len);
+    } else {
+        // Map and read only the blocks covering the range
+        u_int32_t first = offset / SIZE_BLOCK;
+        u_int32_t block_cnt = (offset + len - 1) / SIZE_BLOCK - first + 1;
+        u_int32_t* blocks = (u_int32_t*)malloc(sizeof(u_int32_t) * block_cnt);
+        char* buffer = (char*)malloc(block_cnt * SIZE_BLOCK);
+        if (blocks == NULL || buffer == NULL) {
+            print_err("read_file_range: malloc");
+            free(blocks);
+            free(buffer);
             return -1;
         }
-        int start = start_block - INODE_DIRECT;
-        if (_read_indirect(vol, indirect, &ptr, &block_cnt, last_size, start) < 0) {
-            print_err("_read_indirect");
-            free(file->data);
+        if (_map_file_blocks(vol, inodeptr, first, block_cnt, blocks) < 0) {
+            print_err("_map_file_blocks");
+            free(blocks);
+            free(buffer);
+            return -1;
+        }
+        if (read_data_vec(vol, block_cnt, blocks, buffer) < 0) {
+            print_err("read_data_vec");
+            free(blocks);
+            free(buffer);
             return -1;
         }
+        memcpy(buf, buffer + offset % SIZE_BLOCK, len);
+        free(blocks);
+        free(buffer);
     }
 
-    // Double indirect block
-    u_int32_t dindirect[BLOCK_ENTRIES];
-    if (block_cnt > 0) {
-        if (read_data(vol, file->inodeptr->i_dindirect, (char*)dindirect) < 0) {
-            print_err("read_data");
-            free(file->data);
+    // Update access time
+    if (touch_inode(vol, inodeptr) < 0) {
+        return -1;
+    }
+    return len;
+}
+
+// Keep the data of a small file in the inode, freeing its blocks
+int _write_inline(Volume* vol, FileType* file) {
+    Inode* inodeptr = file->inodeptr;
+    if (!(inodeptr->i_flags & INODE_INLINE) && inodeptr->i_blocks > 0) {
+        u_int32_t indirect[BLOCK_ENTRIES];
+        u_int32_t dindirect[BLOCK_ENTRIES];
+        if (_free_file_blocks(vol, inodeptr, 0, indirect, dindirect) < 0) {
             return -1;
         }
-        int indirect_start = (start_block - INODE_INDIRECT) / BLOCK_ENTRIES;
-        int start = (start_block - INODE_INDIRECT) % BLOCK_ENTRIES;
-        if (start_block < INODE_INDIRECT) {
-            indirect_start = 0;
-            start = 0;
-        }
-        for (int i = indirect_start; i < BLOCK_ENTRIES && block_cnt > 0; i++) {
-            if (read_data(vol, dindirect[i], (char*)indirect) < 0) {
-                print_err("read_data");
-                free(file->data);
-                return -1;
-            }
-            if (_read_indirect(vol, indirect, &ptr, &block_cnt, last_size, start) < 0) {
-                print_err("_read_indirect");
-                free(file->data);
-                return -1;
-            }
-            start = 0;
+        if (save_meta_blocks(vol) < 0) {
+            return -1;
         }
     }
-    // Update inode
-    file->inodeptr->i_atime = time(NULL);
-    if (write_inode(vol, file->inodeptr) < 0) {
-        free(file->data);
+    inodeptr->i_flags |= INODE_INLINE;
+    memset(inodeptr->i_data, 0, INLINE_SIZE);
+    if (file->size > 0) {
+        memcpy(inodeptr->i_data, file->data, file->size);
+    }
+    inodeptr->i_blocks = 0;
+    inodeptr->i_size = file->size;
+    inodeptr->i_mtime = time(NULL);
+    inodeptr->i_atime = time(NULL);
+    if (write_inode(vol, inodeptr) < 0) {
         return -1;
     }
 #ifdef _DEBUG
-    printf("File read: %u bytes\n", file->size);
+    printf("File written inline: %u bytes\n", file->size);
 #endif
     return 0;
 }
 
-int _write_indirect(Volume* vol, u_int32_t* indirect, char** data, u_int32_t cnt, u_int32_t last_size, int start) {
-    if (start < 0) {
-        start = 0;
-    }
-    for (int i = start; i < BLOCK_ENTRIES && i < (int32_t)cnt; i++) {
-        if (i < (int32_t)cnt - 1) {
-            if (write_data(vol, indirect[i], *data) < 0) {
-                return -1;
-            }
-            *data += SIZE_BLOCK;
-        } else {
-            char buffer[SIZE_BLOCK];
-            memset(buffer, 0, SIZE_BLOCK);
-            memcpy(buffer, *data, last_size);
-            if (write_data(vol, indirect[i], buffer) < 0) {
-                return -1;
-            }
-            *data += last_size;
+int _fill_stream(Volume* vol, FileStream* stream) {
+    Inode* inodeptr = stream->inodeptr;
+    u_int32_t block_cnt = (inodeptr->i_size + SIZE_BLOCK - 1) / SIZE_BLOCK;
+    while (stream->count < STREAM_RING && stream->next_block < block_cnt) {
+        StreamChunk* chunk = &stream->ring[(stream->head + stream->count) % STREAM_RING];
+        chunk->cnt = block_cnt - stream->next_block > STREAM_BLOCKS ? STREAM_BLOCKS : block_cnt - stream->next_block;
+        if (_map_file_blocks(vol, inodeptr, stream->next_block, chunk->cnt, chunk->blocks) < 0) {
+            print_err("_map_file_blocks");
+            return -1;
+        }
+        chunk->tag = submit_data_read(vol, chunk->cnt, chunk->blocks, chunk->data);
+        if (chunk->tag < 0) {
+            print_err("submit_data_read");
+            return -1;
         }
+        stream->next_block += chunk->cnt;
+        stream->count++;
     }
     return 0;
 }
 
+int open_stream(Volume* vol, Inode* inodeptr, FileStream* stream) {
+    if (inodeptr == NULL) {
+        print_err("Invalid inode");
+        return -1;
+    }
+    stream->inodeptr = inodeptr;
+    stream->next_block = 0;
+    stream->offset = 0;
+    stream->head = 0;
+    stream->count = 0;
+    for (int i = 0; i < STREAM_RING; i++) {
+        stream->ring[i].tag = -1;
+    }
+
+    // Update access time
+    if (touch_inode(vol, inodeptr) < 0) {
+        return -1;
+    }
+    if (inodeptr->i_flags & INODE_INLINE) {
+        return 0;
+    }
+    return _fill_stream(vol, stream);
+}
+
+int read_stream(Volume* vol, FileStream* stream, char** data) {
+    Inode* inodeptr = stream->inodeptr;
+    if (stream->offset >= inodeptr->i_size) {
+        return 0;
+    }
+    if (inodeptr->i_flags & INODE_INLINE) {
+        *data = inodeptr->i_data;
+        stream->offset = inodeptr->i_size;
+        return inodeptr->i_size;
+    }
+
+    // Reuse the chunk returned before, then wait for the oldest one
+    if (_fill_stream(vol, stream) < 0 || stream->count == 0) {
+        return -1;
+    }
+    StreamChunk* chunk = &stream->ring[stream->head];
+    int res = finish_data_read(vol, chunk->tag);
+    chunk->tag = -1;
+    stream->head = (stream->head + 1) % STREAM_RING;
+    stream->count--;
+    if (res < 0) {
+        print_err("finish_data_read");
+        return -1;
+    }
+    u_int32_t len = chunk->cnt * SIZE_BLOCK;
+    if (len > inodeptr->i_size - stream->offset) {
+        len = inodeptr->i_size - stream->offset;
+    }
+    stream->offset += len;
+    *data = chunk->data;
+    return len;
+}
+
+void close_stream(Volume* vol, FileStream* stream) {
+    for (int i = 0; i < STREAM_RING; i++) {
+        if (stream->ring[i].tag >= 0) {
+            wait_request(vol, stream->ring[i].tag);
+            stream->ring[i].tag = -1;
+        }
+    }
+    stream->count = 0;
+}
+
 int write_file(Volume* vol, FileType* file) {
     if (file->inodeptr == NULL) {
         print_err("Invalid inode");
         return -1;
     }
-    char buffer[SIZE_BLOCK + 10];
     u_int32_t start_block = file->start_block;
     u_int16_t original_blocks = file->inodeptr->i_blocks;
     u_int16_t block_cnt = file->size / SIZE_BLOCK + (file->size % SIZE_BLOCK != 0);
@@ -163,6 +255,17 @@ int write_file(Volume* vol, FileType* file) {
         print_err("File too large");
         return -1;
     }
+
+    // Small files are kept in the inode, and moved to blocks once they grow
+    bool is_inline = (file->inodeptr->i_flags & INODE_INLINE) != 0;
+    if (start_block == 0 && file->size <= INLINE_SIZE && (vol->inline_data || is_inline)) {
+        return _write_inline(vol, file);
+    }
+    if (is_inline) {
+        file->inodeptr->i_flags &= ~INODE_INLINE;
+        file->inodeptr->i_blocks = 0;
+        original_blocks = 0;
+    }
     u_int32_t indirect[BLOCK_ENTRIES];
     u_int32_t dindirect[BLOCK_ENTRIES];
 
@@ -174,67 +277,35 @@ int write_file(Volume* vol, FileType* file) {
         }
     }
 
-    // Write data to blocks
-    char* ptr = file->data;
-    u_int32_t last_size = file->size % SIZE_BLOCK;
-    if (last_size == 0 && block_cnt > 0) {
-        last_size = SIZE_BLOCK;
-    }
-
-    // - Direct blocks
-    for (int i = start_block; i < INODE_DIRECT && i < block_cnt; i++) {
-        if (i < block_cnt - 1) {
-            if (write_data(vol, file->inodeptr->i_direct[i], ptr) < 0) {
-                print_err("write_data");
-                return -1;
-            }
-            ptr += SIZE_BLOCK;
-        } else {
-            memset(buffer, 0, SIZE_BLOCK);
-            memcpy(buffer, ptr, last_size);
-            if (write_data(vol, file->inodeptr->i_direct[i], buffer) < 0) {
-                return -1;
-            }
-        }
-    }
-
-    // - Indirect block
-    if (block_cnt > INODE_DIRECT && start_block < INODE_INDIRECT) {
-        if (read_data(vol, file->inodeptr->i_indirect, (char*)indirect) < 0) {
-            print_err("Read indirect block");
+    // Write data to blocks with vectored commands
+    if (block_cnt > start_block) {
+        u_int32_t write_cnt = block_cnt - start_block;
+        u_int32_t data_len = file->size - start_block * SIZE_BLOCK;
+        u_int32_t* blocks = (u_int32_t*)malloc(sizeof(u_int32_t) * write_cnt);
+        char* buffer = (char*)malloc(write_cnt * SIZE_BLOCK);
+        if (blocks == NULL || buffer == NULL) {
+            print_err("write_file: malloc");
+            free(blocks);
+            free(buffer);
             return -1;
         }
-        int start = start_block - INODE_DIRECT;
-        if (_write_indirect(vol, indirect, &ptr, block_cnt - INODE_DIRECT, last_size, start) < 0) {
-            print_err("_write_indirect");
+        // Pad the last block with zeros
+        memcpy(buffer, file->data, data_len);
+        memset(buffer + data_len, 0, write_cnt * SIZE_BLOCK - data_len);
+        if (_map_file_blocks(vol, file->inodeptr, start_block, write_cnt, blocks) < 0) {
+            print_err("_map_file_blocks");
+            free(blocks);
+            free(buffer);
             return -1;
         }
-    }
-
-    // - Double indirect block
-    if (block_cnt > INODE_INDIRECT) {
-        if (read_data(vol, file->inodeptr->i_dindirect, (char*)dindirect) < 0) {
-            print_err("Read double indirect block");
+        if (write_data_vec(vol, write_cnt, blocks, buffer) < 0) {
+            print_err("write_data_vec");
+            free(blocks);
+            free(buffer);
             return -1;
         }
-        int start = (start_block - INODE_INDIRECT) % BLOCK_ENTRIES;
-        int indirect_start = (start_block - INODE_INDIRECT) / BLOCK_ENTRIES;
-        int indirect_blocks = (block_cnt - INODE_INDIRECT) / BLOCK_ENTRIES + ((block_cnt - INODE_INDIRECT) % BLOCK_ENTRIES != 0);
-        if (start_block < INODE_INDIRECT) {
-            start = 0;
-            indirect_start = 0;
-        }
-        for (int i = indirect_start; i < BLOCK_ENTRIES && i < indirect_blocks; i++) {
-            if (read_data(vol, dindirect[i], (char*)indirect) < 0) {
-                print_err("Read indirect block");
-                return -1;
-            }
-            int blocks_left = block_cnt - INODE_INDIRECT - i * BLOCK_ENTRIES;
-            if (_write_indirect(vol, indirect, &ptr, blocks_left, last_size, start) < 0) {
-                return -1;
-            }
-            start = 0;
-        }
+        free(blocks);
+        free(buffer);
     }
 
     // Free blocks
@@ -267,6 +338,218 @@ int write_file(Volume* vol, FileType* file) {
     return 0;
 }
 
+int write_file_range(Volume* vol, Inode* inodeptr, u_int32_t offset, u_int32_t len, char* buf) {
+    if (inodeptr == NULL) {
+        print_err("Invalid inode");
+        return -1;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    u_int32_t old_size = inodeptr->i_size;
+    u_int32_t end = offset + len;
+    u_int32_t new_size = end > old_size ? end : old_size;
+    u_int32_t block_cnt = new_size / SIZE_BLOCK + (new_size % SIZE_BLOCK != 0);
+    if (block_cnt >= INODE_DINDIRECT) {
+        print_err("File too large");
+        return -1;
+    }
+
+    // Small files are kept in the inode, and moved to blocks once they grow
+    bool is_inline = (inodeptr->i_flags & INODE_INLINE) != 0;
+    if (new_size <= INLINE_SIZE && (is_inline || (vol->inline_data && inodeptr->i_blocks == 0))) {
+        if (!is_inline) {
+            inodeptr->i_flags |= INODE_INLINE;
+            memset(inodeptr->i_data, 0, INLINE_SIZE);
+        }
+        memcpy(inodeptr->i_data + offset, buf, len);
+        inodeptr->i_size = new_size;
+        inodeptr->i_mtime = time(NULL);
+        inodeptr->i_atime = time(NULL);
+        if (write_inode(vol, inodeptr) < 0) {
+            return -1;
+        }
+        return len;
+    }
+    u_int32_t old_blocks = inodeptr->i_blocks;
+    u_int32_t lo = offset < old_size ? offset : old_size;
+    char old_data[INLINE_SIZE];
+    if (is_inline) {
+        // The data in the inode is written to the first block with the range
+        memcpy(old_data, inodeptr->i_data, old_size);
+        inodeptr->i_flags &= ~INODE_INLINE;
+        inodeptr->i_blocks = 0;
+        old_blocks = 0;
+        lo = 0;
+    }
+
+    // Allocate blocks
+    if (block_cnt > old_blocks) {
+        u_int32_t indirect[BLOCK_ENTRIES];
+        u_int32_t dindirect[BLOCK_ENTRIES];
+        if (_allocate_file_blocks(vol, inodeptr, block_cnt, indirect, dindirect) < 0) {
+            print_err("_allocate_file_blocks");
+            return -1;
+        }
+    }
+
+    // Only the blocks in the range are written, the partial ones are read first
+    u_int32_t first = lo / SIZE_BLOCK;
+    u_int32_t write_cnt = (end - 1) / SIZE_BLOCK - first + 1;
+    u_int32_t* blocks = (u_int32_t*)malloc(sizeof(u_int32_t) * write_cnt);
+    char* buffer = (char*)malloc(write_cnt * SIZE_BLOCK);
+    if (blocks == NULL || buffer == NULL) {
+        print_err("write_file_range: malloc");
+        free(blocks);
+        free(buffer);
+        return -1;
+    }
+    memset(buffer, 0, write_cnt * SIZE_BLOCK);
+    int res = _map_file_blocks(vol, inodeptr, first, write_cnt, blocks);
+    bool read_first = false;
+    if (res == 0 && is_inline) {
+        memcpy(buffer, old_data, old_size);
+    } else if (res == 0 && lo % SIZE_BLOCK != 0) {
+        res = read_data(vol, blocks[0], buffer);
+        read_first = true;
+    }
+    if (res == 0 && end < old_size && end % SIZE_BLOCK != 0 && !(write_cnt == 1 && read_first)) {
+        res = read_data(vol, blocks[write_cnt - 1], buffer + (write_cnt - 1) * SIZE_BLOCK);
+    }
+    if (res < 0) {
+        print_err("write_file_range: read");
+        free(blocks);
+        free(buffer);
+        return -1;
+    }
+    if (offset > old_size) {
+        // Fill the gap after the end of the file with zeros
+        memset(buffer + old_size - first * SIZE_BLOCK, 0, offset - old_size);
+    }
+    memcpy(buffer + offset - first * SIZE_BLOCK, buf, len);
+    if (write_data_vec(vol, write_cnt, blocks, buffer) < 0) {
+        print_err("write_data_vec");
+        free(blocks);
+        free(buffer);
+        return -1;
+    }
+    free(blocks);
+    free(buffer);
+
+    if (block_cnt != old_blocks) {
+        // Update superblock
+        if (save_meta_blocks(vol) < 0) {
+            return -1;
+        }
+    }
+
+    // Update inode
+    inodeptr->i_blocks = block_cnt;
+    inodeptr->i_size = new_size;
+    inodeptr->i_mtime = time(NULL);
+    inodeptr->i_atime = time(NULL);
+    if (write_inode(vol, inodeptr) < 0) {
+        return -1;
+    }
+    return len;
+}
+
+int truncate_file(Volume* vol, Inode* inodeptr, u_int32_t size) {
+    if (inodeptr == NULL) {
+        print_err("Invalid inode");
+        return -1;
+    }
+    if (size >= inodeptr->i_size) {
+        return 0;
+    }
+    if (inodeptr->i_flags & INODE_INLINE) {
+        memset(inodeptr->i_data + size, 0, INLINE_SIZE - size);
+    } else if (vol->inline_data && size <= INLINE_SIZE) {
+        // Small enough to be moved into the inode
+        char data[INLINE_SIZE];
+        if (read_file_range(vol, inodeptr, 0, size, data) < 0) {
+            return -1;
+        }
+        FileType file;
+        file.inodeptr = inodeptr;
+        file.data = data;
+        file.size = size;
+        file.start_block = 0;
+        return _write_inline(vol, &file);
+    } else {
+        u_int32_t block_cnt = size / SIZE_BLOCK + (size % SIZE_BLOCK != 0);
+        if (block_cnt < inodeptr->i_blocks) {
+            u_int32_t indirect[BLOCK_ENTRIES];
+            u_int32_t dindirect[BLOCK_ENTRIES];
+            if (_free_file_blocks(vol, inodeptr, block_cnt, indirect, dindirect) < 0) {
+                return -1;
+            }
+            inodeptr->i_blocks = block_cnt;
+            if (save_meta_blocks(vol) < 0) {
+                return -1;
+            }
+        }
+    }
+    inodeptr->i_size = size;
+    inodeptr->i_mtime = time(NULL);
+    inodeptr->i_atime = time(NULL);
+    return write_inode(vol, inodeptr);
+}
+
+int shift_file(Volume* vol, Inode* inodeptr, u_int32_t pos, int delta) {
+    if (inodeptr == NULL) {
+        print_err("Invalid inode");
+        return -1;
+    }
+    u_int32_t size = inodeptr->i_size;
+    if (pos > size || (delta < 0 && (u_int32_t)-delta > pos)) {
+        print_err("Invalid position");
+        return -1;
+    }
+    if (delta == 0) {
+        return 0;
+    }
+    u_int32_t new_size = size + delta;
+    if (new_size / SIZE_BLOCK + (new_size % SIZE_BLOCK != 0) >= INODE_DINDIRECT) {
+        print_err("File too large");
+        return -1;
+    }
+    char* chunk = (char*)malloc(SHIFT_CHUNK);
+    if (chunk == NULL) {
+        print_err("shift_file: malloc");
+        return -1;
+    }
+
+    // Move the data from the end when growing and from pos when shrinking,
+    // so that nothing is overwritten before being moved.
+    // Chunks are cut on the blocks of the destination.
+    u_int32_t tail = size - pos;
+    u_int32_t done = 0;
+    while (done < tail) {
+        u_int32_t src, n;
+        if (delta > 0) {
+            n = (size - done + delta) % SHIFT_CHUNK;
+            n = n == 0 ? SHIFT_CHUNK : n;
+            n = n < tail - done ? n : tail - done;
+            src = size - done - n;
+        } else {
+            src = pos + done;
+            n = SHIFT_CHUNK - (src + delta) % SHIFT_CHUNK;
+            n = n < tail - done ? n : tail - done;
+        }
+        if (read_file_range(vol, inodeptr, src, n, chunk) < 0 || write_file_range(vol, inodeptr, src + delta, n, chunk) < 0) {
+            free(chunk);
+            return -1;
+        }
+        done += n;
+    }
+    free(chunk);
+    if (delta < 0) {
+        return truncate_file(vol, inodeptr, new_size);
+    }
+    return 0;
+}
+
 int parse_dir(FileType* file, DirType* dir) {
     /**
      * Structure of a directory file:
@@ -281,27 +564,292 @@ int parse_dir(FileType* file, DirType* dir) {
     if (file->inodeptr == NULL || file->data == NULL) {
         return -1;
     }
-    u_int16_t dir_size = *(u_int16_t*)file->data;
+    // Records of mode INODE_UNUSED are free, counted in DirSize and kept for new entries
+    u_int16_t records = *(u_int16_t*)file->data;
     dir->inodeptr = file->inodeptr;
     dir->orig_data = file->data;
-    dir->dir_size = dir_size;
-    dir->dir_entries = (DirEntry*)(malloc(sizeof(DirEntry) * dir_size));
+    dir->dir_entries = (DirEntry*)(malloc(sizeof(DirEntry) * records));
+    dir->holes = (u_int16_t*)malloc(sizeof(u_int16_t) * records);
+    dir->index = NULL;
+    if (dir->dir_entries == NULL || dir->holes == NULL) {
+        print_err("parse_dir: Failed to malloc entries");
+        return -1;
+    }
     DirEntry* entries = dir->dir_entries;
     char* ptr = file->data + DIR_ENTEY_OFFSET;
     u_int16_t tot_size = DIR_ENTEY_OFFSET;
+    u_int16_t dir_size = 0;
+    dir->n_holes = 0;
+    dir->hole_size = 0;
 
-    for (int i = 0; i < dir_size; i++) {
-        entries[i].inode_mode = *(u_int16_t*)ptr;
-        ptr += 2;
-        entries[i].inode_idx = *(u_int16_t*)ptr;
-        ptr += 2;
-        entries[i].filename_len = *(u_int16_t*)ptr;
-        ptr += 2;
-        entries[i].filename = ptr;
-        ptr += entries[i].filename_len;
-        tot_size += 6 + entries[i].filename_len;
+    for (int i = 0; i < records; i++) {
+        u_int16_t mode = ((u_int16_t*)ptr)[0];
+        u_int16_t len = ((u_int16_t*)ptr)[2];
+        if (mode == INODE_UNUSED) {
+            dir->holes[dir->n_holes++] = ptr - file->data;
+            dir->hole_size += DIR_RECORD_HEAD + len;
+        } else {
+            entries[dir_size].inode_mode = mode;
+            entries[dir_size].inode_idx = ((u_int16_t*)ptr)[1];
+            entries[dir_size].filename_len = len;
+            entries[dir_size].filename = ptr + DIR_RECORD_HEAD;
+            dir_size++;
+        }
+        ptr += DIR_RECORD_HEAD + len;
+        tot_size += DIR_RECORD_HEAD + len;
     }
+    dir->dir_size = dir_size;
     dir->tot_size = tot_size;
+    return index_dir(dir);
+}
+
+// FNV-1a hash of a name
+u_int32_t _hash_name(char* name, int len) {
+    u_int32_t hash = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        hash = (hash ^ (u_int8_t)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+void _free_index(DirIndex* index) {
+    if (index != NULL) {
+        free(index->head);
+        free(index->next);
+        free(index);
+    }
+}
+
+int index_dir(DirType* dir) {
+    DirIndex* index = (DirIndex*)malloc(sizeof(DirIndex));
+    if (index == NULL) {
+        print_err("index_dir: Failed to malloc index");
+        return -1;
+    }
+    index->size = DIR_HASH_MIN;
+    while (index->size < dir->dir_size) {
+        index->size *= 2;
+    }
+    index->cap = index->size;
+    index->head = (int*)malloc(sizeof(int) * index->size);
+    index->next = (int*)malloc(sizeof(int) * index->cap);
+    if (index->head == NULL || index->next == NULL) {
+        print_err("index_dir: Failed to malloc buckets");
+        _free_index(index);
+        return -1;
+    }
+    memset(index->head, 0xff, sizeof(int) * index->size);
+    _free_index(dir->index);
+    dir->index = index;
+    for (int i = 0; i < dir->dir_size; i++) {
+        DirEntry* entry = &dir->dir_entries[i];
+        int bucket = _hash_name(entry->filename, entry->filename_len) & (index->size - 1);
+        index->next[i] = index->head[bucket];
+        index->head[bucket] = i;
+    }
+    return 0;
+}
+
+int index_dir_search(DirType* dir, char* name, int len) {
+    DirIndex* index = dir->index;
+    int bucket = _hash_name(name, len) & (index->size - 1);
+    for (int i = index->head[bucket]; i >= 0; i = index->next[i]) {
+        DirEntry* entry = &dir->dir_entries[i];
+        if (entry->filename_len == len && memcmp(entry->filename, name, len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int index_dir_add(DirType* dir, int entry_idx) {
+    DirIndex* index = dir->index;
+    if (dir->dir_size > index->size || entry_idx >= index->cap) {
+        return index_dir(dir);
+    }
+    DirEntry* entry = &dir->dir_entries[entry_idx];
+    int bucket = _hash_name(entry->filename, entry->filename_len) & (index->size - 1);
+    index->next[entry_idx] = index->head[bucket];
+    index->head[bucket] = entry_idx;
+    return 0;
+}
+
+void index_dir_remove(DirType* dir, int entry_idx) {
+    DirIndex* index = dir->index;
+    DirEntry* entry = &dir->dir_entries[entry_idx];
+    int* link = &index->head[_hash_name(entry->filename, entry->filename_len) & (index->size - 1)];
+    while (*link >= 0 && *link != entry_idx) {
+        link = &index->next[*link];
+    }
+    if (*link == entry_idx) {
+        *link = index->next[entry_idx];
+    }
+    // Relink the last entry at its new place
+    int last = dir->dir_size - 1;
+    if (entry_idx == last) {
+        return;
+    }
+    entry = &dir->dir_entries[last];
+    link = &index->head[_hash_name(entry->filename, entry->filename_len) & (index->size - 1)];
+    while (*link >= 0 && *link != last) {
+        link = &index->next[*link];
+    }
+    if (*link == last) {
+        *link = entry_idx;
+    }
+    index->next[entry_idx] = index->next[last];
+}
+
+// Offset of the record of an entry in the directory file
+u_int16_t _dir_record(DirType* dir, DirEntry* entry) {
+    return entry->filename - dir->orig_data - DIR_RECORD_HEAD;
+}
+
+// Rewrite a directory without its free records, then parse it again
+int _compact_dir(Volume* vol, DirType* dir) {
+    FileType file;
+    file.data = NULL;
+    file.start_block = 0;
+    dir->tot_size -= dir->hole_size;
+    if (encode_dir(dir, &file) < 0) {
+        free(file.data);
+        return -1;
+    }
+    if (write_file(vol, &file) < 0) {
+        free(file.data);
+        return -1;
+    }
+    free_dir(dir);
+    return parse_dir(&file, dir);
+}
+
+int dir_add_entry(Volume* vol, DirType* dir, u_int16_t mode, u_int16_t inode_idx, char* name, u_int16_t len) {
+    u_int32_t need = DIR_RECORD_HEAD + len;
+    u_int32_t records = dir->dir_size + dir->n_holes;
+
+    // Take the first free record that fits exactly or leaves room for a smaller free record
+    int hole = -1;
+    u_int32_t hole_len = 0;
+    for (int i = 0; i < dir->n_holes; i++) {
+        hole_len = DIR_RECORD_HEAD + ((u_int16_t*)(dir->orig_data + dir->holes[i]))[2];
+        if (hole_len == need || hole_len >= need + DIR_RECORD_HEAD) {
+            hole = i;
+            break;
+        }
+    }
+    bool split = hole >= 0 && hole_len != need;
+    if ((hole < 0 || split) && records + 1 > 0xffff) {
+        print_err("dir_add_entry: Directory full");
+        return -1;
+    }
+    if (hole < 0 && dir->tot_size + need > 0xffff) {
+        print_err("dir_add_entry: Directory full");
+        return -1;
+    }
+    DirEntry* entries = (DirEntry*)realloc(dir->dir_entries, sizeof(DirEntry) * (dir->dir_size + 1));
+    if (entries == NULL) {
+        print_err("dir_add_entry: Failed to malloc entry");
+        return -1;
+    }
+    dir->dir_entries = entries;
+
+    u_int32_t offset;
+    if (hole >= 0) {
+        offset = dir->holes[hole];
+        dir->hole_size -= need;
+        if (split) {
+            // The rest of the free record stays free
+            u_int16_t* rest = (u_int16_t*)(dir->orig_data + offset + need);
+            rest[0] = INODE_UNUSED;
+            rest[1] = 0;
+            rest[2] = hole_len - need - DIR_RECORD_HEAD;
+            dir->holes[hole] = offset + need;
+        } else {
+            dir->holes[hole] = dir->holes[--dir->n_holes];
+        }
+    } else {
+        offset = dir->tot_size;
+        uintptr_t old_base = (uintptr_t)dir->orig_data;
+        char* data = (char*)realloc(dir->orig_data, dir->tot_size + need);
+        if (data == NULL) {
+            print_err("dir_add_entry: Failed to malloc data");
+            return -1;
+        }
+        // The names point into the data, which may have been moved
+        if ((uintptr_t)data != old_base) {
+            for (int i = 0; i < dir->dir_size; i++) {
+                entries[i].filename = data + ((uintptr_t)entries[i].filename - old_base);
+            }
+        }
+        dir->orig_data = data;
+        dir->tot_size += need;
+    }
+    u_int16_t* record = (u_int16_t*)(dir->orig_data + offset);
+    record[0] = mode;
+    record[1] = inode_idx;
+    record[2] = len;
+    memcpy(dir->orig_data + offset + DIR_RECORD_HEAD, name, len);
+
+    DirEntry* entry = &entries[dir->dir_size];
+    entry->inode_mode = mode;
+    entry->inode_idx = inode_idx;
+    entry->filename_len = len;
+    entry->filename = dir->orig_data + offset + DIR_RECORD_HEAD;
+    dir->dir_size++;
+    if (index_dir_add(dir, dir->dir_size - 1) < 0) {
+        return -1;
+    }
+
+    // Only the record is written, with the header if a record was added
+    u_int32_t write_len = need + (split ? DIR_RECORD_HEAD : 0);
+    if (hole < 0 || split) {
+        *(u_int16_t*)dir->orig_data = records + 1;
+        if (offset + write_len <= SIZE_BLOCK) {
+            // Both in the first block
+            write_len += offset;
+            offset = 0;
+        } else if (write_file_range(vol, dir->inodeptr, 0, DIR_ENTEY_OFFSET, dir->orig_data) < 0) {
+            return -1;
+        }
+    }
+    if (write_file_range(vol, dir->inodeptr, offset, write_len, dir->orig_data + offset) < 0) {
+        return -1;
+    }
+    insert_dentry(vol, dir->inodeptr->i_idx, name, len, inode_idx, mode);
+    return dir->dir_size - 1;
+}
+
+int dir_remove_entry(Volume* vol, DirType* dir, int entry_idx) {
+    DirEntry* entry = &dir->dir_entries[entry_idx];
+    insert_dentry(vol, dir->inodeptr->i_idx, entry->filename, entry->filename_len, DENTRY_NEGATIVE, INODE_UNUSED);
+    if (entry->inode_mode == INODE_DIR) {
+        // The inode may be reused by a new directory
+        drop_dentries(vol, entry->inode_idx);
+    }
+    u_int16_t offset = _dir_record(dir, entry);
+    u_int16_t* holes = (u_int16_t*)realloc(dir->holes, sizeof(u_int16_t) * (dir->n_holes + 1));
+    if (holes == NULL) {
+        print_err("dir_remove_entry: Failed to malloc holes");
+        return -1;
+    }
+    dir->holes = holes;
+    holes[dir->n_holes++] = offset;
+    dir->hole_size += DIR_RECORD_HEAD + entry->filename_len;
+    u_int16_t* record = (u_int16_t*)(dir->orig_data + offset);
+    record[0] = INODE_UNUSED;
+    record[1] = 0;
+
+    index_dir_remove(dir, entry_idx);
+    dir->dir_entries[entry_idx] = dir->dir_entries[dir->dir_size - 1];
+    dir->dir_size--;
+
+    int init_items = dir->inodeptr->i_idx == 0 ? 1 : 2;
+    if (dir->dir_size <= init_items || dir->hole_size > dir->tot_size / 2) {
+        return _compact_dir(vol, dir);
+    }
+    if (write_file_range(vol, dir->inodeptr, offset, sizeof(u_int16_t) * 2, (char*)record) < 0) {
+        return -1;
+    }
     return 0;
 }
 
@@ -366,8 +914,12 @@ int encode_dir(DirType* dir, FileType* file) {
 void free_dir(DirType* dir) {
     free(dir->dir_entries);
     free(dir->orig_data);
+    free(dir->holes);
+    _free_index(dir->index);
     dir->dir_entries = NULL;
     dir->orig_data = NULL;
+    dir->holes = NULL;
+    dir->index = NULL;
 }
 
 void print_dir(DirType* dir) {
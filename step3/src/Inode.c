@@ -2,17 +2,18 @@
 
 int allocate_inode(Volume* vol) {
     SuperBlock* sb = &vol->blockptr->super_block;
-    if (sb->s_free_inodes_count == 0) {
-        return -1;
+    pthread_mutex_lock(&vol->alloc_lock);
+    int i = -1;
+    if (sb->s_free_inodes_count > 0) {
+        i = find_zero_bit(vol->blockptr->inode_bitmap, sb->s_inodes_count, &vol->inode_cursor);
     }
-    for (int i = 0; (u_int32_t)i < sb->s_inodes_count; i++) {
-        if ((vol->blockptr->inode_bitmap[i / BITMAP_WIDTH] & (1UL << (i % BITMAP_WIDTH))) == 0) {
-            vol->blockptr->inode_bitmap[i / BITMAP_WIDTH] |= (1UL << (i % BITMAP_WIDTH));
-            sb->s_free_inodes_count--;
-            return i;
-        }
+    if (i >= 0) {
+        vol->blockptr->inode_bitmap[i / BITMAP_WIDTH] |= (1UL << (i % BITMAP_WIDTH));
+        sb->s_free_inodes_count--;
+        mark_meta_dirty(vol, offsetof(MetaBlocks, inode_bitmap));
     }
-    return -1;
+    pthread_mutex_unlock(&vol->alloc_lock);
+    return i;
 }
 
 int free_inode(Volume* vol, int inode_idx) {
@@ -20,12 +21,33 @@ int free_inode(Volume* vol, int inode_idx) {
     if (inode_idx < 0 || (u_int32_t)inode_idx >= sb->s_inodes_count) {
         return -1;
     }
-    if ((vol->blockptr->inode_bitmap[inode_idx / BITMAP_WIDTH] & (1UL << (inode_idx % BITMAP_WIDTH))) == 0) {
-        return -1;
+    int res = -1;
+    pthread_mutex_lock(&vol->alloc_lock);
+    if ((vol->blockptr->inode_bitmap[inode_idx / BITMAP_WIDTH] & (1UL << (inode_idx % BITMAP_WIDTH))) != 0) {
+        vol->blockptr->inode_bitmap[inode_idx / BITMAP_WIDTH] &= ~(1UL << (inode_idx % BITMAP_WIDTH));
+        sb->s_free_inodes_count++;
+        mark_meta_dirty(vol, offsetof(MetaBlocks, inode_bitmap));
+        res = 0;
     }
-    vol->blockptr->inode_bitmap[inode_idx / BITMAP_WIDTH] &= ~(1UL << (inode_idx % BITMAP_WIDTH));
-    sb->s_free_inodes_count++;
-    return 0;
+    pthread_mutex_unlock(&vol->alloc_lock);
+    return res;
+}
+
+void lock_inode(Volume* vol, int inode_idx, bool write) {
+    pthread_rwlock_t* lock = &vol->inode_locks[inode_idx % INODE_LOCKS];
+    if (write) {
+        pthread_rwlock_wrlock(lock);
+    } else {
+        pthread_rwlock_rdlock(lock);
+    }
+}
+
+int try_lock_inode(Volume* vol, int inode_idx) {
+    return pthread_rwlock_trywrlock(&vol->inode_locks[inode_idx % INODE_LOCKS]) == 0 ? 0 : -1;
+}
+
+void unlock_inode(Volume* vol, int inode_idx) {
+    pthread_rwlock_unlock(&vol->inode_locks[inode_idx % INODE_LOCKS]);
 }
 
 int read_inode(Volume* vol, Inode* inode) {
@@ -34,14 +56,7 @@ int read_inode(Volume* vol, Inode* inode) {
     if (inode_idx >= sb->s_inodes_count) {
         return -1;
     }
-    int inode_blk = METABLOCKS_SIZE + inode_idx / sb->s_inodes_per_block;
-    int inode_off = inode_idx % sb->s_inodes_per_block;
-    char buffer[SIZE_BLOCK];
-    if (read_block(vol, inode_blk, buffer) < 0) {
-        return -1;
-    }
-    memcpy(inode, buffer + inode_off * sizeof(Inode), sizeof(Inode));
-    return 0;
+    return read_inode_record(vol, inode_idx, (char*)inode);
 }
 
 int write_inode(Volume* vol, Inode* inode) {
@@ -50,30 +65,289 @@ int write_inode(Volume* vol, Inode* inode) {
     if (inode_idx >= sb->s_inodes_count) {
         return -1;
     }
-    int inode_blk = METABLOCKS_SIZE + inode_idx / sb->s_inodes_per_block;
-    int inode_off = inode_idx % sb->s_inodes_per_block;
-    char buffer[SIZE_BLOCK];
-    if (read_block(vol, inode_blk, buffer) < 0) {
+    return write_inode_record(vol, inode_idx, (char*)inode);
+}
+
+int touch_inode(Volume* vol, Inode* inode) {
+    u_int32_t now = time(NULL);
+    switch (vol->atime_mode) {
+        case ATIME_NO:
+            return 0;
+
+        case ATIME_REL:
+            if (inode->i_atime > inode->i_mtime && now - inode->i_atime < RELATIME_THRESHOLD) {
+                return 0;
+            }
+            break;
+
+        case ATIME_LAZY:
+            inode->i_atime = now;
+            return touch_inode_record(vol, inode->i_idx, (char*)inode);
+
+        default:
+            break;
+    }
+    inode->i_atime = now;
+    return write_inode(vol, inode);
+}
+
+int _read_extents(Volume* vol, Inode* inodeptr, u_int32_t block_cnt, Extent* extents) {
+    u_int32_t covered = 0;
+    int count = 0;
+    for (; count < EXTENTS_INODE && covered < block_cnt; count++) {
+        if (inodeptr->i_extent[count].e_len == 0) {
+            return -1;
+        }
+        extents[count] = inodeptr->i_extent[count];
+        covered += extents[count].e_len;
+    }
+
+    // The extent block is used only if the extents in the inode are not enough
+    if (covered < block_cnt) {
+        if (read_data(vol, inodeptr->i_extent_block, (char*)(extents + EXTENTS_INODE)) < 0) {
+            return -1;
+        }
+        for (; count < (int)EXTENTS_MAX && covered < block_cnt; count++) {
+            if (extents[count].e_len == 0) {
+                return -1;
+            }
+            covered += extents[count].e_len;
+        }
+        if (covered < block_cnt) {
+            return -1;
+        }
+    }
+    return count;
+}
+
+int _write_extents(Volume* vol, Inode* inodeptr, Extent* extents, int count, int old_count) {
+    if (count > EXTENTS_INODE) {
+        if (old_count <= EXTENTS_INODE) {
+            int block = allocate_block(vol);
+#ifdef _DEBUG
+            printf("Allocated extent block: %d\n", block);
+#endif
+            if (block < 0) {
+                return -1;
+            }
+            inodeptr->i_extent_block = block;
+        }
+        Extent spill[EXTENTS_BLOCK];
+        memset(spill, 0, sizeof(spill));
+        memcpy(spill, extents + EXTENTS_INODE, (count - EXTENTS_INODE) * sizeof(Extent));
+        if (write_data(vol, inodeptr->i_extent_block, (char*)spill) < 0) {
+            return -1;
+        }
+    } else if (old_count > EXTENTS_INODE) {
+#ifdef _DEBUG
+        printf("Free extent block: %d\n", inodeptr->i_extent_block);
+#endif
+        free_block(vol, inodeptr->i_extent_block);
+        inodeptr->i_extent_block = 0;
+    }
+    for (int i = 0; i < EXTENTS_INODE; i++) {
+        if (i < count) {
+            inodeptr->i_extent[i] = extents[i];
+        } else {
+            inodeptr->i_extent[i].e_start = 0;
+            inodeptr->i_extent[i].e_len = 0;
+        }
+    }
+    return 0;
+}
+
+u_int32_t _count_file_blocks(Inode* inodeptr, u_int32_t block_cnt);
+int _link_file_blocks(Volume* vol, Inode* inodeptr, u_int32_t block_cnt, u_int32_t* pool, u_int32_t* indirect, u_int32_t* dindirect);
+
+// Map a file of extents by pointers instead, growing it to block_cnt with the new data blocks of pool
+int _extents_to_pointers(Volume* vol, Inode* inodeptr, u_int32_t block_cnt, u_int32_t* pool) {
+    u_int32_t old_blocks = inodeptr->i_blocks;
+    Extent extents[EXTENTS_MAX];
+    int count = _read_extents(vol, inodeptr, old_blocks, extents);
+    if (count < 0) {
+        return -1;
+    }
+
+    // Interleave the data blocks with new pointer blocks, in the order _link_file_blocks takes them
+    Inode empty = {0};
+    u_int32_t total = _count_file_blocks(&empty, block_cnt);
+    u_int32_t ptr_cnt = total - block_cnt;
+    u_int32_t* order = (u_int32_t*)malloc(sizeof(u_int32_t) * total);
+    u_int32_t* ptrs = (u_int32_t*)malloc(sizeof(u_int32_t) * ptr_cnt);
+    if (order == NULL || ptrs == NULL || allocate_extent(vol, ptr_cnt, -1, ptrs) < 0) {
+        print_err("_extents_to_pointers: Failed to allocate pointer blocks");
+        free(order);
+        free(ptrs);
         return -1;
     }
-    memcpy(buffer + inode_off * sizeof(Inode), inode, sizeof(Inode));
-    if (write_block(vol, inode_blk, buffer) < 0) {
+    u_int32_t used = 0, next_ptr = 0;
+    int e = 0;
+    u_int32_t off = 0;
+    for (u_int32_t i = 0; i < block_cnt; i++) {
+        if (i < old_blocks) {
+            order[used++] = extents[e].e_start + off;
+            if (++off == extents[e].e_len) {
+                e++;
+                off = 0;
+            }
+        } else {
+            order[used++] = pool[i - old_blocks];
+        }
+        if (i == INODE_DIRECT || i == INODE_INDIRECT) {
+            order[used++] = ptrs[next_ptr++];
+        }
+        if (i >= INODE_INDIRECT && (i - INODE_INDIRECT) % BLOCK_ENTRIES == 0) {
+            order[used++] = ptrs[next_ptr++];
+        }
+    }
+
+    // Linked into a copy, the file keeps its extents until the pointers are written
+    Inode scratch = *inodeptr;
+    memset(scratch.i_data, 0, INLINE_SIZE);
+    scratch.i_flags &= ~INODE_EXTENTS;
+    scratch.i_blocks = 0;
+    u_int32_t indirect[BLOCK_ENTRIES];
+    u_int32_t dindirect[BLOCK_ENTRIES];
+    int res = _link_file_blocks(vol, &scratch, block_cnt, order, indirect, dindirect);
+    free(order);
+    if (res < 0) {
+        print_err("_extents_to_pointers: Failed to link the blocks");
+        for (u_int32_t i = 0; i < ptr_cnt; i++) {
+            free_block(vol, ptrs[i]);
+        }
+        free(ptrs);
         return -1;
     }
+    free(ptrs);
+    if (count > EXTENTS_INODE) {
+        free_block(vol, inodeptr->i_extent_block);
+    }
+    scratch.i_blocks = old_blocks;
+    *inodeptr = scratch;
+#ifdef _DEBUG
+    printf("Converted inode %u from extents to pointers\n", inodeptr->i_idx);
+#endif
     return 0;
 }
 
-int _allocate_file_blocks(Volume* vol, Inode* inodeptr, u_int32_t block_cnt, u_int32_t* indirect, u_int32_t* dindirect) {
+// Append the blocks to the extents of a file, merging the contiguous ones
+int _allocate_extent_blocks(Volume* vol, Inode* inodeptr, u_int32_t block_cnt) {
+    Extent extents[EXTENTS_MAX];
+    int old_count = _read_extents(vol, inodeptr, inodeptr->i_blocks, extents);
+    if (old_count < 0) {
+        return -1;
+    }
+    u_int32_t n = block_cnt - inodeptr->i_blocks;
+    u_int32_t* pool = (u_int32_t*)malloc(sizeof(u_int32_t) * n);
+    int goal = old_count > 0 ? (int)(extents[old_count - 1].e_start + extents[old_count - 1].e_len) : -1;
+    if (pool == NULL || allocate_extent(vol, n, goal, pool) < 0) {
+        free(pool);
+        return -1;
+    }
+    int count = old_count;
+    int res = 0;
+    for (u_int32_t i = 0; i < n; i++) {
+        Extent* last = count > 0 ? &extents[count - 1] : NULL;
+        if (last != NULL && last->e_start + last->e_len == pool[i]) {
+            last->e_len++;
+        } else if (count < (int)EXTENTS_MAX) {
+            extents[count].e_start = pool[i];
+            extents[count].e_len = 1;
+            count++;
+        } else {
+            // Too fragmented for the extents, the file is mapped by pointers from now on
+            res = _extents_to_pointers(vol, inodeptr, block_cnt, pool);
+            break;
+        }
+    }
+    if (res == 0 && (inodeptr->i_flags & INODE_EXTENTS) != 0) {
+        res = _write_extents(vol, inodeptr, extents, count, old_count);
+    }
+    if (res < 0) {
+        for (u_int32_t i = 0; i < n; i++) {
+            free_block(vol, pool[i]);
+        }
+    }
+    free(pool);
+    return res;
+}
+
+// Trim the extents of a file from the end down to block_cnt blocks
+int _free_extent_blocks(Volume* vol, Inode* inodeptr, u_int32_t block_cnt) {
+    Extent extents[EXTENTS_MAX];
+    int old_count = _read_extents(vol, inodeptr, inodeptr->i_blocks, extents);
+    if (old_count < 0) {
+        return -1;
+    }
+    int count = old_count;
+    u_int32_t covered = 0;
+    for (int i = 0; i < count; i++) {
+        covered += extents[i].e_len;
+    }
+    while (count > 0 && covered > block_cnt) {
+        Extent* last = &extents[count - 1];
+        u_int32_t drop = last->e_len < covered - block_cnt ? last->e_len : covered - block_cnt;
+#ifdef _DEBUG
+        printf("Free extent: %u +%u\n", last->e_start + last->e_len - drop, drop);
+#endif
+        for (u_int32_t i = 0; i < drop; i++) {
+            free_block(vol, last->e_start + last->e_len - 1 - i);
+        }
+        last->e_len -= drop;
+        covered -= drop;
+        if (last->e_len == 0) {
+            count--;
+        }
+    }
+    return _write_extents(vol, inodeptr, extents, count, old_count);
+}
+
+// Map the file blocks through the extents
+int _map_extent_blocks(Volume* vol, Inode* inodeptr, u_int32_t start, u_int32_t cnt, u_int32_t* blocks) {
+    Extent extents[EXTENTS_MAX];
+    u_int32_t end = start + cnt;
+    int count = _read_extents(vol, inodeptr, end, extents);
+    if (count < 0) {
+        return -1;
+    }
+    u_int32_t pos = 0;
+    for (int i = 0; i < count && pos < end; i++) {
+        for (u_int32_t j = 0; j < extents[i].e_len && pos < end; j++, pos++) {
+            if (pos >= start) {
+                blocks[pos - start] = extents[i].e_start + j;
+            }
+        }
+    }
+    return 0;
+}
+
+// Number of data and pointer blocks needed to grow a file to block_cnt
+u_int32_t _count_file_blocks(Inode* inodeptr, u_int32_t block_cnt) {
+    u_int32_t total = 0;
+    for (u_int32_t i = inodeptr->i_blocks; i < block_cnt; i++) {
+        total++;
+        if (i == INODE_DIRECT || i == INODE_INDIRECT) {
+            total++;
+        }
+        if (i >= INODE_INDIRECT && (i - INODE_INDIRECT) % BLOCK_ENTRIES == 0) {
+            total++;
+        }
+    }
+    return total;
+}
+
+// Link the blocks of pool to the pointers of a file, from i_blocks to block_cnt.
+// pool holds the data and pointer blocks in the order they are needed.
+int _link_file_blocks(Volume* vol, Inode* inodeptr, u_int32_t block_cnt, u_int32_t* pool, u_int32_t* indirect, u_int32_t* dindirect) {
     bool read_indirect = true;
     bool read_dindirect = true;
-    for (u_int32_t i = inodeptr->i_blocks; i < block_cnt; i++) {
-        int data_block = allocate_block(vol);
+    u_int32_t used = 0;
+    int res = 0;
+    for (u_int32_t i = inodeptr->i_blocks; i < block_cnt && res == 0; i++) {
+        int data_block = pool[used++];
 #ifdef _DEBUG
         printf("Allocated data block: %d\n", data_block);
 #endif
-        if (data_block < 0) {
-            return -1;
-        }
         if (i < INODE_DIRECT) {
             // Direct blocks
             inodeptr->i_direct[i] = data_block;
@@ -83,19 +357,16 @@ int _allocate_file_blocks(Volume* vol, Inode* inodeptr, u_int32_t block_cnt, u_i
             // - Step1: Allocate or read indirect block
             if (i == INODE_DIRECT) {
                 // Allocate indirect block
-                int res = allocate_block(vol);
+                inodeptr->i_indirect = pool[used++];
 #ifdef _DEBUG
-                printf("Allocated indirect block: %d\n", res);
+                printf("Allocated indirect block: %d\n", inodeptr->i_indirect);
 #endif
-                if (res < 0) {
-                    return -1;
-                }
-                inodeptr->i_indirect = res;
                 memset(indirect, 0, SIZE_BLOCK);
                 read_indirect = false;
             } else if (read_indirect) {
                 if (read_data(vol, inodeptr->i_indirect, (char*)indirect) < 0) {
-                    return -1;
+                    res = -1;
+                    break;
                 }
                 read_indirect = false;
             }
@@ -105,9 +376,7 @@ int _allocate_file_blocks(Volume* vol, Inode* inodeptr, u_int32_t block_cnt, u_i
 
             // - Step3: Write indirect block to disk
             if (i == block_cnt - 1 || i == INODE_INDIRECT - 1) {
-                if (write_data(vol, inodeptr->i_indirect, (char*)indirect) < 0) {
-                    return -1;
-                }
+                res = write_data(vol, inodeptr->i_indirect, (char*)indirect);
                 read_indirect = true;
             }
         } else {
@@ -116,19 +385,16 @@ int _allocate_file_blocks(Volume* vol, Inode* inodeptr, u_int32_t block_cnt, u_i
             // - Step1: Allocate or read double indirect block
             if (i == INODE_INDIRECT) {
                 // Allocate double indirect block
-                int res = allocate_block(vol);
+                inodeptr->i_dindirect = pool[used++];
 #ifdef _DEBUG
-                printf("Allocated double indirect block: %d\n", res);
+                printf("Allocated double indirect block: %d\n", inodeptr->i_dindirect);
 #endif
-                if (res < 0) {
-                    return -1;
-                }
-                inodeptr->i_dindirect = res;
                 memset(dindirect, 0, SIZE_BLOCK);
                 read_dindirect = false;
             } else if (read_dindirect) {
                 if (read_data(vol, inodeptr->i_dindirect, (char*)dindirect) < 0) {
-                    return -1;
+                    res = -1;
+                    break;
                 }
                 read_dindirect = false;
             }
@@ -136,19 +402,16 @@ int _allocate_file_blocks(Volume* vol, Inode* inodeptr, u_int32_t block_cnt, u_i
             // - Step2: Allocate or read indirect block
             if ((i - INODE_INDIRECT) % BLOCK_ENTRIES == 0) {
                 // Allocate indirect block
-                int res = allocate_block(vol);
+                dindirect[(i - INODE_INDIRECT) / BLOCK_ENTRIES] = pool[used++];
 #ifdef _DEBUG
-                printf("Allocated indirect block: %d\n", res);
+                printf("Allocated indirect block: %d\n", dindirect[(i - INODE_INDIRECT) / BLOCK_ENTRIES]);
 #endif
-                if (res < 0) {
-                    return -1;
-                }
-                dindirect[(i - INODE_INDIRECT) / BLOCK_ENTRIES] = res;
                 memset(indirect, 0, SIZE_BLOCK);
                 read_indirect = false;
             } else if (read_indirect) {
                 if (read_data(vol, dindirect[(i - INODE_INDIRECT) / BLOCK_ENTRIES], (char*)indirect) < 0) {
-                    return -1;
+                    res = -1;
+                    break;
                 }
                 read_indirect = false;
             }
@@ -158,27 +421,51 @@ int _allocate_file_blocks(Volume* vol, Inode* inodeptr, u_int32_t block_cnt, u_i
 
             // - Step4: Write indirect block to disk
             if (i == block_cnt - 1 || (i - INODE_INDIRECT) % BLOCK_ENTRIES == BLOCK_ENTRIES - 1 || i == INODE_DINDIRECT - 1) {
-                if (write_data(vol, dindirect[(i - INODE_INDIRECT) / BLOCK_ENTRIES], (char*)indirect) < 0) {
-                    return -1;
-                }
+                res = write_data(vol, dindirect[(i - INODE_INDIRECT) / BLOCK_ENTRIES], (char*)indirect);
                 read_indirect = true;
             }
 
             // - Step5: Write double indirect block to disk
-            if (i == block_cnt - 1 || i == INODE_DINDIRECT - 1) {
-                if (write_data(vol, inodeptr->i_dindirect, (char*)dindirect) < 0) {
-                    return -1;
-                }
+            if (res == 0 && (i == block_cnt - 1 || i == INODE_DINDIRECT - 1)) {
+                res = write_data(vol, inodeptr->i_dindirect, (char*)dindirect);
                 read_dindirect = true;
             }
         }
     }
-    return 0;
+    return res;
+}
+
+int _allocate_file_blocks(Volume* vol, Inode* inodeptr, u_int32_t block_cnt, u_int32_t* indirect, u_int32_t* dindirect) {
+    if (block_cnt <= inodeptr->i_blocks) {
+        return 0;
+    }
+    if (inodeptr->i_flags & INODE_EXTENTS) {
+        return _allocate_extent_blocks(vol, inodeptr, block_cnt);
+    }
+
+    // Allocate all the data and pointer blocks in contiguous runs, following the last block of the file
+    int goal = -1;
+    u_int32_t last;
+    if (inodeptr->i_blocks > 0 && _map_file_blocks(vol, inodeptr, inodeptr->i_blocks - 1, 1, &last) == 0) {
+        goal = last + 1;
+    }
+    u_int32_t total = _count_file_blocks(inodeptr, block_cnt);
+    u_int32_t* pool = (u_int32_t*)malloc(sizeof(u_int32_t) * total);
+    if (pool == NULL || allocate_extent(vol, total, goal, pool) < 0) {
+        free(pool);
+        return -1;
+    }
+    int res = _link_file_blocks(vol, inodeptr, block_cnt, pool, indirect, dindirect);
+    free(pool);
+    return res;
 }
 
 int _free_file_blocks(Volume* vol, Inode* inodeptr, u_int32_t block_cnt, u_int32_t* indirect, u_int32_t* dindirect) {
     bool read_indirect = true;
     bool read_dindirect = true;
+    if (inodeptr->i_flags & INODE_EXTENTS) {
+        return _free_extent_blocks(vol, inodeptr, block_cnt);
+    }
     for (int i = inodeptr->i_blocks - 1; i >= (int32_t)block_cnt; i--) {
         if (i >= INODE_INDIRECT) {
             // Double indirect block
@@ -295,6 +582,56 @@ int _free_file_blocks(Volume* vol, Inode* inodeptr, u_int32_t block_cnt, u_int32
     return 0;
 }
 
+int _map_file_blocks(Volume* vol, Inode* inodeptr, u_int32_t start, u_int32_t cnt, u_int32_t* blocks) {
+    u_int32_t end = start + cnt;
+    if (end > INODE_DINDIRECT) {
+        return -1;
+    }
+    if (inodeptr->i_flags & INODE_EXTENTS) {
+        return _map_extent_blocks(vol, inodeptr, start, cnt, blocks);
+    }
+    u_int32_t i = start;
+
+    // Direct blocks
+    for (; i < end && i < INODE_DIRECT; i++) {
+        blocks[i - start] = inodeptr->i_direct[i];
+    }
+
+    // Single indirect block
+    if (i < end && i < INODE_INDIRECT) {
+        u_int32_t indirect[BLOCK_ENTRIES];
+        if (read_data(vol, inodeptr->i_indirect, (char*)indirect) < 0) {
+            return -1;
+        }
+        for (; i < end && i < INODE_INDIRECT; i++) {
+            blocks[i - start] = indirect[i - INODE_DIRECT];
+        }
+    }
+
+    // Double indirect block, all the indirect blocks are read in one batch
+    if (i < end) {
+        u_int32_t dindirect[BLOCK_ENTRIES];
+        if (read_data(vol, inodeptr->i_dindirect, (char*)dindirect) < 0) {
+            return -1;
+        }
+        u_int32_t first = (i - INODE_INDIRECT) / BLOCK_ENTRIES;
+        u_int32_t last = (end - 1 - INODE_INDIRECT) / BLOCK_ENTRIES;
+        u_int32_t* indirect = (u_int32_t*)malloc((last - first + 1) * SIZE_BLOCK);
+        if (indirect == NULL) {
+            return -1;
+        }
+        if (read_data_vec(vol, last - first + 1, dindirect + first, (char*)indirect) < 0) {
+            free(indirect);
+            return -1;
+        }
+        for (; i < end; i++) {
+            blocks[i - start] = indirect[i - INODE_INDIRECT - first * BLOCK_ENTRIES];
+        }
+        free(indirect);
+    }
+    return 0;
+}
+
 char* _print_indirect(u_int32_t* indirect, int size, char* ptr, int depth) {
     for (int i = 0; i < depth; i++) {
         ptr += sprintf(ptr, "        ");
@@ -333,42 +670,62 @@ void print_inode(Volume* vol, Inode* inode, char** data, int* len) {
     cctime[strlen(cctime) - 1] = '\0';
     ptr += sprintf(ptr, "Create: %s\n\n", cctime);
 
-    // Direct blocks
-    ptr += sprintf(ptr, "Direct blocks:\t");
-    for (int i = 0; i < INODE_DIRECT && i < inode->i_blocks; i++) {
-        ptr += sprintf(ptr, "%8u", inode->i_direct[i]);
-    }
-    ptr += sprintf(ptr, "\n");
-
-    // Indirect blocks
-    if (inode->i_blocks > INODE_DIRECT) {
-        ptr += sprintf(ptr, "Indirect blocks:\t%d\n", inode->i_indirect);
-        u_int32_t indirect[BLOCK_ENTRIES];
-        if (read_data(vol, inode->i_indirect, (char*)indirect) < 0) {
+    if (inode->i_flags & INODE_INLINE) {
+        // Inline data
+        ptr += sprintf(ptr, "Inline data:\t%u bytes\n", inode->i_size);
+    } else if (inode->i_flags & INODE_EXTENTS) {
+        // Extents
+        Extent extents[EXTENTS_MAX];
+        int count = _read_extents(vol, inode, inode->i_blocks, extents);
+        if (count < 0) {
             free(buffer);
             return;
         }
-        ptr = _print_indirect(indirect, inode->i_blocks - INODE_DIRECT, ptr, 1);
-    }
+        ptr += sprintf(ptr, "Extents:\t%d\n", count);
+        if (count > EXTENTS_INODE) {
+            ptr += sprintf(ptr, "Extent block:\t%u\n", inode->i_extent_block);
+        }
+        for (int i = 0; i < count; i++) {
+            ptr += sprintf(ptr, "%8u +%u\n", extents[i].e_start, extents[i].e_len);
+        }
+    } else {
+        // Direct blocks
+        ptr += sprintf(ptr, "Direct blocks:\t");
+        for (int i = 0; i < INODE_DIRECT && i < inode->i_blocks; i++) {
+            ptr += sprintf(ptr, "%8u", inode->i_direct[i]);
+        }
+        ptr += sprintf(ptr, "\n");
 
-    // Double indirect blocks
-    if (inode->i_blocks > INODE_INDIRECT) {
-        ptr += sprintf(ptr, "Double indirect:\t%d\n", inode->i_dindirect);
-        u_int32_t dindirect[BLOCK_ENTRIES];
-        if (read_data(vol, inode->i_dindirect, (char*)dindirect) < 0) {
-            free(buffer);
-            return;
+        // Indirect blocks
+        if (inode->i_blocks > INODE_DIRECT) {
+            ptr += sprintf(ptr, "Indirect blocks:\t%d\n", inode->i_indirect);
+            u_int32_t indirect[BLOCK_ENTRIES];
+            if (read_data(vol, inode->i_indirect, (char*)indirect) < 0) {
+                free(buffer);
+                return;
+            }
+            ptr = _print_indirect(indirect, inode->i_blocks - INODE_DIRECT, ptr, 1);
         }
-        int indirect_blocks = (inode->i_blocks - INODE_INDIRECT) / BLOCK_ENTRIES + ((inode->i_blocks - INODE_INDIRECT) % BLOCK_ENTRIES != 0);
-        for (int i = 0; i < BLOCK_ENTRIES && i < indirect_blocks; i++) {
-            if (dindirect[i] != 0) {
-                ptr += sprintf(ptr, "        Indirect blocks:\t%d\n", dindirect[i]);
-                u_int32_t indirect[BLOCK_ENTRIES];
-                if (read_data(vol, dindirect[i], (char*)indirect) < 0) {
-                    free(buffer);
-                    return;
+
+        // Double indirect blocks
+        if (inode->i_blocks > INODE_INDIRECT) {
+            ptr += sprintf(ptr, "Double indirect:\t%d\n", inode->i_dindirect);
+            u_int32_t dindirect[BLOCK_ENTRIES];
+            if (read_data(vol, inode->i_dindirect, (char*)dindirect) < 0) {
+                free(buffer);
+                return;
+            }
+            int indirect_blocks = (inode->i_blocks - INODE_INDIRECT) / BLOCK_ENTRIES + ((inode->i_blocks - INODE_INDIRECT) % BLOCK_ENTRIES != 0);
+            for (int i = 0; i < BLOCK_ENTRIES && i < indirect_blocks; i++) {
+                if (dindirect[i] != 0) {
+                    ptr += sprintf(ptr, "        Indirect blocks:\t%d\n", dindirect[i]);
+                    u_int32_t indirect[BLOCK_ENTRIES];
+                    if (read_data(vol, dindirect[i], (char*)indirect) < 0) {
+                        free(buffer);
+                        return;
+                    }
+                    ptr = _print_indirect(indirect, inode->i_blocks - INODE_INDIRECT - i * BLOCK_ENTRIES, ptr, 2);
                 }
-                ptr = _print_indirect(indirect, inode->i_blocks - INODE_INDIRECT - i * BLOCK_ENTRIES, ptr, 2);
             }
         }
     }
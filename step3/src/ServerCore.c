@@ -42,8 +42,11 @@ int accept_new(int master_socket, struct sockaddr_in *address, int *addrlen) {
     // then its an incoming connection
     int new_socket;
     if ((new_socket = accept(master_socket, (struct sockaddr *)address, (socklen_t *)addrlen)) < 0) {
-        perror("accept");
-        exit(EXIT_FAILURE);
+        // Nothing left to accept on a non-blocking listener
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("accept");
+        }
+        return -1;
     }
 
     // inform user of socket number - used in send and receive commands
@@ -60,42 +63,3 @@ int accept_new(int master_socket, struct sockaddr_in *address, int *addrlen) {
     printf("Connect successfully\n");
     return new_socket;
 }
-
-// Disconnect the client socket, close the pipe and mark them as 0
-void disconnect(int *client_socket, pid_t *pid_list, int status) {
-    if (status == 0) {
-        // Quit by exit command
-        if (shutdown(*client_socket, SHUT_RDWR) < 0) {
-            perror("shutdown");
-        }
-    }
-    printf("[Host disconnected]\n");
-    // Close the socket and mark as 0 in list for reuse
-    *client_socket = 0;
-    *pid_list = 0;
-}
-
-// Check if the server should exit
-void check_exit(fd_set *controlfds, int *client_socket, pid_t *pid_list) {
-    FD_ZERO(controlfds);
-    FD_SET(STDIN_FILENO, controlfds);
-    struct timeval timeout = {0, 125000};
-    if (select(STDIN_FILENO + 1, controlfds, NULL, NULL, &timeout) > 0) {
-        // Read from stdin
-        char buffer[MAX_BUF_SIZE];
-        if (read(STDIN_FILENO, buffer, MAX_BUF_SIZE) > 0 && strncmp(buffer, "exit", 4) != 0) {
-            return;
-        }
-        fprintf(stdout, "Exiting...\n");
-        for (int i = 0; i < MAX_CLIENTS; i++) {
-            // Close all clients
-            if (pid_list[i] > 0) {
-                pid_t pid = pid_list[i];
-                printf("Killing child process %d\n", pid);
-                disconnect(client_socket + i, pid_list + i, 0);
-                waitpid(pid, NULL, 0);
-            }
-        }
-        exit(0);
-    }
-}
\ No newline at end of file
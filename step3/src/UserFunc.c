@@ -7,6 +7,8 @@ int _get_root_dir(User* user) {
         print_err("_get_root_dir:\tFailed to read inode");
         user->cur_dir.dir_entries = NULL;
         user->cur_dir.orig_data = NULL;
+        user->cur_dir.holes = NULL;
+        user->cur_dir.index = NULL;
         return DISK_FAILURE;
     }
     FileType root;
@@ -17,6 +19,8 @@ int _get_root_dir(User* user) {
         print_err("_get_root_dir:\tFailed to read file");
         user->cur_dir.dir_entries = NULL;
         user->cur_dir.orig_data = NULL;
+        user->cur_dir.holes = NULL;
+        user->cur_dir.index = NULL;
         return DISK_FAILURE;
     }
     DirType* dir = &user->cur_dir;
@@ -25,14 +29,40 @@ int _get_root_dir(User* user) {
         print_err("_get_root_dir:\tFailed to parse dir");
         user->cur_dir.dir_entries = NULL;
         user->cur_dir.orig_data = NULL;
+        user->cur_dir.holes = NULL;
+        user->cur_dir.index = NULL;
         return DISK_FAILURE;
     }
     user->cache_time = time(NULL);
     return 0;
 }
 
+// Read the directory of dir->inodeptr again
+int _reload_dir(User* user, DirType* dir) {
+    FileType file;
+    file.inodeptr = dir->inodeptr;
+    file.start_block = 0;
+    int res = read_file(user->vol, &file);
+    if (res < 0) {
+        print_err("_reload_dir:\tFailed to read file");
+        return DISK_FAILURE;
+    }
+    free_dir(dir);
+    res = parse_dir(&file, dir);
+    if (res < 0) {
+        print_err("_reload_dir:\tFailed to parse dir");
+        return DISK_FAILURE;
+    }
+    return 0;
+}
+
 int _change_dir_relative(User* user, char* targetpath) {
     DirType* dir = &user->cur_dir;
+    Inode* inode = dir->inodeptr;
+    // Only the last directory is read if the names on the way are cached.
+    // The names of the first directory are not cached, it may be older than the disk.
+    bool parsed = true;
+    bool fresh = false;
     char* ptr = targetpath;
     while (ptr != NULL && *ptr != '\0') {
         if (*ptr == '/') {
@@ -44,21 +74,37 @@ int _change_dir_relative(User* user, char* targetpath) {
 #ifdef _DEBUG
         printf("_change_dir_relative:\tTarget: %.*s\n", len, ptr);
 #endif
-        // Search for target
-        DirEntry* entry = _search_dir(dir, ptr, len);
-        if (entry == NULL) {
+        // Search for target in the dentry cache, then in the directory
+        u_int16_t mode = INODE_UNUSED;
+        int inode_idx = lookup_dentry(user->vol, inode->i_idx, ptr, len, &mode);
+        if (inode_idx == DENTRY_MISS) {
+            if (!parsed) {
+                int res = _reload_dir(user, dir);
+                if (res < 0) {
+                    return res;
+                }
+                parsed = true;
+                fresh = true;
+            }
+            DirEntry* entry = _search_dir(dir, ptr, len);
+            inode_idx = entry == NULL ? DENTRY_NEGATIVE : entry->inode_idx;
+            mode = entry == NULL ? INODE_UNUSED : entry->inode_mode;
+            if (fresh) {
+                insert_dentry(user->vol, inode->i_idx, ptr, len, inode_idx, mode);
+            }
+        }
+        if (inode_idx == DENTRY_NEGATIVE) {
             return TARGET_NOT_FOUND;
         }
 #ifdef _DEBUG
-        printf("_change_dir_relative:\tEntry: %u, %u\n", entry->inode_mode, entry->inode_idx);
+        printf("_change_dir_relative:\tEntry: %u, %d\n", mode, inode_idx);
 #endif
         // Check if target is a directory
-        if (entry->inode_mode != INODE_DIR) {
+        if (mode != INODE_DIR) {
             return INVALID_PATH;
         }
-        // Read target directory
-        Inode* inode = dir->inodeptr;
-        inode->i_idx = entry->inode_idx;
+        // Read target inode
+        inode->i_idx = inode_idx;
         int res = read_inode(user->vol, inode);
         if (res < 0) {
             print_err("_change_dir_relative:\tFailed to read inode");
@@ -73,22 +119,12 @@ int _change_dir_relative(User* user, char* targetpath) {
         if (user->id != 0 && !user_prem && !other_prem) {
             return PERMISSION_DENIED;
         }
-        FileType file;
-        file.inodeptr = inode;
-        file.start_block = 0;
-        res = read_file(user->vol, &file);
-        if (res < 0) {
-            print_err("_change_dir_relative:\tFailed to read file");
-            return DISK_FAILURE;
-        }
-        free_dir(dir);
-        res = parse_dir(&file, dir);
-        if (res < 0) {
-            print_err("_change_dir_relative:\tFailed to parse dir");
-            return DISK_FAILURE;
-        }
+        parsed = false;
         ptr = (next == NULL ? next : next + 1);
     }
+    if (!parsed) {
+        return _reload_dir(user, dir);
+    }
     return 0;
 }
 
@@ -100,13 +136,17 @@ int _copy_user(User* dest, User* src) {
     dest->cur_dir = src->cur_dir;
     dest->cur_dir.inodeptr = vinode;
     DirType* dir = &dest->cur_dir;
+    dir->index = NULL;
     *dir->inodeptr = *src->cur_dir.inodeptr;
+    dir->dir_entries = NULL;
+    dir->holes = (u_int16_t*)malloc(sizeof(u_int16_t) * (dir->n_holes + 1));
     dir->orig_data = (char*)malloc(dir->tot_size);
-    if (dir->orig_data == NULL) {
+    if (dir->orig_data == NULL || dir->holes == NULL) {
         print_err("_copy_user:\tFailed to malloc dir data");
-        dir->dir_entries = NULL;
+        free_dir(dir);
         return -1;
     }
+    memcpy(dir->holes, src->cur_dir.holes, sizeof(u_int16_t) * dir->n_holes);
     memcpy(dir->orig_data, src->cur_dir.orig_data, dir->tot_size);
     dir->dir_entries = (DirEntry*)malloc(sizeof(DirEntry) * dir->dir_size);
     if (dir->dir_entries == NULL) {
@@ -116,7 +156,7 @@ int _copy_user(User* dest, User* src) {
     }
     if (src->cur_dir.orig_data == NULL) {
         memcpy(dir->dir_entries, src->cur_dir.dir_entries, sizeof(DirEntry) * dir->dir_size);
-        return 0;
+        return index_dir(dir);
     }
     for (int i = 0; i < dir->dir_size; i++) {
         DirEntry* src_entry = &src->cur_dir.dir_entries[i];
@@ -126,7 +166,7 @@ int _copy_user(User* dest, User* src) {
         dest_entry->filename_len = src_entry->filename_len;
         dest_entry->filename = dir->orig_data + (src_entry->filename - src->cur_dir.orig_data);
     }
-    return 0;
+    return index_dir(dir);
 }
 
 int _user_pathfinder(User* src, User* vuser, char* path) {
@@ -150,6 +190,11 @@ int _user_pathfinder(User* src, User* vuser, char* path) {
 }
 
 int _user_target_locator(User* src, char* targetpath, bool is_dir, User* vuser, char** target) {
+    // Nothing to be freed by the caller until a directory is read
+    vuser->cur_dir.dir_entries = NULL;
+    vuser->cur_dir.orig_data = NULL;
+    vuser->cur_dir.holes = NULL;
+    vuser->cur_dir.index = NULL;
     // If is a valid path
     size_t len = strlen(targetpath);
     if (len == 0) {
@@ -315,6 +360,10 @@ int _get_path(User* user) {
 }
 
 DirEntry* _search_dir(DirType* dir, char* targetname, int len) {
+    if (dir->index != NULL) {
+        int i = index_dir_search(dir, targetname, len);
+        return i < 0 ? NULL : &dir->dir_entries[i];
+    }
     for (int i = 0; i < dir->dir_size; i++) {
         if (dir->dir_entries[i].filename_len == len && strncmp(dir->dir_entries[i].filename, targetname, len) == 0) {
             return &dir->dir_entries[i];
@@ -356,44 +405,16 @@ int _make_target_entry(User* user, char* targetname, u_int16_t mode) {
         print_err("_make_target_entry:\tFailed to allocate inode");
         return DISK_FAILURE;
     }
-    u_int16_t new_tot_size = dir->tot_size + sizeof(u_int16_t) * 3 + len;
-    char* new_data = (char*)realloc(dir->orig_data, new_tot_size);
-    if (new_data == NULL) {
-        print_err("_make_target_entry:\tFailed to malloc new data");
-        return DISK_FAILURE;
-    }
-    *((u_int16_t*)new_data) = *((u_int16_t*)new_data) + 1;
-    char* ptr = new_data + dir->tot_size;
-    // Add entry
-    ((u_int16_t*)ptr)[0] = mode;
-    ((u_int16_t*)ptr)[1] = inode_idx;
-    ((u_int16_t*)ptr)[2] = len;
-    ptr += sizeof(u_int16_t) * 3;
-    memcpy(ptr, targetname, len);
-    // Update dir
-    dir->dir_size++;
-    dir->tot_size = new_tot_size;
-    dir->orig_data = new_data;
-    free(dir->dir_entries);
-    FileType file;
-    file.inodeptr = dir->inodeptr;
-    file.data = new_data;
-    file.size = new_tot_size;
-    file.start_block = 0;
-    int res = parse_dir(&file, dir);
-    if (res < 0) {
-        print_err("_make_target_entry:\tFailed to parse dir");
-        return DISK_FAILURE;
-    }
-    res = write_file(user->vol, &file);
+    int res = dir_add_entry(user->vol, dir, mode, inode_idx, targetname, len);
     if (res < 0) {
-        print_err("_make_target_entry:\tFailed to write file");
+        print_err("_make_target_entry:\tFailed to add entry");
+        free_inode(user->vol, inode_idx);
         return DISK_FAILURE;
     }
     return inode_idx;
 }
 
-int _remove_target_entry(User* user, int entry_idx, size_t len) {
+int _remove_target_entry(User* user, int entry_idx) {
     // Remove entry
     DirType* dir = &user->cur_dir;
     bool user_prem = dir->inodeptr->i_uid == user->id && (dir->inodeptr->i_prem & USER_W) != 0;
@@ -402,27 +423,9 @@ int _remove_target_entry(User* user, int entry_idx, size_t len) {
         print_err("_remove_target_entry:\tPermission denied");
         return PERMISSION_DENIED;
     }
-    DirEntry* entry = &dir->dir_entries[entry_idx];
-    memmove(entry, entry + 1, sizeof(DirEntry) * (dir->dir_size - entry_idx - 1));
-    dir->dir_size--;
-    dir->tot_size -= sizeof(u_int16_t) * 3 + len;
-    dir->dir_entries = (DirEntry*)realloc(dir->dir_entries, sizeof(DirEntry) * dir->dir_size);
-    // Update file
-    FileType file;
-    file.inodeptr = dir->inodeptr;
-    file.start_block = 0;
-    int res = encode_dir(dir, &file);
-    if (res < 0) {
-        print_err("_remove_target_entry:\tFailed to encode dir");
-        return DISK_FAILURE;
-    }
-    if (dir->orig_data != NULL) {
-        free(dir->orig_data);
-    }
-    dir->orig_data = file.data;
-    res = write_file(user->vol, &file);
+    int res = dir_remove_entry(user->vol, dir, entry_idx);
     if (res < 0) {
-        print_err("_remove_target_entry:\tFailed to write file");
+        print_err("_remove_target_entry:\tFailed to remove entry");
         return DISK_FAILURE;
     }
     return 0;
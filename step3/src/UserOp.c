@@ -40,7 +40,20 @@ int u_init_user(User* user) {
 }
 
 int u_format_volume(User* user, AuthList* list) {
+    // Streams still reading the old files are waited for with the tree released
+    for (int i = 0; i < INODE_LOCKS; i++) {
+        if (try_lock_inode(user->vol, i) < 0) {
+            while (--i >= 0) {
+                unlock_inode(user->vol, i);
+            }
+            user->busy_inode = -1;
+            return INODE_BUSY;
+        }
+    }
     int res = format_disk(user->vol);
+    for (int i = INODE_LOCKS - 1; i >= 0; i--) {
+        unlock_inode(user->vol, i);
+    }
     if (res < 0) {
         print_err("format_volume:\tFailed to format disk");
         return -1;
@@ -54,6 +67,7 @@ int u_format_volume(User* user, AuthList* list) {
     }
     root_inode.i_idx = 0;
     root_inode.i_mode = INODE_DIR;
+    root_inode.i_flags = user->vol->extents ? INODE_EXTENTS : 0;
     root_inode.i_nlink = 1;
     root_inode.i_uid = 0;
     root_inode.i_prem = 075;
@@ -143,6 +157,7 @@ int u_make_file(User* user, char* filename) {
     Inode inode;
     inode.i_idx = res;
     inode.i_mode = INODE_FILE;
+    inode.i_flags = user->vol->extents ? INODE_EXTENTS : 0;
     inode.i_size = 0;
     inode.i_blocks = 0;
     inode.i_parent = vuser.cur_dir.inodeptr->i_idx;
@@ -192,6 +207,7 @@ int u_make_dir(User* user, char* dirname) {
     Inode inode;
     inode.i_idx = res;
     inode.i_mode = INODE_DIR;
+    inode.i_flags = user->vol->extents ? INODE_EXTENTS : 0;
     inode.i_size = 0;
     inode.i_blocks = 0;
     inode.i_parent = vuser.cur_dir.inodeptr->i_idx;
@@ -266,12 +282,20 @@ int u_remove_file(User* user, char* filename) {
         free_dir(&vuser.cur_dir);
         return INVALID_PATH;
     }
-    res = _remove_target_entry(&vuser, entry - vuser.cur_dir.dir_entries, len);
+    // Streams still reading the file are waited for with the tree released
+    if (try_lock_inode(user->vol, inode_idx) < 0) {
+        free_dir(&vuser.cur_dir);
+        user->busy_inode = inode_idx;
+        return INODE_BUSY;
+    }
+    res = _remove_target_entry(&vuser, entry - vuser.cur_dir.dir_entries);
     free_dir(&vuser.cur_dir);
     if (res < 0) {
+        unlock_inode(user->vol, inode_idx);
         return res;
     }
     res = _remove_inode_link(user->vol, inode_idx);
+    unlock_inode(user->vol, inode_idx);
     if (res < 0) {
         return res;
     }
@@ -334,7 +358,7 @@ int u_remove_dir(User* user, char* dirname) {
         free_dir(&vuser.cur_dir);
         return DIR_NOT_EMPTY;
     }
-    res = _remove_target_entry(&vuser, entry - vuser.cur_dir.dir_entries, len);
+    res = _remove_target_entry(&vuser, entry - vuser.cur_dir.dir_entries);
     free_dir(&vuser.cur_dir);
     if (res < 0) {
         return res;
@@ -489,11 +513,14 @@ int u_stat_file(User* user, char* filename, char** data, int* len) {
         return TARGET_NOT_FOUND;
     }
     Inode inode;
-    inode.i_idx = entry->inode_idx;
+    int inode_idx = entry->inode_idx;
+    inode.i_idx = inode_idx;
+    lock_inode(user->vol, inode_idx, false);
     res = read_inode(user->vol, &inode);
     if (res < 0) {
         print_err("u_stat_file:\tFailed to read inode");
         free_dir(&vuser.cur_dir);
+        unlock_inode(user->vol, inode_idx);
         return DISK_FAILURE;
     }
     // Check premission
@@ -501,6 +528,7 @@ int u_stat_file(User* user, char* filename, char** data, int* len) {
     bool other_prem = inode.i_uid != user->id && (inode.i_prem & OTHER_R) != 0;
     if (user->id != 0 && !user_prem && !other_prem) {
         free_dir(&vuser.cur_dir);
+        unlock_inode(user->vol, inode_idx);
         return PERMISSION_DENIED;
     }
     char* data_ptr;
@@ -510,6 +538,7 @@ int u_stat_file(User* user, char* filename, char** data, int* len) {
     if (data_ptr == NULL) {
         print_err("u_stat_file:\tFailed to realloc data");
         free_dir(&vuser.cur_dir);
+        unlock_inode(user->vol, inode_idx);
         return -1;
     }
     memmove(data_ptr + entry->filename_len + 9, data_ptr, data_len);
@@ -518,10 +547,11 @@ int u_stat_file(User* user, char* filename, char** data, int* len) {
     *data = data_ptr;
     *len = data_len + entry->filename_len + 9;
     free_dir(&vuser.cur_dir);
+    unlock_inode(user->vol, inode_idx);
     return 0;
 }
 
-int u_cat_file(User* user, char* filename, char** data, int* len) {
+int u_open_file(User* user, char* filename, Inode* inode) {
     if (filename == NULL) {
         return INVALID_PATH;
     }
@@ -531,46 +561,40 @@ int u_cat_file(User* user, char* filename, char** data, int* len) {
     char* target;
     int res = _user_target_locator(user, filename, true, &vuser, &target);
     if (res < 0) {
-        print_err("u_cat_file:\tFailed to locate target");
+        print_err("u_open_file:\tFailed to locate target");
         free_dir(&vuser.cur_dir);
         return res;
     }
     DirEntry* entry = _search_dir(&vuser.cur_dir, target, strlen(target));
     if (entry == NULL) {
-        print_err("u_cat_file:\tFile not found");
+        print_err("u_open_file:\tFile not found");
         free_dir(&vuser.cur_dir);
         return TARGET_NOT_FOUND;
     }
-    Inode inode;
-    inode.i_idx = entry->inode_idx;
-    res = read_inode(user->vol, &inode);
+    int inode_idx = entry->inode_idx;
+    inode->i_idx = inode_idx;
+    lock_inode(user->vol, inode_idx, false);
+    res = read_inode(user->vol, inode);
 #ifdef _DEBUG
-    print_inode(user->vol, &inode, NULL, NULL);
+    print_inode(user->vol, inode, NULL, NULL);
 #endif
     free_dir(&vuser.cur_dir);
     if (res < 0) {
-        print_err("u_cat_file:\tFailed to read inode");
+        print_err("u_open_file:\tFailed to read inode");
+        unlock_inode(user->vol, inode_idx);
         return DISK_FAILURE;
     }
-    bool user_prem = inode.i_uid == user->id && (inode.i_prem & USER_R) != 0;
-    bool other_prem = inode.i_uid != user->id && (inode.i_prem & OTHER_R) != 0;
+    bool user_prem = inode->i_uid == user->id && (inode->i_prem & USER_R) != 0;
+    bool other_prem = inode->i_uid != user->id && (inode->i_prem & OTHER_R) != 0;
     if (user->id != 0 && !user_prem && !other_prem) {
+        unlock_inode(user->vol, inode_idx);
         return PERMISSION_DENIED;
     }
-    if (inode.i_mode != INODE_FILE) {
-        print_err("u_cat_file:\tNot a file");
+    if (inode->i_mode != INODE_FILE) {
+        print_err("u_open_file:\tNot a file");
+        unlock_inode(user->vol, inode_idx);
         return INVALID_PATH;
     }
-    FileType file;
-    file.inodeptr = &inode;
-    file.start_block = 0;
-    res = read_file(user->vol, &file);
-    if (res < 0) {
-        print_err("u_cat_file:\tFailed to read file");
-        return DISK_FAILURE;
-    }
-    *data = file.data;
-    *len = file.size;
     return 0;
 }
 
@@ -595,22 +619,27 @@ int u_write_file(User* user, char* filename, int length, char* data) {
         return TARGET_NOT_FOUND;
     }
     Inode inode;
-    inode.i_idx = entry->inode_idx;
+    int inode_idx = entry->inode_idx;
+    inode.i_idx = inode_idx;
+    lock_inode(user->vol, inode_idx, true);
     res = read_inode(user->vol, &inode);
     free_dir(&vuser.cur_dir);
     if (res < 0) {
         print_err("u_write_file:\tFailed to read inode");
+        unlock_inode(user->vol, inode_idx);
         return DISK_FAILURE;
     }
     // Check premission
     bool user_prem = inode.i_uid == user->id && (inode.i_prem & USER_W) != 0;
     bool other_prem = inode.i_uid != user->id && (inode.i_prem & OTHER_W) != 0;
     if (user->id != 0 && !user_prem && !other_prem) {
+        unlock_inode(user->vol, inode_idx);
         return PERMISSION_DENIED;
     }
     // Check if it's a file
     if (inode.i_mode != INODE_FILE) {
         print_err("u_write_file:\tNot a file");
+        unlock_inode(user->vol, inode_idx);
         return INVALID_PATH;
     }
     // Construct file
@@ -622,8 +651,68 @@ int u_write_file(User* user, char* filename, int length, char* data) {
     res = write_file(user->vol, &file);
     if (res < 0) {
         print_err("u_write_file:\tFailed to write file");
+        unlock_inode(user->vol, inode_idx);
+        return DISK_FAILURE;
+    }
+    unlock_inode(user->vol, inode_idx);
+    return 0;
+}
+
+int u_append_file(User* user, char* filename, int length, char* data) {
+    if (filename == NULL) {
+        return INVALID_PATH;
+    }
+    if (length < 0) {
+        return INVALID_POS;
+    }
+    Inode vinode = *user->cur_dir.inodeptr;
+    User vuser;
+    vuser.cur_dir.inodeptr = &vinode;
+    char* target;
+    int res = _user_target_locator(user, filename, true, &vuser, &target);
+    if (res < 0) {
+        print_err("u_append_file:\tFailed to locate target");
+        free_dir(&vuser.cur_dir);
+        return res;
+    }
+    DirEntry* entry = _search_dir(&vuser.cur_dir, target, strlen(target));
+    if (entry == NULL) {
+        print_err("u_append_file:\tFile not found");
+        free_dir(&vuser.cur_dir);
+        return TARGET_NOT_FOUND;
+    }
+    Inode inode;
+    int inode_idx = entry->inode_idx;
+    inode.i_idx = inode_idx;
+    lock_inode(user->vol, inode_idx, true);
+    res = read_inode(user->vol, &inode);
+    free_dir(&vuser.cur_dir);
+    if (res < 0) {
+        print_err("u_append_file:\tFailed to read inode");
+        unlock_inode(user->vol, inode_idx);
         return DISK_FAILURE;
     }
+    // Check premission
+    bool user_prem = inode.i_uid == user->id && (inode.i_prem & USER_W) != 0;
+    bool other_prem = inode.i_uid != user->id && (inode.i_prem & OTHER_W) != 0;
+    if (user->id != 0 && !user_prem && !other_prem) {
+        unlock_inode(user->vol, inode_idx);
+        return PERMISSION_DENIED;
+    }
+    // Check if it's a file
+    if (inode.i_mode != INODE_FILE) {
+        print_err("u_append_file:\tNot a file");
+        unlock_inode(user->vol, inode_idx);
+        return INVALID_PATH;
+    }
+    // Only the last partial block is read, new blocks follow it
+    res = write_file_range(user->vol, &inode, inode.i_size, length, data);
+    if (res < 0) {
+        print_err("u_append_file:\tFailed to write file");
+        unlock_inode(user->vol, inode_idx);
+        return DISK_FAILURE;
+    }
+    unlock_inode(user->vol, inode_idx);
     return 0;
 }
 
@@ -651,59 +740,40 @@ int u_insert_file(User* user, char* filename, int pos, int length, char* data) {
         return TARGET_NOT_FOUND;
     }
     Inode inode;
-    inode.i_idx = entry->inode_idx;
+    int inode_idx = entry->inode_idx;
+    inode.i_idx = inode_idx;
+    lock_inode(user->vol, inode_idx, true);
     res = read_inode(user->vol, &inode);
     free_dir(&vuser.cur_dir);
     if (res < 0) {
         print_err("u_insert_file:\tFailed to read inode");
+        unlock_inode(user->vol, inode_idx);
         return DISK_FAILURE;
     }
     // Check premission
     bool user_prem = inode.i_uid == user->id && (inode.i_prem & USER_W) != 0;
     bool other_prem = inode.i_uid != user->id && (inode.i_prem & OTHER_W) != 0;
     if (user->id != 0 && !user_prem && !other_prem) {
+        unlock_inode(user->vol, inode_idx);
         return PERMISSION_DENIED;
     }
     // Check if it's a file
     if (inode.i_mode != INODE_FILE) {
         print_err("u_insert_file:\tNot a file");
+        unlock_inode(user->vol, inode_idx);
         return INVALID_PATH;
     }
-    // Calculate start block
+    // Check position
     if ((u_int32_t)pos > inode.i_size) {
         pos = inode.i_size;
     }
-    u_int32_t start_block = pos / SIZE_BLOCK;
-    FileType file;
-    file.inodeptr = &inode;
-    file.start_block = start_block;
-    res = read_file(user->vol, &file);
-    if (res < 0) {
-        print_err("u_insert_file:\tFailed to read file");
-        return DISK_FAILURE;
-    }
-    // Calculate new size
-    u_int32_t new_size = file.size + length;
-    u_int32_t new_data_len = new_size - start_block * SIZE_BLOCK;
-    // Reallocate data
-    file.data = (char*)realloc(file.data, new_data_len);
-    if (file.data == NULL) {
-        print_err("u_insert_file:\tFailed to realloc data");
-        return -1;
-    }
-    // Shift data
-    u_int32_t pos_start = pos % SIZE_BLOCK;
-    u_int32_t pos_end = pos_start + length;
-    memmove(file.data + pos_end, file.data + pos_start, new_data_len - pos_end);
-    memcpy(file.data + pos_start, data, length);
-    // Update file
-    file.size = new_size;
-    res = write_file(user->vol, &file);
-    free(file.data);
-    if (res < 0) {
+    // Shift the data after the position, then write the inserted data
+    if (shift_file(user->vol, &inode, pos, length) < 0 || write_file_range(user->vol, &inode, pos, length, data) < 0) {
         print_err("u_insert_file:\tFailed to write file");
+        unlock_inode(user->vol, inode_idx);
         return DISK_FAILURE;
     }
+    unlock_inode(user->vol, inode_idx);
     return 0;
 }
 
@@ -731,97 +801,45 @@ int u_delete_file(User* user, char* filename, int pos, int length) {
         return TARGET_NOT_FOUND;
     }
     Inode inode;
-    inode.i_idx = entry->inode_idx;
+    int inode_idx = entry->inode_idx;
+    inode.i_idx = inode_idx;
+    lock_inode(user->vol, inode_idx, true);
     res = read_inode(user->vol, &inode);
     free_dir(&vuser.cur_dir);
     if (res < 0) {
         print_err("u_delete_file:\tFailed to read inode");
+        unlock_inode(user->vol, inode_idx);
         return DISK_FAILURE;
     }
     // Check premission
     bool user_prem = inode.i_uid == user->id && (inode.i_prem & USER_W) != 0;
     bool other_prem = inode.i_uid != user->id && (inode.i_prem & OTHER_W) != 0;
     if (user->id != 0 && !user_prem && !other_prem) {
+        unlock_inode(user->vol, inode_idx);
         return PERMISSION_DENIED;
     }
     // Check if it's a file
     if (inode.i_mode != INODE_FILE) {
         print_err("u_delete_file:\tNot a file");
+        unlock_inode(user->vol, inode_idx);
         return INVALID_PATH;
     }
-    // Calculate start block
+    // Check position
     if ((u_int32_t)pos >= inode.i_size) {
         print_err("u_delete_file:\tInvalid position");
+        unlock_inode(user->vol, inode_idx);
         return INVALID_POS;
     }
     if ((u_int32_t)pos + length > inode.i_size) {
         length = inode.i_size - pos;
     }
-    u_int32_t start_block = pos / SIZE_BLOCK;
-    // Calculate new size
-    u_int32_t new_size = inode.i_size - length;
-    u_int32_t new_data_len = new_size - start_block * SIZE_BLOCK;
-    u_int32_t pos_offset = pos % SIZE_BLOCK;
-    // Construct file
-    FileType file;
-    file.inodeptr = &inode;
-    file.start_block = start_block;
-    if (length < SIZE_BLOCK) {
-        // Read continous block
-        res = read_file(user->vol, &file);
-        if (res < 0) {
-            print_err("u_delete_file:\tFailed to read file");
-            return DISK_FAILURE;
-        }
-        // Shift data
-        u_int32_t end_offset = pos_offset + length;
-        u_int32_t end_len = inode.i_size - pos - length;
-        memmove(file.data + pos_offset, file.data + end_offset, end_len);
-    } else {
-        // Some hacky way to only read one block containing the pos
-        u_int32_t origin_size = inode.i_size;
-        u_int32_t hack_size = (start_block + 1) * SIZE_BLOCK;
-        u_int32_t origin_block = inode.i_blocks;
-        u_int32_t hack_block = start_block + 1;
-        inode.i_size = hack_size;
-        inode.i_blocks = hack_block;
-        res = read_file(user->vol, &file);
-        // Restore size
-        inode.i_size = origin_size;
-        inode.i_blocks = origin_block;
-        if (res < 0) {
-            print_err("u_delete_file:\tFailed to read file");
-            return DISK_FAILURE;
-        }
-        // Reallocate data
-        file.data = (char*)realloc(file.data, new_data_len);
-        if ((u_int32_t)length != origin_size - pos) {
-            // Read the content after deletion end
-            u_int32_t end_pos = pos + length;
-            u_int32_t end_block = end_pos / SIZE_BLOCK;
-            FileType end;
-            end.inodeptr = &inode;
-            end.start_block = end_block;
-            res = read_file(user->vol, &end);
-            if (res < 0) {
-                print_err("u_delete_file:\tFailed to read file");
-                return DISK_FAILURE;
-            }
-            // Shift data
-            u_int32_t end_offset = end_pos % SIZE_BLOCK;
-            u_int32_t end_len = origin_size - end_pos;
-            memcpy(file.data + pos_offset, end.data + end_offset, end_len);
-            free(end.data);
-        }
-    }
-    // Update file
-    file.size = new_size;
-    res = write_file(user->vol, &file);
-    free(file.data);
-    if (res < 0) {
+    // Shift the data after the deleted range onto it
+    if (shift_file(user->vol, &inode, pos + length, -length) < 0) {
         print_err("u_delete_file:\tFailed to write file");
+        unlock_inode(user->vol, inode_idx);
         return DISK_FAILURE;
     }
+    unlock_inode(user->vol, inode_idx);
     return 0;
 }
 